@@ -21,14 +21,14 @@
  */
 
 bool init_build_merkle( struct build_merkle_state *state,
-        const void *sk_seed, const void *pk_seed,
+        const struct private_key_seed *sk_seed, const void *pk_seed,
         hash_t hash, int tree_height,
         unsigned layer, uint_fast64_t tree,
         int target_node, unsigned char *auth_path,
         unsigned char *root) {
     state->sk_seed = sk_seed;
     state->pk_seed = pk_seed;
-    SHA256_set_first_block(&state->pk_seed_pre, pk_seed, hash_len(hash));
+    if (!init_sphincs_seed(&state->pk_seed_pre, hash, pk_seed)) return false;
     state->hash = hash;
     state->n = hash_len(hash);
     switch (hash_len( hash )) {
@@ -42,13 +42,172 @@ bool init_build_merkle( struct build_merkle_state *state,
     set_layer_address( state->adr, layer );
     set_tree_address( state->adr, tree );
     /* The rest of adr will be initialized later */
+
+    /* The only thing that changes in the ADR for the internal nodes is */
+    /* the height and the index, and so we set up the rest now */
+    memcpy( state->h_block, state->adr, ADR_CONST_FOR_TREE );
+    set_type( state->h_block, HASH_TREE_ADDRESS );
+    init_H_sha256_192( state->h_block );
+    init_thash_sha256_192( state->t_block, 24 * MAX_WOTS_DIGITS );
     state->auth_path = auth_path;
     state->root = root;
     state->current_node = 0;
+    state->nodes = NULL;
+    state->failed = false;
 
     return true;
 }
 
+/* The number of times we compute each hash (for the hash counts) */
+#define HASH_COPIES (1 + FAULT_DUP_LANES)
+
+#if SPEED_SETTING
+#define MERKLE_CHAINS_PER_ITER 1   /* generating 1 OTS public key takes */
+                               /* about as long as the LMS step with W=2 */
+#else
+#define MERKLE_CHAINS_PER_ITER 2   /* generating 2 OTS public keys takes */
+                               /* about as long as the LMS step with W=4 */
+#endif
+
+/*
+ * This computes the WOTS+ public keys (that is, the leaf values) of the
+ * count leaves starting at first_node, placing them in leaf
+ * All the WOTS+ chains of all the leaves are independent and of the same
+ * length, and so we run them in lockstep, count * 51 of them at a time;
+ * that gives the multi-lane hash engine enough to fill its lanes
+ * This returns the number of hash compression operations we did (with
+ * FAULT_DUP_LANES, it sets state->failed if it detects a fault)
+ */
+static int build_wots_leaves( struct build_merkle_state *state,
+                     const struct private_key_generator *gen,
+                     int first_node, int count,
+                     unsigned char (*leaf)[MAX_HASH_LEN] ) {
+    int n = state->n;
+    int digits = state->wots_digits;
+    int num_chains = count * digits;
+    int i, j, k;
+    int hc_done_so_far = 0;
+
+    /*
+     * Each chain has its own F message block (ADR || chain value ||
+     * padding); we step the chain value in place
+     */
+    unsigned char block[MERKLE_CHAINS_PER_ITER * MAX_WOTS_DIGITS]
+                       [F_SHA256_192_BLOCK_LEN];
+    const unsigned char *block_p[MERKLE_CHAINS_PER_ITER * MAX_WOTS_DIGITS];
+    const unsigned char *key_state[MERKLE_CHAINS_PER_ITER * MAX_WOTS_DIGITS];
+    unsigned char *value[MERKLE_CHAINS_PER_ITER * MAX_WOTS_DIGITS];
+
+    set_type( state->adr, WOTS_HASH_ADDRESS );
+    set_hash_address( state->adr, 0 );
+    init_F_sha256_192( block[0] );
+    for (k = 0; k < count; k++) {
+        set_key_pair_address( state->adr, first_node + k );
+        for (i = 0; i < digits; i++) {
+            unsigned char *b = block[k*digits + i];
+            if (b != block[0]) {
+                memcpy( b + LEN_ADR, block[0] + LEN_ADR,
+                        F_SHA256_192_BLOCK_LEN - LEN_ADR );
+            }
+            memcpy( b, state->adr, LEN_ADR );
+            set_chain_address( b, i );
+            block_p[k*digits + i] = b;
+            key_state[k*digits + i] = &b[LEN_ADR-16];
+            value[k*digits + i] = b + LEN_ADR;
+        }
+    }
+
+    /* Create the private WOTS+ keys (the bottoms of the chains) */
+    do_private_key_gen_many( value, n, gen, key_state, num_chains );
+
+    /* Now, advance them all to the top of the WOTS+ chains */
+    for (j=0; j<15; j++) {
+        for (i = 0; i < num_chains; i++) {
+            set_hash_address( block[i], j );
+        }
+#if FAULT_DUP_LANES
+        bool ok;
+        if (state->hash == HASH_SHA256_192) {
+            ok = do_F_sha256_192_many_dup( value, &state->pk_seed_pre,
+                                  block_p, num_chains );
+        } else {
+            ok = do_F_many_dup( value, state->hash, &state->pk_seed_pre,
+                       block_p, (const unsigned char *const *)value,
+                       num_chains );
+        }
+        if (!ok) {
+            state->failed = true;
+            return hc_done_so_far;
+        }
+#else
+        if (state->hash == HASH_SHA256_192) {
+            do_F_sha256_192_many( value, &state->pk_seed_pre, block_p,
+                                  num_chains );
+        } else {
+            do_F_many( value, state->hash, &state->pk_seed_pre, block_p,
+                       (const unsigned char *const *)value, num_chains );
+        }
+#endif
+    }
+        /* The number of hash compression operations we've done in the */
+        /* above loop */
+    hc_done_so_far += num_chains * (1 + HASH_COPIES * 15);
+
+    /* We've computing all the public WOTS digits */
+    /* Now, compress the hashes of each leaf into a single value */
+    uint32_t wots_buffer[MAX_HASH_LEN/4 * MAX_WOTS_DIGITS]; /* We gather */
+                             /* the tops of the WOTS+ chains here (or, */
+                             /* for SHA-256/192, in the T_l block) */
+    unsigned char *gather = (unsigned char *)wots_buffer;
+    if (state->hash == HASH_SHA256_192) gather = state->t_block + LEN_ADR;
+    set_type( state->adr, WOTS_KEY_COMPRESSION );
+    for (k = 0; k < count; k++) {
+        for (i = 0; i < digits; i++) {
+            memcpy( gather + n*i, value[k*digits + i], n );
+        }
+        set_key_pair_address( state->adr, first_node + k );
+#if FAULT_DUP_LANES
+        {
+            unsigned char *dest = leaf[k];
+            const unsigned char *adr = state->adr;
+            const uint32_t *in = wots_buffer;
+            const unsigned char *t_block = state->t_block;
+            bool ok;
+            if (state->hash == HASH_SHA256_192) {
+                memcpy( state->t_block, state->adr, LEN_ADR );
+                ok = do_thash_sha256_192_many_dup( &dest, &state->pk_seed_pre,
+                                  &t_block, n * digits, 1 );
+            } else {
+                ok = do_thash_many_dup( &dest, state->hash,
+                                  &state->pk_seed_pre, &adr, &in,
+                                  n * digits, 1 );
+            }
+            if (!ok) {
+                state->failed = true;
+                return hc_done_so_far;
+            }
+        }
+#else
+        if (state->hash == HASH_SHA256_192) {
+            memcpy( state->t_block, state->adr, LEN_ADR );
+            do_thash_sha256_192( leaf[k], &state->pk_seed_pre,
+                                 state->t_block, n * digits );
+        } else {
+            do_thash( leaf[k], state->hash, &state->pk_seed_pre, state->adr,
+                      wots_buffer, n * digits );
+        }
+#endif
+            /* The approximate number of hashes in the above t-hash */
+        hc_done_so_far += HASH_COPIES *
+                          ((n * digits) / 16 + 1 + (n * digits) / 32);
+    }
+
+    /* We don't need to zeroize block; we've stepped each chain in place */
+    /* all the way to the top, and so it holds only public values */
+
+    return hc_done_so_far;
+}
+
 /* 
  * This performs the next step in producing the authentication path and/or
  * the root 
@@ -61,76 +220,52 @@ bool step_build_merkle(struct build_merkle_state *state,
 
     int hc_done_so_far = 0; /* Count of the number of hash */
                             /* computations we've done */
-
-#if SPEED_SETTING
-#define MERKLE_CHAINS_PER_ITER 1   /* generating 1 OTS public key takes */
-                               /* about as long as the LMS step with W=2 */
-#else
-#define MERKLE_CHAINS_PER_ITER 2   /* generating 2 OTS public keys takes */
-                               /* about as long as the LMS step with W=4 */
-#endif
     int m;
     struct private_key_generator gen;
     bool all_done_flag = false;
 
-    for (m=0; m<MERKLE_CHAINS_PER_ITER; m++) {
-        int current_node = state->current_node;
-        if (current_node >= (1 << state->tree_height)) {
-            /* We're done */
-            all_done_flag = true;
-            break;
-        }
+    /* The leaves we'll compute this time */
+    int count = (1 << state->tree_height) - state->current_node;
+    if (count <= 0) {
+        /* We're done */
+        if (ret_hc) *ret_hc = 0;
+        return true;
+    }
+    if (count > MERKLE_CHAINS_PER_ITER) count = MERKLE_CHAINS_PER_ITER;
 
-        /* Fire up the engine that'll produce private WOTS keys */
-        init_private_key_gen( &gen, state->sk_seed, state->n, state->adr,
-                              ADR_CONST_FOR_TREE );
-        hc_done_so_far += 1; /* This does about 1 hash compression operation */
-    
-        /* Build a WOTS public key */
-        int i;
-        set_type( state->adr, WOTS_HASH_ADDRESS );
-        set_key_pair_address( state->adr, current_node );
+    /* Fire up the engine that'll produce private WOTS keys */
+    init_private_key_gen_from_seed( &gen, state->sk_seed, state->adr,
+                          ADR_CONST_FOR_TREE );
+    hc_done_so_far += 1; /* This does about 1 hash compression operation */
+
+    /* Build the WOTS public keys */
+    unsigned char leaf[MERKLE_CHAINS_PER_ITER][MAX_HASH_LEN];
+    hc_done_so_far += build_wots_leaves( state, &gen, state->current_node,
+                                         count, leaf );
+    zeroize( &gen, sizeof gen );  /* There's private data here */
+    if (state->failed) {
+        /* We miscomputed something; there's no point in going on */
+        if (ret_hc) *ret_hc = hc_done_so_far;
+        return true;
+    }
+
+    for (m=0; m<count; m++) {
+        int current_node = state->current_node;
         int n = state->n;
-    
-        uint32_t wots_buffer[MAX_HASH_LEN/4 * MAX_WOTS_DIGITS]; /* We store */
-                                 /* the tops of the WOTS+ chains here */
-        for (i = 0; i < 51; i++) {
-            set_chain_address( state->adr, i );
-    
-            /* Create the private WOTS+ key */
-            set_hash_address( state->adr, 0 );
-            void *digit = &wots_buffer[ (n/4)*i ];
-            do_private_key_gen( digit, n, &gen, &state->adr[LEN_ADR-16] );
-    
-            /* Now, advance it to the top of the WOTS+ chain */
-            int j;
-            for (j=0; j<15; j++) {
-                set_hash_address( state->adr, j );
-                do_F(digit, state->hash, &state->pk_seed_pre, state->adr,
-                                                                     digit);
-            }
-        }
-            /* The number of hash compression operations we've done in the */
-            /* above loop */
-        hc_done_so_far += 51 * (1 + 15);
-    
-        /* We've computing all the public WOTS digits */
-        /* Now, compress the hashes into a single value */
-        set_type( state->adr, WOTS_KEY_COMPRESSION );
-        set_key_pair_address( state->adr, current_node );
         unsigned char buffer[ MAX_HASH_LEN ];
-    
-        do_thash( buffer, state->hash, &state->pk_seed_pre, state->adr,
-                  wots_buffer, n * state->wots_digits );\
-            /* The approximate number of hashes in the above t-hash */
-        hc_done_so_far += (n * state->wots_digits) / 16 + 1 +
-                          (n * state->wots_digits) / 32;
-    
+        memcpy( buffer, leaf[m], n );
+
         /* We've put the full WOTS public key */
         /* Now, walk up the Merkle tree to combine it with previous computed */
         /* WOTS public keys */
         int h;
         for (h = 0;; h++) {
+            if (state->nodes) {
+                /* The caller wants the entire tree */
+                memcpy( state->nodes + n * MERKLE_NODE( state->tree_height,
+                                           h, current_node >> h ),
+                        buffer, n );
+            }
             if (state->auth_path) {
                 /* If this node is on the authentication path (that is, */
                 /* adjacent to the path from the root to the target node), */
@@ -143,12 +278,27 @@ bool step_build_merkle(struct build_merkle_state *state,
             if (current_node & (1<<h)) {
                 /* We're the right child at this node */
                 /* Combine it with the corresponding left child */
-                set_type(state->adr, HASH_TREE_ADDRESS);
-                set_tree_height(state->adr, h+1 );
-                set_tree_index(state->adr, current_node >> (h+1));
-                do_H(buffer, state->hash, &state->pk_seed_pre, state->adr,
-                     state->stack + h*n, buffer );
-                hc_done_so_far += 2;  /* a do_H does 2 hash compressios */
+                set_tree_height(state->h_block, h+1 );
+                set_tree_index(state->h_block, current_node >> (h+1));
+#if FAULT_DUP_LANES
+                if (!do_H_dup(buffer, state->hash, &state->pk_seed_pre,
+                              state->h_block, state->stack + h*n, buffer )) {
+                    state->failed = true;
+                    if (ret_hc) *ret_hc = hc_done_so_far;
+                    return true;
+                }
+#else
+                if (state->hash == HASH_SHA256_192) {
+                    do_H_sha256_192(buffer, &state->pk_seed_pre,
+                                    state->h_block, state->stack + h*n,
+                                    buffer );
+                } else {
+                    do_H(buffer, state->hash, &state->pk_seed_pre,
+                         state->h_block, state->stack + h*n, buffer );
+                }
+#endif
+                hc_done_so_far += 2 * HASH_COPIES;  /* a do_H does 2 */
+                                        /* hash compressios */
             } else {
                 if (h == state->tree_height) {
                     /* Actually, there is no node above us; we're at the top */
@@ -168,8 +318,6 @@ bool step_build_merkle(struct build_merkle_state *state,
         state->current_node += 1;
     }
 
-    zeroize( &gen, sizeof gen );  /* There's private data here */
-
     if (ret_hc) *ret_hc = hc_done_so_far;
     return all_done_flag;
 }
@@ -6,13 +6,15 @@
 #include "sphincs_hash.h"
 #include "adr.h"
 #include "sha256.h"
+#include "private_key_gen.h"
 
 #define MAX_WOTS_DIGITS 51   /* Need to move this somewhere else */
 #define MAX_XMSS_HEIGHT 8    /* The maximum height of a single XMSS tree */
 
 struct build_merkle_state {
-    const void *sk_seed, *pk_seed;
-    SHA256_FIRSTBLOCK pk_seed_pre;
+    const struct private_key_seed *sk_seed;
+    const void *pk_seed;
+    struct sphincs_seed pk_seed_pre;
 
     hash_t hash; int n;
     int wots_digits;         /* Number of digits we compute for each leaf */
@@ -20,19 +22,38 @@ struct build_merkle_state {
     int target_node;         /* If we're generating an authentication path */
                              /* then this is node the auth path is for */
     unsigned char adr[LEN_ADR];
+    unsigned char h_block[H_SHA256_192_BLOCK_LEN]; /* The ADR (and, for */
+                             /* SHA-256/192, the message block) we use to */
+                             /* combine the Merkle nodes */
+    unsigned char t_block[THASH_SHA256_192_BLOCK_LEN(24 * MAX_WOTS_DIGITS)];
+                             /* For SHA-256/192, the message block we */
+                             /* compress the WOTS+ public keys in */
     unsigned char *auth_path; /* Where to place the authentication path */
     unsigned char *root;     /* Where to place the computed root */
     int current_node;        /* Which XMSS leaf we're working on */
     unsigned char stack[MAX_HASH_LEN * MAX_XMSS_HEIGHT]; /* Stack used to */
                              /* compute the internal XMSS tree nodes */
+    unsigned char *nodes;    /* If non-NULL, we write every node of the */
+                             /* tree here (see MERKLE_NODE below); the */
+                             /* caller sets this after init_build_merkle */
+    bool failed;             /* With FAULT_DUP_LANES, set if the two */
+                             /* copies of some hash disagreed (and so the */
+                             /* root and auth path can't be trusted) */
 };
 
+/*
+ * Where node j at height h of a tree of height H goes within the nodes
+ * array (in units of the hash length); the root is first, and the leaves
+ * are last.  The array has (2 << H) - 1 entries
+ */
+#define MERKLE_NODE(H, h, j) ((1 << ((H) - (h))) - 1 + (j))
+
 /*
  * Initialize the computation of the Merkle tree, including where to
  * return the authentication path and the computed root
  */
 bool init_build_merkle( struct build_merkle_state *state,
-        const void *sk_seed, const void *pk_seed,
+        const struct private_key_seed *sk_seed, const void *pk_seed,
         hash_t hash, int tree_height,
         unsigned layer, uint_fast64_t tree,
         int target_node, unsigned char *auth_path,
@@ -40,7 +61,8 @@ bool init_build_merkle( struct build_merkle_state *state,
 
 /*
  * Perform the next step in the computation of the Merkle tree.  Returns
- * true when we have completed the computation.
+ * true when we have completed the computation (or when we detected a
+ * fault; the caller checks state->failed).
  * If ret_hc is non-NULL, the number of hash computations performed is
  * written there
  */
@@ -0,0 +1,171 @@
+/*
+ * This is the background build thread (BUILD_THREAD in tune.h)
+ *
+ * Once started, this thread does all the work of building the next LMS
+ * tree and Sphincs+ signature, and of computing the next bottom LMS
+ * subtree, that sh_sign otherwise does a slice of with each signature.
+ * That leaves sh_sign with just the LM-OTS signature, and copying out the
+ * rest.
+ *
+ * Who touches what:
+ * - The signing thread reads the current LMS tree and Sphincs+ signature,
+ *   and advances current_lms_index (which only it uses)
+ * - The build thread does all the build steps (and so owns the next LMS
+ *   tree and Sphincs+ signature, and all the build state, including
+ *   got_fatal_error); it also computes the next bottom subtree, in the
+ *   spare buffer (see offline.c, which keeps the same books)
+ * - The handoffs (moving to the next bottom subtree, and switching to the
+ *   next LMS tree) are done by the signing thread, holding the lock, once
+ *   the build thread has said it is done with what is being handed over
+ */
+#define _GNU_SOURCE     /* For pthread_attr_setaffinity_np */
+#include "sphincs-hybrid.h"
+#include "sh_signer.h"
+#include "tune.h"
+
+#if BUILD_THREAD
+#include <pthread.h>
+#include <sched.h>
+
+static void *build_thread( void *arg ) {
+    struct sh_signer *signer = arg;
+
+    pthread_mutex_lock( &signer->bg.lock );
+    while (!signer->bg.stop) {
+        /* The next bottom subtree comes first; the signer will need it */
+        /* sooner than the next LMS tree */
+        if (can_refresh( signer )) {
+            merkle_index_t index = signer->defer.refresh_index;
+            unsigned char *spare = signer->defer.spare_lms_bottom_subtree;
+            pthread_mutex_unlock( &signer->bg.lock );
+            refresh_lms_bottom( signer, index, spare );
+            pthread_mutex_lock( &signer->bg.lock );
+            signer->defer.refresh_index = index + 1;
+            pthread_cond_signal( &signer->bg.ready );
+            continue;
+        }
+
+        /* Then, the next LMS tree and Sphincs+ signature */
+        if (!signer->defer.next_ready && !signer->bg.failed) {
+            pthread_mutex_unlock( &signer->bg.lock );
+            /* Nobody's waiting on the individual steps; no reason to */
+            /* even out their cost */
+            (void)step_next( signer, false );
+            bool failed = signer->got_fatal_error;
+            bool done = signer->build_state == b_done;
+            pthread_mutex_lock( &signer->bg.lock );
+            if (failed) {
+                signer->bg.failed = true;
+                pthread_cond_signal( &signer->bg.ready );
+            } else if (done) {
+                /* We stop here; the signer does the switch once it */
+                /* has used up the current LMS tree */
+                signer->defer.next_ready = true;
+                pthread_cond_signal( &signer->bg.ready );
+            }
+            continue;
+        }
+
+        /* Nothing to do until the signer catches up */
+        pthread_cond_wait( &signer->bg.work, &signer->bg.lock );
+    }
+    pthread_mutex_unlock( &signer->bg.lock );
+    return 0;
+}
+
+bool build_thread_wait( struct sh_signer *signer, bool wait ) {
+    bool ok;
+
+    pthread_mutex_lock( &signer->bg.lock );
+    for (;;) {
+        if (signer->bg.failed) {
+            ok = false;
+            break;
+        }
+        merkle_index_t bottom_subtree = signer->defer.bottom_subtree;
+        ok = deferred_handoff( signer );
+        if (bottom_subtree != signer->defer.bottom_subtree) {
+            /* We've moved to a new bottom subtree (possibly in the next */
+            /* LMS tree); the thread has something new to work on */
+            pthread_cond_signal( &signer->bg.work );
+        }
+        if (ok || !wait) break;
+
+        /* The build thread is behind; wait for it */
+        pthread_cond_wait( &signer->bg.ready, &signer->bg.lock );
+    }
+    pthread_mutex_unlock( &signer->bg.lock );
+    return ok;
+}
+
+void build_thread_stop( struct sh_signer *signer ) {
+    if (!signer->bg.running) return;
+
+    pthread_mutex_lock( &signer->bg.lock );
+    signer->bg.stop = true;
+    pthread_cond_signal( &signer->bg.work );
+    pthread_mutex_unlock( &signer->bg.lock );
+    pthread_join( signer->bg.thread, 0 );
+
+    pthread_cond_destroy( &signer->bg.ready );
+    pthread_cond_destroy( &signer->bg.work );
+    pthread_mutex_destroy( &signer->bg.lock );
+    signer->bg.running = false;
+}
+#endif
+
+bool sh_start_build_thread( struct sh_signer *signer, int cpu ) {
+#if BUILD_THREAD
+    if (!signer || !signer->initialized || signer->got_fatal_error ||
+        signer->bg.running) {
+        return false;
+    }
+
+    /* The thread picks up from wherever sh_sign (or sh_do_offline_work) */
+    /* got to */
+    if (!signer->defer.active) start_deferred( signer );
+    signer->bg.stop = false;
+    signer->bg.failed = false;
+
+    pthread_attr_t attr;
+    if (0 != pthread_attr_init( &attr )) return false;
+    bool ok = true;
+    if (cpu >= 0) {
+#if defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO( &cpus );
+        CPU_SET( cpu, &cpus );
+        ok = 0 == pthread_attr_setaffinity_np( &attr, sizeof cpus, &cpus );
+#else
+        ok = false;     /* We don't know how to pin threads here */
+#endif
+    }
+    if (ok) {
+        ok = 0 == pthread_mutex_init( &signer->bg.lock, 0 );
+    }
+    if (ok && 0 != pthread_cond_init( &signer->bg.work, 0 )) {
+        pthread_mutex_destroy( &signer->bg.lock );
+        ok = false;
+    }
+    if (ok && 0 != pthread_cond_init( &signer->bg.ready, 0 )) {
+        pthread_cond_destroy( &signer->bg.work );
+        pthread_mutex_destroy( &signer->bg.lock );
+        ok = false;
+    }
+    if (ok && 0 != pthread_create( &signer->bg.thread, &attr,
+                                   build_thread, signer )) {
+        /* This is also where we end up if we can't run on that CPU */
+        pthread_cond_destroy( &signer->bg.ready );
+        pthread_cond_destroy( &signer->bg.work );
+        pthread_mutex_destroy( &signer->bg.lock );
+        ok = false;
+    }
+    pthread_attr_destroy( &attr );
+
+    signer->bg.running = ok;
+    return ok;
+#else
+    (void)signer; (void)cpu;
+    return false;       /* Not compiled in */
+#endif
+}
@@ -0,0 +1,98 @@
+/*
+ * Test for the background build thread (BUILD_THREAD)
+ *
+ * We start the build thread, and sign (and verify) with sh_sign until
+ * we've moved on to the next LMS tree; that covers the handoffs from the
+ * thread to the signer (both of the bottom subtrees, and of the next LMS
+ * tree).  Then we sign online until we've run ahead of the thread, and
+ * check that sh_sign_online fails (rather than waiting for it) and that
+ * sh_sign then waits.  Then we delete the signer while the thread is busy
+ * building the tree after that.  We also delete a signer whose thread has
+ * only just started
+ *
+ * This needs to be built with BUILD_THREAD set; 'make build_thread_test'
+ * builds and runs it
+ */
+#include "sphincs-hybrid.h"
+#include "tune.h"
+#include "test_common.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+#if !BUILD_THREAD
+#error Build this with BUILD_THREAD set
+#endif
+
+int main(void) {
+    /* Delete a signer whose thread has only just started */
+    struct sh_signer *sign = test_load_signer();
+    if (!sign) return 1;
+    if (!sh_start_build_thread( sign, -1 )) {
+        printf( "Couldn't start the build thread\n" );
+        return 1;
+    }
+    sh_delete_signer( sign );
+    printf( "Deleted a signer with a freshly started thread\n" );
+
+    /* Now sign with the thread doing the build work */
+    sign = test_load_signer();
+    if (!sign) return 1;
+    if (!sh_start_build_thread( sign, -1 )) {
+        printf( "Couldn't start the build thread\n" );
+        return 1;
+    }
+    if (sh_start_build_thread( sign, -1 )) {
+        printf( "Started a second build thread\n" );
+        return 1;
+    }
+    if (sh_do_offline_work( sign, 1000, SH_WORK_HASHES )) {
+        printf( "Offline work ran alongside the build thread\n" );
+        return 1;
+    }
+
+    struct leaf_tracker track = { 0 };
+    unsigned long count, extra = 0;
+    for (count = 0; extra < EXTRA_SIGS; count++) {
+        if (count == MAX_SIGS) {
+            printf( "Never switched LMS trees\n" );
+            return 1;
+        }
+        if (!test_sign( sign, count, false )) {
+            printf( "Signature %lu failed\n", count );
+            return 1;
+        }
+        if (!track_leaf( &track )) return 1;
+        if (track.switched) extra++;
+    }
+    printf( "Signed and verified %lu signatures, across one LMS tree "
+            "switch\n", count );
+
+    /* The thread has to build an entire LMS tree before we can get */
+    /* through this one; if we sign online as fast as we can, we'll run */
+    /* out of signatures before it's done, and sh_sign_online should then */
+    /* fail rather than wait for it (we don't verify these; that would */
+    /* slow us down enough to let the thread keep up) */
+    unsigned long online;
+    for (online = 0;; online++, count++) {
+        if (online == MAX_SIGS) {
+            printf( "sh_sign_online never got ahead of the thread\n" );
+            return 1;
+        }
+        if (!sh_sign_online( sig, sizeof sig, sign, "Online", 6 )) break;
+        if (!track_leaf( &track )) return 1;
+    }
+    /* sh_sign waits for the thread instead */
+    if (!test_sign( sign, count, false )) {
+        printf( "sh_sign failed after sh_sign_online ran out\n" );
+        return 1;
+    }
+    printf( "sh_sign_online failed after %lu signatures, rather than "
+            "waiting\n", online );
+
+    /* The thread is busy building the next LMS tree; stop it mid-build */
+    sh_delete_signer( sign );
+    printf( "Deleted the signer while its thread was building\n" );
+
+    printf( "Passed\n" );
+    return 0;
+}
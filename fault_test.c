@@ -0,0 +1,124 @@
+/*
+ * Fault injection test for the fault protection (FAULT_STRATEGY)
+ *
+ * This corrupts one result while we load a key, and checks that we
+ * noticed: with FAULT_STRATEGY 1, the loaded signer must refuse to sign;
+ * with FAULT_STRATEGY 2, it must have recovered, and produce the same
+ * signature as a signer that never saw the fault.  We try it at a fault
+ * near the start of the load (in the FORS trees), one in the middle, and
+ * one at the very end (in the top Merkle tree of the hypertree)
+ *
+ * What we corrupt depends on FAULT_LANES: with it set, the result in one
+ * lane of a duplicated hash computation; without it, one of the roots we
+ * compare once the parallel load has built each tree twice (and so that
+ * needs LOAD_THREADS > 1)
+ *
+ * This needs to be built with FAULT_INJECTION and FAULT_STRATEGY set;
+ * 'make fault_test' builds and runs it for both strategies, both with
+ * duplicated lanes, and with recomputed trees on several threads
+ */
+#include "sphincs-hybrid.h"
+#include "sphincs_hash.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#if !FAULT_INJECTION || !FAULT_STRATEGY
+#error Build this with FAULT_INJECTION and FAULT_STRATEGY set
+#endif
+#if FAULT_DUP_LANES
+#define FAULT_POINT "hash batch"
+#elif LOAD_THREADS > 1
+#define FAULT_POINT "root comparison"
+#else
+#error Without FAULT_LANES, the hook is in the parallel load; set LOAD_THREADS
+#endif
+
+static bool do_rand( void *buffer, size_t len_buffer ) {
+    unsigned char *p = buffer;
+    int i;
+    for (i=0; i<len_buffer; i++) *p++ = i;
+    return true;
+}
+
+static unsigned char sk_buffer[1024];
+static unsigned char pk_buffer[1024];
+static unsigned char ref_sig[LEN_SIG_192_FAST];
+static unsigned char sig[LEN_SIG_192_FAST];
+
+/*
+ * Load the key with a fault injected at the countdown'th point the hook
+ * is called (batch of duplicated hashes, or root comparison), and check
+ * what happens.  Returns true on success
+ */
+static bool test_fault( long countdown, long total ) {
+    printf( "Fault in " FAULT_POINT " %ld of %ld: ", countdown, total );
+    fault_injection_countdown = countdown;
+    struct sh_signer *sign = sh_load_signer( sk_buffer, do_rand );
+    if (!sign) { printf( "load failed\n" ); return false; }
+    if (fault_injection_countdown != 0) {
+        printf( "fault not injected\n" );
+        sh_delete_signer( sign );
+        return false;
+    }
+
+    bool signed_ok = sh_sign( sig, sizeof sig, sign, "Hello", 5 );
+    sh_delete_signer( sign );
+
+#if FAULT_STRATEGY == 2
+    /* We should have recomputed our way past the fault */
+    if (!signed_ok) { printf( "not recovered (signer failed)\n" ); return false; }
+    if (0 != memcmp( sig, ref_sig, sizeof sig )) {
+        printf( "not recovered (wrong signature)\n" );
+        return false;
+    }
+    if (!sh_verify( "Hello", 5, sig, sizeof sig, pk_buffer )) {
+        printf( "not recovered (signature didn't verify)\n" );
+        return false;
+    }
+    printf( "detected and recovered\n" );
+#else
+    /* We should have gone into the error state */
+    if (signed_ok) { printf( "not detected\n" ); return false; }
+    printf( "detected\n" );
+#endif
+    return true;
+}
+
+int main(void) {
+    size_t len_sk, len_pk;
+    bool flag =  sh_keygen( 1, 192, 1, do_rand,
+                    sk_buffer, sizeof sk_buffer, &len_sk,
+                    pk_buffer, sizeof pk_buffer, &len_pk);
+    if (!flag) { printf( "Keygen failed\n" ); return 1; }
+
+    /*
+     * Do a clean load first; this gives us the signature we expect, and
+     * (as the countdown never reaches zero) the number of times a load
+     * calls the hook
+     */
+    fault_injection_countdown = LONG_MAX;
+    struct sh_signer *sign = sh_load_signer( sk_buffer, do_rand );
+    long total = LONG_MAX - fault_injection_countdown;
+    fault_injection_countdown = 0;
+    if (!sign) { printf( "Loading signer failed\n" ); return 1; }
+    if (!sh_sign( ref_sig, sizeof ref_sig, sign, "Hello", 5 )) {
+        printf( "Signature failed\n" );
+        return 1;
+    }
+    sh_delete_signer( sign );
+    if (!sh_verify( "Hello", 5, ref_sig, sizeof ref_sig, pk_buffer )) {
+        printf( "Verify failed\n" );
+        return 1;
+    }
+
+    printf( "FAULT_STRATEGY %d, FAULT_LANES %d, LOAD_THREADS %d\n",
+            FAULT_STRATEGY, FAULT_LANES, LOAD_THREADS );
+    bool ok = test_fault( 1, total );
+    ok = test_fault( total / 2, total ) && ok;
+    ok = test_fault( total, total ) && ok;
+
+    printf( "%s\n", ok ? "Passed" : "FAILED" );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,368 @@
+/*
+ * Haraka v2
+ *
+ * This is the Haraka-512 permutation (and the Haraka-S sponge built on
+ * it), as used by Sphincs+.  We have two versions of the permutation: one
+ * that uses the x86 AES-NI instructions, and a portable one (which we use
+ * on CPUs without AES-NI); we pick at runtime
+ *
+ * Note that the portable version uses table lookups (for the AES S-box),
+ * and so is not constant time.  Signing runs the permutation on secret
+ * values (the WOTS+ and FORS chains), and so we use the portable version
+ * only to verify; sh_keygen and sh_load_signer refuse Haraka keys on CPUs
+ * without AES-NI (see haraka_constant_time)
+ */
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "haraka.h"
+#include "zeroize.h"
+
+#if !defined( HARAKA_AESNI )
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HARAKA_AESNI 1   /* We can use AES-NI (if the CPU has it) */
+#else
+#define HARAKA_AESNI 0
+#endif
+#endif
+#if HARAKA_AESNI
+#include <immintrin.h>
+#endif
+
+#define HARAKA_RATE 32   /* Haraka-S absorbs/squeezes 32 bytes per block */
+
+/* The standard Haraka v2 round constants */
+static const unsigned char haraka_rc_default[HARAKA_NUM_RC][16] = {
+    { 0x9d, 0x7b, 0x81, 0x75, 0xf0, 0xfe, 0xc5, 0xb2,
+      0x0a, 0xc0, 0x20, 0xe6, 0x4c, 0x70, 0x84, 0x06 },
+    { 0x17, 0xf7, 0x08, 0x2f, 0xa4, 0x6b, 0x0f, 0x64,
+      0x6b, 0xa0, 0xf3, 0x88, 0xe1, 0xb4, 0x66, 0x8b },
+    { 0x14, 0x91, 0x02, 0x9f, 0x60, 0x9d, 0x02, 0xcf,
+      0x98, 0x84, 0xf2, 0x53, 0x2d, 0xde, 0x02, 0x34 },
+    { 0x79, 0x4f, 0x5b, 0xfd, 0xaf, 0xbc, 0xf3, 0xbb,
+      0x08, 0x4f, 0x7b, 0x2e, 0xe6, 0xea, 0xd6, 0x0e },
+    { 0x44, 0x70, 0x39, 0xbe, 0x1c, 0xcd, 0xee, 0x79,
+      0x8b, 0x44, 0x72, 0x48, 0xcb, 0xb0, 0xcf, 0xcb },
+    { 0x7b, 0x05, 0x8a, 0x2b, 0xed, 0x35, 0x53, 0x8d,
+      0xb7, 0x32, 0x90, 0x6e, 0xee, 0xcd, 0xea, 0x7e },
+    { 0x1b, 0xef, 0x4f, 0xda, 0x61, 0x27, 0x41, 0xe2,
+      0xd0, 0x7c, 0x2e, 0x5e, 0x43, 0x8f, 0xc2, 0x67 },
+    { 0x3b, 0x0b, 0xc7, 0x1f, 0xe2, 0xfd, 0x5f, 0x67,
+      0x07, 0xcc, 0xca, 0xaf, 0xb0, 0xd9, 0x24, 0x29 },
+    { 0xee, 0x65, 0xd4, 0xb9, 0xca, 0x8f, 0xdb, 0xec,
+      0xe9, 0x7f, 0x86, 0xe6, 0xf1, 0x63, 0x4d, 0xab },
+    { 0x33, 0x7e, 0x03, 0xad, 0x4f, 0x40, 0x2a, 0x5b,
+      0x64, 0xcd, 0xb7, 0xd4, 0x84, 0xbf, 0x30, 0x1c },
+    { 0x00, 0x98, 0xf6, 0x8d, 0x2e, 0x8b, 0x02, 0x69,
+      0xbf, 0x23, 0x17, 0x94, 0xb9, 0x0b, 0xcc, 0xb2 },
+    { 0x8a, 0x2d, 0x9d, 0x5c, 0xc8, 0x9e, 0xaa, 0x4a,
+      0x72, 0x55, 0x6f, 0xde, 0xa6, 0x78, 0x04, 0xfa },
+    { 0xd4, 0x9f, 0x12, 0x29, 0x2e, 0x4f, 0xfa, 0x0e,
+      0x12, 0x2a, 0x77, 0x6b, 0x2b, 0x9f, 0xb4, 0xdf },
+    { 0xee, 0x12, 0x6a, 0xbb, 0xae, 0x11, 0xd6, 0x32,
+      0x36, 0xa2, 0x49, 0xf4, 0x44, 0x03, 0xa1, 0x1e },
+    { 0xa6, 0xec, 0xa8, 0x9c, 0xc9, 0x00, 0x96, 0x5f,
+      0x84, 0x00, 0x05, 0x4b, 0x88, 0x49, 0x04, 0xaf },
+    { 0xec, 0x93, 0xe5, 0x27, 0xe3, 0xc7, 0xa2, 0x78,
+      0x4f, 0x9c, 0x19, 0x9d, 0xd8, 0x5e, 0x02, 0x21 },
+    { 0x73, 0x01, 0xd4, 0x82, 0xcd, 0x2e, 0x28, 0xb9,
+      0xb7, 0xc9, 0x59, 0xa7, 0xf8, 0xaa, 0x3a, 0xbf },
+    { 0x6b, 0x7d, 0x30, 0x10, 0xd9, 0xef, 0xf2, 0x37,
+      0x17, 0xb0, 0x86, 0x61, 0x0d, 0x70, 0x60, 0x62 },
+    { 0xc6, 0x9a, 0xfc, 0xf6, 0x53, 0x91, 0xc2, 0x81,
+      0x43, 0x04, 0x30, 0x21, 0xc2, 0x45, 0xca, 0x5a },
+    { 0x3a, 0x94, 0xd1, 0x36, 0xe8, 0x92, 0xaf, 0x2c,
+      0xbb, 0x68, 0x6b, 0x22, 0x3c, 0x97, 0x23, 0x92 },
+    { 0xb4, 0x71, 0x10, 0xe5, 0x58, 0xb9, 0xba, 0x6c,
+      0xeb, 0x86, 0x58, 0x22, 0x38, 0x92, 0xbf, 0xd3 },
+    { 0x8d, 0x12, 0xe1, 0x24, 0xdd, 0xfd, 0x3d, 0x93,
+      0x77, 0xc6, 0xf0, 0xae, 0xe5, 0x3c, 0x86, 0xdb },
+    { 0xb1, 0x12, 0x22, 0xcb, 0xe3, 0x8d, 0xe4, 0x83,
+      0x9c, 0xa0, 0xeb, 0xff, 0x68, 0x62, 0x60, 0xbb },
+    { 0x7d, 0xf7, 0x2b, 0xc7, 0x4e, 0x1a, 0xb9, 0x2d,
+      0x9c, 0xd1, 0xe4, 0xe2, 0xdc, 0xd3, 0x4b, 0x73 },
+    { 0x4e, 0x92, 0xb3, 0x2c, 0xc4, 0x15, 0x14, 0x4b,
+      0x43, 0x1b, 0x30, 0x61, 0xc3, 0x47, 0xbb, 0x43 },
+    { 0x99, 0x68, 0xeb, 0x16, 0xdd, 0x31, 0xb2, 0x03,
+      0xf6, 0xef, 0x07, 0xe7, 0xa8, 0x75, 0xa7, 0xdb },
+    { 0x2c, 0x47, 0xca, 0x7e, 0x02, 0x23, 0x5e, 0x8e,
+      0x77, 0x59, 0x75, 0x3c, 0x4b, 0x61, 0xf3, 0x6d },
+    { 0xf9, 0x17, 0x86, 0xb8, 0xb9, 0xe5, 0x1b, 0x6d,
+      0x77, 0x7d, 0xde, 0xd6, 0x17, 0x5a, 0xa7, 0xcd },
+    { 0x5d, 0xee, 0x46, 0xa9, 0x9d, 0x06, 0x6c, 0x9d,
+      0xaa, 0xe9, 0xa8, 0x6b, 0xf0, 0x43, 0x6b, 0xec },
+    { 0xc1, 0x27, 0xf3, 0x3b, 0x59, 0x11, 0x53, 0xa2,
+      0x2b, 0x33, 0x57, 0xf9, 0x50, 0x69, 0x1e, 0xcb },
+    { 0xd9, 0xd0, 0x0e, 0x60, 0x53, 0x03, 0xed, 0xe4,
+      0x9c, 0x61, 0xda, 0x00, 0x75, 0x0c, 0xee, 0x2c },
+    { 0x50, 0xa3, 0xa4, 0x63, 0xbc, 0xba, 0xbb, 0x80,
+      0xab, 0x0c, 0xe9, 0x96, 0xa1, 0xa5, 0xb1, 0xf0 },
+    { 0x39, 0xca, 0x8d, 0x93, 0x30, 0xde, 0x0d, 0xab,
+      0x88, 0x29, 0x96, 0x5e, 0x02, 0xb1, 0x3d, 0xae },
+    { 0x42, 0xb4, 0x75, 0x2e, 0xa8, 0xf3, 0x14, 0x88,
+      0x0b, 0xa4, 0x54, 0xd5, 0x38, 0x8f, 0xbb, 0x17 },
+    { 0xf6, 0x16, 0x0a, 0x36, 0x79, 0xb7, 0xb6, 0xae,
+      0xd7, 0x7f, 0x42, 0x5f, 0x5b, 0x8a, 0xbb, 0x34 },
+    { 0xde, 0xaf, 0xba, 0xff, 0x18, 0x59, 0xce, 0x43,
+      0x38, 0x54, 0xe5, 0xcb, 0x41, 0x52, 0xf6, 0x26 },
+    { 0x78, 0xc9, 0x9e, 0x83, 0xf7, 0x9c, 0xca, 0xa2,
+      0x6a, 0x02, 0xf3, 0xb9, 0x54, 0x9a, 0xe9, 0x4c },
+    { 0x35, 0x12, 0x90, 0x22, 0x28, 0x6e, 0xc0, 0x40,
+      0xbe, 0xf7, 0xdf, 0x1b, 0x1a, 0xa5, 0x51, 0xae },
+    { 0xcf, 0x59, 0xa6, 0x48, 0x0f, 0xbc, 0x73, 0xc1,
+      0x2b, 0xd2, 0x7e, 0xba, 0x3c, 0x61, 0xc1, 0xa0 },
+    { 0xa1, 0x9d, 0xc5, 0xe9, 0xfd, 0xbd, 0xd6, 0x4a,
+      0x88, 0x82, 0x28, 0x02, 0x03, 0xcc, 0x6a, 0x75 },
+};
+
+/*
+ * The portable version
+ */
+static const unsigned char sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
+    0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26,
+    0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+    0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed,
+    0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f,
+    0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec,
+    0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14,
+    0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+    0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f,
+    0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+    0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f,
+    0xb0, 0x54, 0xbb, 0x16
+};
+
+/* Multiply by x in GF(2**8) */
+static unsigned char xtime( unsigned char x ) {
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+/*
+ * One AES round (SubBytes, ShiftRows, MixColumns, AddRoundKey); this is
+ * what the aesenc instruction does
+ */
+static void aes_round( unsigned char *s, const unsigned char *rk ) {
+    unsigned char t[16];
+    int c;
+
+    /* SubBytes and ShiftRows (byte 4*c+r is row r, column c) */
+    for (c = 0; c < 4; c++) {
+        t[4*c+0] = sbox[ s[4*c+0] ];
+        t[4*c+1] = sbox[ s[(4*c+5) & 15] ];
+        t[4*c+2] = sbox[ s[(4*c+10) & 15] ];
+        t[4*c+3] = sbox[ s[(4*c+15) & 15] ];
+    }
+
+    /* MixColumns and AddRoundKey */
+    for (c = 0; c < 4; c++) {
+        unsigned char a0 = t[4*c+0], a1 = t[4*c+1];
+        unsigned char a2 = t[4*c+2], a3 = t[4*c+3];
+        unsigned char all = a0 ^ a1 ^ a2 ^ a3;
+        s[4*c+0] = a0 ^ all ^ xtime(a0 ^ a1) ^ rk[4*c+0];
+        s[4*c+1] = a1 ^ all ^ xtime(a1 ^ a2) ^ rk[4*c+1];
+        s[4*c+2] = a2 ^ all ^ xtime(a2 ^ a3) ^ rk[4*c+2];
+        s[4*c+3] = a3 ^ all ^ xtime(a3 ^ a0) ^ rk[4*c+3];
+    }
+}
+
+/*
+ * The Haraka-512 permutation (on a 64 byte state, in place), portable
+ * version
+ * Each of the 5 rounds does two AES rounds on each 16 byte quarter of the
+ * state, and then MIX4 (which shuffles the 32 bit words between the
+ * quarters)
+ */
+static void haraka512_perm_portable( unsigned char *s,
+                                     const unsigned char (*rc)[16] ) {
+    unsigned char t[64];
+    int round, i;
+
+    for (round = 0; round < 5; round++) {
+        for (i = 0; i < 4; i++) {
+            aes_round( s + 16*i, rc[8*round + i] );
+        }
+        for (i = 0; i < 4; i++) {
+            aes_round( s + 16*i, rc[8*round + 4 + i] );
+        }
+
+        /* MIX4; word w of quarter q is at s + 16*q + 4*w */
+        static const unsigned char mix[16] = {
+             3, 11,  7, 15,  8,  0, 12,  4,  9,  1, 13,  5,  2, 10,  6, 14
+        };
+        for (i = 0; i < 16; i++) {
+            memcpy( t + 4*i, s + 4*mix[i], 4 );
+        }
+        memcpy( s, t, 64 );
+    }
+    zeroize( t, sizeof t );
+}
+
+#if HARAKA_AESNI
+/* The same permutation, using AES-NI */
+static __attribute__((target("aes")))
+void haraka512_perm_aesni( unsigned char *p,
+                           const unsigned char (*rc)[16] ) {
+    __m128i s0, s1, s2, s3, tmp;
+    int round;
+
+    s0 = _mm_loadu_si128( (const __m128i *)(p +  0) );
+    s1 = _mm_loadu_si128( (const __m128i *)(p + 16) );
+    s2 = _mm_loadu_si128( (const __m128i *)(p + 32) );
+    s3 = _mm_loadu_si128( (const __m128i *)(p + 48) );
+
+#define RC(i) _mm_loadu_si128( (const __m128i *)rc[i] )
+    for (round = 0; round < 5; round++) {
+        int k = 8*round;
+        s0 = _mm_aesenc_si128( s0, RC(k+0) );
+        s1 = _mm_aesenc_si128( s1, RC(k+1) );
+        s2 = _mm_aesenc_si128( s2, RC(k+2) );
+        s3 = _mm_aesenc_si128( s3, RC(k+3) );
+        s0 = _mm_aesenc_si128( s0, RC(k+4) );
+        s1 = _mm_aesenc_si128( s1, RC(k+5) );
+        s2 = _mm_aesenc_si128( s2, RC(k+6) );
+        s3 = _mm_aesenc_si128( s3, RC(k+7) );
+
+        /* MIX4 */
+        tmp = _mm_unpacklo_epi32( s0, s1 );
+        s0  = _mm_unpackhi_epi32( s0, s1 );
+        s1  = _mm_unpacklo_epi32( s2, s3 );
+        s2  = _mm_unpackhi_epi32( s2, s3 );
+        s3  = _mm_unpacklo_epi32( s0, s2 );
+        s0  = _mm_unpackhi_epi32( s0, s2 );
+        s2  = _mm_unpackhi_epi32( s1, tmp );
+        s1  = _mm_unpacklo_epi32( s1, tmp );
+    }
+#undef RC
+
+    _mm_storeu_si128( (__m128i *)(p +  0), s0 );
+    _mm_storeu_si128( (__m128i *)(p + 16), s1 );
+    _mm_storeu_si128( (__m128i *)(p + 32), s2 );
+    _mm_storeu_si128( (__m128i *)(p + 48), s3 );
+}
+#endif
+
+/*
+ * The permutation we actually call; the first time anyone needs it, we
+ * check whether the CPU has AES-NI (pthread_once makes sure that happens
+ * exactly once, and that every thread sees the result)
+ */
+static void (*haraka512_perm)( unsigned char *,
+                               const unsigned char (*)[16] );
+static bool haraka_have_aesni;
+static pthread_once_t haraka_once = PTHREAD_ONCE_INIT;
+
+static void haraka_select( void ) {
+    haraka512_perm = haraka512_perm_portable;
+    haraka_have_aesni = false;
+#if HARAKA_AESNI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports( "aes" )) {
+        haraka512_perm = haraka512_perm_aesni;
+        haraka_have_aesni = true;
+    }
+#endif
+}
+
+bool haraka_constant_time( void ) {
+    pthread_once( &haraka_once, haraka_select );
+    return haraka_have_aesni;
+}
+
+void haraka512( unsigned char *out, const unsigned char *in,
+                const struct haraka_ctx *ctx ) {
+    unsigned char s[64];
+    int i;
+
+    pthread_once( &haraka_once, haraka_select );
+    memcpy( s, in, 64 );
+    haraka512_perm( s, ctx->rc );
+    for (i = 0; i < 64; i++) s[i] ^= in[i];
+
+    /* The output is the truncation of the 64 byte result */
+    memcpy( out +  0, s +  8, 8 );
+    memcpy( out +  8, s + 24, 8 );
+    memcpy( out + 16, s + 32, 8 );
+    memcpy( out + 24, s + 48, 8 );
+    zeroize( s, sizeof s );
+}
+
+/*
+ * Haraka-S
+ */
+void haraka_S_init( struct haraka_S_state *state ) {
+    memset( state->s, 0, sizeof state->s );
+    state->pos = 0;
+}
+
+void haraka_S_absorb( struct haraka_S_state *state,
+                      const void *in, size_t len,
+                      const struct haraka_ctx *ctx ) {
+    const unsigned char *p = in;
+    while (len > 0) {
+        unsigned i, this_len = HARAKA_RATE - state->pos;
+        if (this_len > len) this_len = len;
+        for (i = 0; i < this_len; i++) {
+            state->s[state->pos + i] ^= p[i];
+        }
+        state->pos += this_len;
+        p += this_len;
+        len -= this_len;
+        if (state->pos == HARAKA_RATE) {
+            haraka512_perm( state->s, ctx->rc );
+            state->pos = 0;
+        }
+    }
+}
+
+void haraka_S_squeeze( unsigned char *out, size_t len,
+                       struct haraka_S_state *state,
+                       const struct haraka_ctx *ctx ) {
+    /* Pad the last block */
+    state->s[state->pos] ^= 0x1f;
+    state->s[HARAKA_RATE - 1] ^= 0x80;
+
+    while (len > 0) {
+        size_t this_len = (len < HARAKA_RATE) ? len : HARAKA_RATE;
+        haraka512_perm( state->s, ctx->rc );
+        memcpy( out, state->s, this_len );
+        out += this_len;
+        len -= this_len;
+    }
+    zeroize( state, sizeof *state );
+}
+
+void haraka_S( unsigned char *out, size_t out_len,
+               const void *in, size_t in_len,
+               const struct haraka_ctx *ctx ) {
+    struct haraka_S_state state;
+    haraka_S_init( &state );
+    haraka_S_absorb( &state, in, in_len, ctx );
+    haraka_S_squeeze( out, out_len, &state, ctx );
+}
+
+/*
+ * This is the Sphincs+ tweak_constants; the constants we use are the
+ * output of Haraka-S (using the standard constants) on PK.seed
+ */
+void haraka_init_standard_ctx( struct haraka_ctx *ctx ) {
+    memcpy( ctx->rc, haraka_rc_default, sizeof ctx->rc );
+}
+
+void haraka_init_ctx( struct haraka_ctx *ctx,
+                      const unsigned char *pk_seed, size_t pk_seed_len ) {
+    struct haraka_ctx standard;
+    haraka_init_standard_ctx( &standard );
+    haraka_S( &ctx->rc[0][0], sizeof ctx->rc, pk_seed, pk_seed_len,
+              &standard );
+}
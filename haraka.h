@@ -0,0 +1,68 @@
+#if !defined(HARAKA_H_)
+#define HARAKA_H_
+
+/*
+ * Haraka v2 (Kölbl, Lauridsen, Mendel, Rechberger), as used by the Sphincs+
+ * Haraka parameter sets
+ *
+ * Haraka is built out of AES rounds; on CPUs with AES-NI, it is several
+ * times faster than a SHA-256 compression operation
+ */
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HARAKA_NUM_RC   40     /* The number of 16 byte round constants */
+
+/*
+ * The round constants.  Sphincs+ 'tweaks' these based on PK.seed (which
+ * means it doesn't need to include PK.seed in each hash)
+ */
+struct haraka_ctx {
+    unsigned char rc[HARAKA_NUM_RC][16];
+};
+
+/*
+ * Set up the round constants for the given PK.seed (pk_seed_len bytes
+ * long); this is the Sphincs+ tweak_constants operation
+ */
+void haraka_init_ctx( struct haraka_ctx *ctx,
+                      const unsigned char *pk_seed, size_t pk_seed_len );
+
+/* Set up the standard (untweaked) Haraka v2 round constants */
+void haraka_init_standard_ctx( struct haraka_ctx *ctx );
+
+/*
+ * Returns true if our Haraka is constant time on this CPU (that is, if it
+ * has AES-NI).  If not, our Haraka is fine for verifying, but must not be
+ * used for signing (it'd leak secret values through cache timing)
+ */
+bool haraka_constant_time( void );
+
+/* Haraka-512: hash the 64 byte input into a 32 byte output */
+void haraka512( unsigned char *out, const unsigned char *in,
+                const struct haraka_ctx *ctx );
+
+/*
+ * Haraka-S: the sponge construction based on the Haraka-512 permutation;
+ * this takes an arbitrary length input, and produces an arbitrary length
+ * output.  We do it incrementally, as H_msg hashes several separate pieces
+ */
+struct haraka_S_state {
+    unsigned char s[64];
+    unsigned pos;             /* Bytes absorbed into the current block */
+};
+void haraka_S_init( struct haraka_S_state *state );
+void haraka_S_absorb( struct haraka_S_state *state,
+                      const void *in, size_t len,
+                      const struct haraka_ctx *ctx );
+/* This can be called only once per haraka_S_init */
+void haraka_S_squeeze( unsigned char *out, size_t len,
+                       struct haraka_S_state *state,
+                       const struct haraka_ctx *ctx );
+
+/* Haraka-S on a single input */
+void haraka_S( unsigned char *out, size_t out_len,
+               const void *in, size_t in_len,
+               const struct haraka_ctx *ctx );
+
+#endif /* HARAKA_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Tests for the Haraka hash
+ *
+ * We check Haraka-512 (with the standard round constants) against the
+ * known answer from the Haraka v2 reference code, and then either:
+ * - If our Haraka is constant time on this CPU (it has AES-NI), we do a
+ *   Haraka keygen, load, sign and verify round trip
+ * - If it isn't, we check that keygen and load refuse Haraka keys (we
+ *   don't sign with the portable permutation; it'd leak secrets through
+ *   cache timing)
+ *
+ * 'make haraka_test' builds and runs it twice: once normally, and once
+ * with HARAKA_AESNI=0 (so we test the portable permutation, and the
+ * refusals, even on CPUs with AES-NI)
+ */
+#include "sphincs-hybrid.h"
+#include "haraka.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+static bool do_rand( void *buffer, size_t len_buffer ) {
+    unsigned char *p = buffer;
+    int i;
+    for (i=0; i<len_buffer; i++) *p++ = i;
+    return true;
+}
+
+/* Haraka-512 of the bytes 0x00, 0x01, ..., 0x3f */
+static const unsigned char haraka512_kat[32] = {
+    0xbe, 0x7f, 0x72, 0x3b, 0x4e, 0x80, 0xa9, 0x98,
+    0x13, 0xb2, 0x92, 0x28, 0x7f, 0x30, 0x6f, 0x62,
+    0x5a, 0x6d, 0x57, 0x33, 0x1c, 0xae, 0x5f, 0x34,
+    0xdd, 0x92, 0x77, 0xb0, 0x94, 0x5b, 0xe2, 0xaa,
+};
+
+static bool test_kat( void ) {
+    struct haraka_ctx ctx;
+    unsigned char in[64], out[32];
+    int i;
+
+    haraka_init_standard_ctx( &ctx );
+    for (i=0; i<64; i++) in[i] = i;
+    haraka512( out, in, &ctx );
+    if (0 != memcmp( out, haraka512_kat, sizeof out )) {
+        printf( "Haraka-512 known answer: FAILED\n" );
+        return false;
+    }
+    printf( "Haraka-512 known answer: ok\n" );
+    return true;
+}
+
+static unsigned char sk_buffer[1024];
+static unsigned char pk_buffer[1024];
+static unsigned char sig[LEN_SIG_192_FAST];
+
+static bool test_round_trip( void ) {
+    size_t len_sk, len_pk;
+    if (!sh_keygen( 2, 192, 1, do_rand,
+                    sk_buffer, sizeof sk_buffer, &len_sk,
+                    pk_buffer, sizeof pk_buffer, &len_pk)) {
+        printf( "Keygen failed\n" );
+        return false;
+    }
+    struct sh_signer *sign = sh_load_signer( sk_buffer, do_rand );
+    if (!sign) { printf( "Loading signer failed\n" ); return false; }
+    if (sh_sig_len( sign ) != sizeof sig) {
+        printf( "Unexpected signature length\n" );
+        sh_delete_signer( sign );
+        return false;
+    }
+
+    bool ok = true;
+    int i;
+    for (i=0; i<3 && ok; i++) {
+        char message[20];
+        size_t len = sprintf( message, "Message %d", i );
+        if (!sh_sign( sig, sizeof sig, sign, message, len )) {
+            printf( "Signature %d failed\n", i );
+            ok = false;
+        } else if (!sh_verify( message, len, sig, sizeof sig, pk_buffer )) {
+            printf( "Signature %d didn't verify\n", i );
+            ok = false;
+        } else if (sh_verify( "Another message", 15, sig, sizeof sig,
+                              pk_buffer )) {
+            printf( "Signature %d verified the wrong message\n", i );
+            ok = false;
+        }
+    }
+    sh_delete_signer( sign );
+    if (ok) printf( "Haraka keygen/load/sign/verify: ok\n" );
+    return ok;
+}
+
+static bool test_refusal( void ) {
+    size_t len_sk, len_pk;
+    if (sh_keygen( 2, 192, 1, do_rand,
+                   sk_buffer, sizeof sk_buffer, &len_sk,
+                   pk_buffer, sizeof pk_buffer, &len_pk)) {
+        printf( "Haraka keygen wasn't refused\n" );
+        return false;
+    }
+
+    /* We can't generate a Haraka key here; take a SHA-256 one, and mark */
+    /* it as Haraka */
+    if (!sh_keygen( 1, 192, 1, do_rand,
+                    sk_buffer, sizeof sk_buffer, &len_sk,
+                    pk_buffer, sizeof pk_buffer, &len_pk)) {
+        printf( "Keygen failed\n" );
+        return false;
+    }
+    sk_buffer[3] = HASH_TYPE_HARAKA | HASH_LEN_192;
+    struct sh_signer *sign = sh_load_signer( sk_buffer, do_rand );
+    if (sign) {
+        printf( "Haraka load wasn't refused\n" );
+        sh_delete_signer( sign );
+        return false;
+    }
+    printf( "Haraka keygen/load refused without AES-NI: ok\n" );
+    return true;
+}
+
+int main(void) {
+    printf( "Haraka is %sconstant time here\n",
+            haraka_constant_time() ? "" : "not " );
+    bool ok = test_kat();
+    if (haraka_constant_time()) {
+        ok = test_round_trip() && ok;
+    } else {
+        ok = test_refusal() && ok;
+    }
+
+    printf( "%s\n", ok ? "Passed" : "FAILED" );
+    return ok ? 0 : 1;
+}
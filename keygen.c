@@ -2,41 +2,42 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "hash.h"
+#include "haraka.h"
 #include "build_merkle.h"
 #include "param.h"
+#include "sha256.h"
+#include "zeroize.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <string.h>
 
 /*
- * This generates a new public/private keypair
- *
- * Parameters:
- * hash_function - hash function to use: 
- *                 0 -> SHAKE256, 1 -> SHA256, 2 -> HARAKA
- * hash_size - length of the hash function to use (in bytes)
- *                 Must be one of: 128, 192, 256
- * time_space - where to do an F or an S parameter set of Sphincs+
- *                 0 -> use fast version (with large signatures)
- *                 1 -> use short version (with large signing times)
- * (Note: it is likely that we will fix hash_function and time_space
- *  to SHA256/slow in the future; those are what makes sense in the
- *  hybrid context)
- * do_rand - function to call when this needs randomness
- * sk_buffer - where to place the secret key
- * len_sk_buffer - length of the above buffer
- * size_sk - where to write the actual length of the secret key
- * pk_buffer - where to place the public key
- * len_pk_buffer - length of the above buffer
- * size_pk - where to write the actual length of the public key
+ * The parameter set we're generating keys for
  */
-bool sh_keygen( int hash_function, int hash_size, int time_space,
-                bool (*do_rand)( void *buffer, size_t len_buffer ),
-                void *sk_buffer, size_t len_sk_buffer, size_t *size_sk, 
-                void *pk_buffer, size_t len_pk_buffer, size_t *size_pk) {
+struct keygen_param {
+    int hash_function;
+    hash_t hash;
+    int n;
+    bool fast;
+    int d, tree_height;     /* The hypertree geometry */
+    size_t sk_len, pk_len;  /* The lengths of the keys */
+    size_t accel_len;       /* The length of the acceleration blob */
+};
+
+/* Validate the parameter set, and look up the details */
+static bool lookup_keygen_param( struct keygen_param *param,
+                   int hash_function, int hash_size, int time_space ) {
     /* Do parameter validation, look up the hash function */
     hash_t hash = 0;
     switch (hash_function) {
 //    case 0: hash = HASH_TYPE_SHAKE256; break;
     case 1: hash = HASH_TYPE_SHA256; break;
-//    case 2: hash = HASH_TYPE_HARAKA; break;
+    case 2:
+        /* Without AES-NI, our Haraka isn't constant time; we only verify */
+        /* with it then */
+        if (!haraka_constant_time()) return false;
+        hash = HASH_TYPE_HARAKA;
+        break;
     default: return false;  /* Unrecognized hash */
     }
     switch (hash_size) {
@@ -55,62 +56,265 @@ bool sh_keygen( int hash_function, int hash_size, int time_space,
 
     int n = hash_size / 8;  /* hash_size validated above */
 
-    int d, tree_height;
-    if (!lookup_hypertree_geometry( n, fast, &d, &tree_height )) return false;
+    if (!lookup_hypertree_geometry( n, fast, &param->d,
+                                    &param->tree_height )) return false;
+
+    param->hash_function = hash_function;
+    param->hash = hash;
+    param->n = n;
+    param->fast = fast;
 
     /* The lengths of the secret keys and the public keys */
     /* These are 4 bytes longer than what the Sphincs+ doc claims, as we */
     /* also record the parameter set */
-    size_t sk_len = 4 + 4*n;
-    size_t pk_len = 4 + 2*n;
-
-    /* Make sure that the passed buffers are long enough */ 
-    if (sk_len > len_sk_buffer) return false;
-    if (pk_len > len_pk_buffer) return false;
-
-    /* If asked, return the actual sizes */
-    if (size_sk) *size_sk = sk_len;
-    if (size_pk) *size_pk = pk_len;
+    param->sk_len = 4 + 4*n;
+    param->pk_len = 4 + 2*n;
+    /* The acceleration blob is the parameter set, followed by the leaves */
+    /* of the top Merkle tree */
+    param->accel_len = 4 + ((size_t)n << param->tree_height);
+    return true;
+}
 
-    /* Write out the public and private keys */
+/*
+ * Write out the parameter set, and pick the random seeds, for one keypair
+ */
+static bool keygen_seeds( const struct keygen_param *param,
+                   bool (*do_rand)( void *buffer, size_t len_buffer ),
+                   unsigned char *sk_buffer, unsigned char *pk_buffer ) {
+    int n = param->n;
     unsigned char *sk_param_set = sk_buffer;
     unsigned char *sk_seed = sk_param_set + 4;
-    unsigned char *sk_prf = sk_seed + n;
-    unsigned char *sk_pk_seed = sk_prf + n;
-    unsigned char *sk_pk_root = sk_pk_seed + n;
+    unsigned char *sk_pk_seed = sk_seed + 2*n;
     unsigned char *pk_param_set = pk_buffer;
     unsigned char *pk_seed = pk_param_set + 4;
-    unsigned char *pk_root = pk_seed + n;
 
-    sk_param_set[0] = pk_param_set[0] = hash_function;
+    sk_param_set[0] = pk_param_set[0] = param->hash_function;
     sk_param_set[1] = pk_param_set[1] = n;
-    sk_param_set[2] = pk_param_set[2] = fast;
-    sk_param_set[3] = pk_param_set[3] = hash;
+    sk_param_set[2] = pk_param_set[2] = param->fast;
+    sk_param_set[3] = pk_param_set[3] = param->hash;
 
-    if (!do_rand) goto failed;
-    if (!do_rand( sk_seed, 3*n )) goto failed;
+    if (!do_rand) return false;
+    if (!do_rand( sk_seed, 3*n )) return false;  /* SK.seed, SK.prf and */
+                                                 /* PK.seed */
 
     memcpy( pk_seed, sk_pk_seed, n );
+    return true;
+}
 
-    /* Now, the hard part; compute the root */
+/*
+ * Now, the hard part; compute the root of the top Merkle tree (the rest of
+ * the public key), and place it in both keys
+ * If nodes is non-NULL, we also write every node of that tree there (in
+ * MERKLE_NODE order)
+ */
+static bool keygen_root( const struct keygen_param *param,
+                   unsigned char *sk_buffer, unsigned char *pk_buffer,
+                   unsigned char *nodes ) {
+    int n = param->n;
+    unsigned char *sk_seed = sk_buffer + 4;
+    unsigned char *sk_pk_seed = sk_seed + 2*n;
+    unsigned char *sk_pk_root = sk_pk_seed + n;
+    unsigned char *pk_root = pk_buffer + 4 + n;
+
+    struct private_key_seed sk_seed_gen;
+    init_private_key_seed( &sk_seed_gen, sk_seed, n );
     struct build_merkle_state state;
-    if (!init_build_merkle( &state, sk_seed, sk_pk_seed,
-        hash, tree_height, 
-        d-1, 0,
-        0, 0, pk_root)) goto failed;
+    if (!init_build_merkle( &state, &sk_seed_gen, sk_pk_seed,
+        param->hash, param->tree_height, 
+        param->d-1, 0,
+        0, 0, pk_root)) {
+        zeroize( &sk_seed_gen, sizeof sk_seed_gen );
+        return false;
+    }
+    state.nodes = nodes;
 
     while (!step_build_merkle( &state, 0 )) {
         ;
     }
+    zeroize( &sk_seed_gen, sizeof sk_seed_gen );
+    if (state.failed) return false;  /* We detected a miscomputation */
 
     /* The private key gets a copy of the root */
     memcpy( sk_pk_root, pk_root, n );
+    return true;
+}
+
+/*
+ * This generates a new public/private keypair
+ *
+ * Parameters:
+ * hash_function - hash function to use: 
+ *                 0 -> SHAKE256, 1 -> SHA256, 2 -> HARAKA
+ * hash_size - length of the hash function to use (in bytes)
+ *                 Must be one of: 128, 192, 256
+ * time_space - where to do an F or an S parameter set of Sphincs+
+ *                 0 -> use fast version (with large signatures)
+ *                 1 -> use short version (with large signing times)
+ * (Note: it is likely that we will fix hash_function and time_space
+ *  to SHA256/slow in the future; those are what makes sense in the
+ *  hybrid context)
+ * do_rand - function to call when this needs randomness
+ * sk_buffer - where to place the secret key
+ * len_sk_buffer - length of the above buffer
+ * size_sk - where to write the actual length of the secret key
+ * pk_buffer - where to place the public key
+ * len_pk_buffer - length of the above buffer
+ * size_pk - where to write the actual length of the public key
+ */
+bool sh_keygen( int hash_function, int hash_size, int time_space,
+                bool (*do_rand)( void *buffer, size_t len_buffer ),
+                void *sk_buffer, size_t len_sk_buffer, size_t *size_sk, 
+                void *pk_buffer, size_t len_pk_buffer, size_t *size_pk) {
+    return sh_keygen_accel( hash_function, hash_size, time_space, do_rand,
+                sk_buffer, len_sk_buffer, size_sk,
+                pk_buffer, len_pk_buffer, size_pk,
+                NULL, 0, NULL );
+}
+
+/*
+ * The same, but also write out the acceleration blob (if accel_buffer is
+ * non-NULL).  That's the parameter set, followed by the leaves of the top
+ * Merkle tree (which we have to compute anyways); sh_load_signer_accel can
+ * use that to skip rebuilding that tree.  None of that is secret (the
+ * leaves are WOTS public keys, and they're in the signatures anyways)
+ */
+bool sh_keygen_accel( int hash_function, int hash_size, int time_space,
+                bool (*do_rand)( void *buffer, size_t len_buffer ),
+                void *sk_buffer, size_t len_sk_buffer, size_t *size_sk, 
+                void *pk_buffer, size_t len_pk_buffer, size_t *size_pk,
+                void *accel_buffer, size_t len_accel_buffer,
+                size_t *size_accel ) {
+    /* Building the top Merkle tree is mostly multi-lane hashing; make */
+    /* sure we're using the fastest engine for it */
+    SHA256_select_backends();
+
+    struct keygen_param param;
+    if (!lookup_keygen_param( &param, hash_function, hash_size,
+                              time_space )) {
+        return false;
+    }
+
+    /* Make sure that the passed buffers are long enough */ 
+    if (param.sk_len > len_sk_buffer) return false;
+    if (param.pk_len > len_pk_buffer) return false;
+    if (accel_buffer && param.accel_len > len_accel_buffer) return false;
+
+    /* If asked, return the actual sizes */
+    if (size_sk) *size_sk = param.sk_len;
+    if (size_pk) *size_pk = param.pk_len;
+    if (size_accel) *size_accel = accel_buffer ? param.accel_len : 0;
+
+    /* If we're writing the blob, we need a place for the entire tree */
+    unsigned char *nodes = 0;
+    if (accel_buffer) {
+        nodes = malloc( (size_t)param.n * ((2 << param.tree_height) - 1) );
+        if (!nodes) return false;
+    }
+
+    if (!keygen_seeds( &param, do_rand, sk_buffer, pk_buffer ) ||
+        !keygen_root( &param, sk_buffer, pk_buffer, nodes )) {
+        memset( sk_buffer, 0, param.sk_len );
+        memset( pk_buffer, 0, param.pk_len );
+        free( nodes );
+        return false;
+    }
+
+    if (accel_buffer) {
+        /* The parameter set is the same as in the keys */
+        unsigned char *accel = accel_buffer;
+        memcpy( accel, sk_buffer, 4 );
+        memcpy( accel + 4,
+                nodes + param.n * MERKLE_NODE( param.tree_height, 0, 0 ),
+                param.accel_len - 4 );
+        free( nodes );
+    }
 
     return true;
-failed:
-    memset( sk_buffer, 0, sk_len );
-    memset( pk_buffer, 0, pk_len );
-    return false;
+}
+
+/*
+ * Return the length of the acceleration blob for this parameter set (or 0
+ * if it's a parameter set we don't support)
+ */
+size_t sh_accel_len( int hash_function, int hash_size, int time_space ) {
+    struct keygen_param param;
+    if (!lookup_keygen_param( &param, hash_function, hash_size,
+                              time_space )) {
+        return 0;
+    }
+    return param.accel_len;
+}
+
+/*
+ * The bulk version; each job computes the public key of one keypair
+ */
+struct keygen_job {
+    const struct keygen_param *param;
+    unsigned char *sk;      /* The first secret key */
+    unsigned char *pk;      /* The first public key */
+    bool *ok;               /* Set for each key we generated */
+};
+
+static void keygen_one( void *ctx, unsigned index ) {
+    struct keygen_job *job = ctx;
+    const struct keygen_param *param = job->param;
+    job->ok[index] = keygen_root( param, job->sk + index * param->sk_len,
+                                         job->pk + index * param->pk_len,
+                                         NULL );
+}
+
+bool sh_keygen_many( int hash_function, int hash_size, int time_space,
+                bool (*do_rand)( void *buffer, size_t len_buffer ),
+                unsigned count,
+                void *sk_buffer, size_t len_sk_buffer,
+                void *pk_buffer, size_t len_pk_buffer ) {
+    SHA256_select_backends();
+
+    struct keygen_param param;
+    if (!lookup_keygen_param( &param, hash_function, hash_size,
+                              time_space )) {
+        return false;
+    }
+
+    /* Make sure that the passed buffers are long enough */ 
+    if (count > len_sk_buffer / param.sk_len) return false;
+    if (count > len_pk_buffer / param.pk_len) return false;
+    if (count == 0) return true;
+
+    struct keygen_job job;
+    job.param = &param;
+    job.sk = sk_buffer;
+    job.pk = pk_buffer;
+    job.ok = malloc( count * sizeof *job.ok );
+    if (!job.ok) return false;
+
+    /* The caller's do_rand needn't be thread safe; draw all the seeds */
+    /* here, before we split up the work */
+    unsigned i;
+    bool success = true;
+    for (i=0; i<count; i++) {
+        if (!keygen_seeds( &param, do_rand, job.sk + i * param.sk_len,
+                                            job.pk + i * param.pk_len )) {
+            success = false;
+            break;
+        }
+    }
+
+    /* Now, compute the roots; these are independent, and so we build */
+    /* several at once (and each of those keeps the hash lanes busy) */
+    if (success) {
+        run_parallel( count, keygen_one, &job );
+        for (i=0; i<count; i++) {
+            if (!job.ok[i]) success = false;
+        }
+    }
+    free( job.ok );
+
+    if (!success) {
+        memset( sk_buffer, 0, count * param.sk_len );
+        memset( pk_buffer, 0, count * param.pk_len );
+    }
+    return success;
 }
 
 /* Return the length of the public key, assuming the specified setting */
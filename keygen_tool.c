@@ -0,0 +1,102 @@
+/*
+ * Command line tool to generate keypairs in bulk
+ *
+ * Usage: keygen_tool [-haraka] count secret_key_file public_key_file
+ *
+ * This generates count keypairs, and writes the secret keys (one after
+ * the other, each LEN_PRIVKEY_192 bytes long) to secret_key_file, and
+ * the public keys (each LEN_PUBKEY_192 bytes long, in the same order) to
+ * public_key_file.  We generate KEYS_PER_BATCH of them at a time with
+ * sh_keygen_many (which uses up to LOAD_THREADS threads), and write each
+ * batch out as soon as we have it, so we don't need to hold them all in
+ * memory.  The secret key file is created readable only by its owner
+ *
+ * 'make keygen_tool' builds this with LOAD_THREADS set to the number of
+ * cores on the build machine (KEYGEN_THREADS in the Makefile)
+ */
+#include "sphincs-hybrid.h"
+#include "zeroize.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define KEYS_PER_BATCH 64   /* The number of keys we generate at once */
+
+static FILE *urandom;
+
+static bool do_rand( void *buffer, size_t len_buffer ) {
+    return len_buffer == fread( buffer, 1, len_buffer, urandom );
+}
+
+/* Wall clock time, in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf( stderr, "Usage: keygen_tool [-haraka] count "
+                     "secret_key_file public_key_file\n" );
+    exit( 1 );
+}
+
+int main( int argc, char **argv ) {
+    int hash_function = 1;  /* SHA-256 */
+    int arg = 1;
+    if (arg < argc && 0 == strcmp( argv[arg], "-haraka" )) {
+        hash_function = 2;
+        arg++;
+    }
+    if (argc - arg != 3) usage();
+    char *end;
+    unsigned long count = strtoul( argv[arg], &end, 10 );
+    if (*end != '\0' || count == 0) usage();
+
+    urandom = fopen( "/dev/urandom", "rb" );
+    if (!urandom) { perror( "/dev/urandom" ); return 1; }
+
+    int fd = open( argv[arg+1], O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+    FILE *sk_file = (fd < 0) ? NULL : fdopen( fd, "wb" );
+    if (!sk_file) { perror( argv[arg+1] ); return 1; }
+    FILE *pk_file = fopen( argv[arg+2], "wb" );
+    if (!pk_file) { perror( argv[arg+2] ); return 1; }
+
+    static unsigned char sk[KEYS_PER_BATCH][LEN_PRIVKEY_192];
+    static unsigned char pk[KEYS_PER_BATCH][LEN_PUBKEY_192];
+    unsigned long done;
+    double start = now();
+    for (done = 0; done < count; ) {
+        unsigned batch = KEYS_PER_BATCH;
+        if (batch > count - done) batch = count - done;
+
+        if (!sh_keygen_many( hash_function, 192, 1, do_rand, batch,
+                             sk, sizeof sk, pk, sizeof pk )) {
+            fprintf( stderr, "Key generation failed\n" );
+            return 1;
+        }
+        if (batch != fwrite( sk, LEN_PRIVKEY_192, batch, sk_file )) {
+            perror( argv[arg+1] );
+            return 1;
+        }
+        zeroize( sk, sizeof sk );
+        if (batch != fwrite( pk, LEN_PUBKEY_192, batch, pk_file )) {
+            perror( argv[arg+2] );
+            return 1;
+        }
+        done += batch;
+    }
+
+    if (0 != fclose( sk_file )) { perror( argv[arg+1] ); return 1; }
+    if (0 != fclose( pk_file )) { perror( argv[arg+2] ); return 1; }
+    fclose( urandom );
+
+    double elapsed = now() - start;
+    fprintf( stderr, "Generated %lu keypairs (%.1f keys/sec)\n", count,
+             count / elapsed );
+    return 0;
+}
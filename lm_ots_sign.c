@@ -8,18 +8,31 @@
 #include "lms_common_defs.h"
 #include "endian.h"
 #include "private_key_gen.h"
-#include "zeroize.h"
 #include "lm_ots_common.h"
 #include "lm_ots_param.h"
 
 /*
+ * The most leaves we compute in lockstep; this bounds the stack space we
+ * use (about 10k per leaf)
+ */
+#define MAX_LEAVES_AT_ONCE 2
+
+/*
+ * Generate the public keys for the count leaves q, q+1, ..., q+count-1,
+ * placing them (n bytes each) consecutively in public_key
+ *
+ * The p chains of each leaf are independent, and all have the same length;
+ * so we lay them out side by side, and advance all of them (for all the
+ * leaves) one step at a time on the multi-lane hash engine
+ *
  * Note: this includes the bottom level leaf hash that's technically in
  * the LMS merkle tree
  */
-void lm_ots_generate_public_key(
+void lm_ots_generate_public_keys(
     const unsigned char *I, /* Public key identifier */
-    unsigned q,             /* Diversification string, 4 bytes value */
-    const void *seed,
+    unsigned q,             /* Diversification string of the first leaf */
+    unsigned count,         /* Number of leaves */
+    const struct private_key_generator *priv_gen,
     unsigned char *public_key) {
 
     /* Look up the parameter set */
@@ -27,78 +40,104 @@ void lm_ots_generate_public_key(
     unsigned n = 24;
     unsigned w = LM_OTS_W;
     unsigned p = LM_OTS_P;
+    int h = 20;
 
-    /* Start the hash that computes the final value */
-    SHA256_CTX public_ctx;
-    SHA256_Init( &public_ctx );
-    {
-        unsigned char prehash_prefix[ PBLC_PREFIX_LEN ];
-        memcpy( prehash_prefix + PBLC_I, I, I_LEN );
-        put_bigendian( prehash_prefix + PBLC_Q, q, 4 );
-        SET_D( prehash_prefix + PBLC_D, D_PBLC );
-        SHA256_Update(&public_ctx, prehash_prefix,
-                                PBLC_PREFIX_LEN );
-    }
-
-    /* Now generate the public key */
-    int i, j;
+    /* The chain hashes all have the same shape; we lay out the padding */
+    /* once, and then only update the message bytes */
+    unsigned char buf[ MAX_LEAVES_AT_ONCE * LM_OTS_P ]
+                     [ 64 * SHA256_PADDED_BLOCKS(ITER_MAX_LEN) ];
+    uint32_t priv_image[ MAX_LEAVES_AT_ONCE * LM_OTS_P ][4];
+    unsigned char *chain[ MAX_LEAVES_AT_ONCE * LM_OTS_P ];
+    const unsigned char *block[ MAX_LEAVES_AT_ONCE * LM_OTS_P ];
+    const unsigned char *state[ MAX_LEAVES_AT_ONCE * LM_OTS_P ];
+    unsigned char leaf[ MAX_LEAVES_AT_ONCE ]
+                      [ 64 * SHA256_PADDED_BLOCKS(LEAF_MAX_LEN) ];
+    unsigned char *leaf_dest[ MAX_LEAVES_AT_ONCE ];
+    const unsigned char *leaf_block[ MAX_LEAVES_AT_ONCE ];
+
+    while (count > 0) {
+        unsigned leaves = count;
+        if (leaves > MAX_LEAVES_AT_ONCE) leaves = MAX_LEAVES_AT_ONCE;
+        unsigned chains = leaves * p;
+        unsigned l, i, j, c;
+
+        /* Set up the chains, starting with the private keys */
+        for (l=0, c=0; l<leaves; l++) {
+            for (i=0; i<p; i++, c++) {
+                memcpy( buf[c] + ITER_I, I, I_LEN );
+                put_bigendian( buf[c] + ITER_Q, q + l, 4 );
+                put_bigendian( buf[c] + ITER_K, i, 2 );
+                SHA256_pad_blocks( buf[c], ITER_LEN(n), 0 );
+                memset( priv_image[c], 0, sizeof priv_image[c] );
+                put_bigendian( (void*)&priv_image[c][0], q + l, 4);
+                priv_image[c][1] = i | (i << 24);  /* Same on little and */
+                                                   /* big endian */
+                chain[c] = buf[c] + ITER_PREV;
+                block[c] = buf[c];
+                state[c] = (const unsigned char *)priv_image[c];
+            }
+        }
+        do_private_key_gen_many( chain, n, priv_gen, state, chains );
 
-    unsigned char buf[ ITER_MAX_LEN ];
-    memcpy( buf + ITER_I, I, I_LEN );
-    put_bigendian( buf + ITER_Q, q, 4 );
-    SHA256_CTX ctx;
+        /* Now step all the chains forward together */
+        for (j=0; j < (1<<w) - 1; j++) {
+            for (c=0; c<chains; c++) {
+                buf[c][ITER_J] = j;
+            }
+            SHA256_multi_hash_blocks( chain, n, &SHA256_IV, block,
+                                SHA256_PADDED_BLOCKS(ITER_LEN(n)), chains );
+        }
 
-    /* set up the private key generator */
-    struct private_key_generator priv_gen;
-    init_private_key_gen( &priv_gen, seed, 32, 0, 0 );
-    uint32_t priv_image[4] = { 0 };
-    put_bigendian( (void*)&priv_image[0], q, 4);
+        for (l=0; l<leaves; l++) {
+            /* Hash the chain tops into the OTS public key */
+            SHA256_CTX public_ctx;
+            SHA256_Init( &public_ctx );
+            unsigned char prehash_prefix[ PBLC_PREFIX_LEN ];
+            memcpy( prehash_prefix + PBLC_I, I, I_LEN );
+            put_bigendian( prehash_prefix + PBLC_Q, q + l, 4 );
+            SET_D( prehash_prefix + PBLC_D, D_PBLC );
+            SHA256_Update(&public_ctx, prehash_prefix, PBLC_PREFIX_LEN );
+            for (i=0; i<p; i++) {
+                SHA256_Update( &public_ctx, chain[l*p + i], n );
+            }
+            unsigned char temp[32];
+            SHA256_Final( temp, &public_ctx );
+
+            /* And set up the bottom level hash that appears in the */
+            /* Merkle tree */
+            memcpy( leaf[l] + LEAF_I, I, I_LEN );
+            put_bigendian( leaf[l] + LEAF_R, q + l + (1<<h), 4 );
+            SET_D( leaf[l] + LEAF_D, D_LEAF );
+            memcpy( leaf[l] + LEAF_PK, temp, n );
+            SHA256_pad_blocks( leaf[l], LEAF_LEN(n), 0 );
+            leaf_dest[l] = public_key + l*n;
+            leaf_block[l] = leaf[l];
 
-    for (i=0; i<p; i++) {
-        priv_image[1] = i | (i << 24);  /* Same on little and big endian */
-        do_private_key_gen( buf + ITER_PREV, n, &priv_gen, priv_image );
-        put_bigendian( buf + ITER_K, i, 2 );
-        /* We'll place j in the buffer below */
-        for (j=0; j < (1<<w) - 1; j++) {
-            buf[ITER_J] = j;
-            SHA256_Init( &ctx );
-            SHA256_Update( &ctx, buf, ITER_LEN(n) );
-            SHA256_Final( buf + ITER_PREV, &ctx );  /* Note: this will */
-                /* write an extra 8 bytes; we've allocated buf long */
-                /* enough that those extra bytes are harmless */
         }
-        /* Include that in the hash */
-        SHA256_Update( &public_ctx, buf + ITER_PREV, n );
-    }
+        SHA256_multi_hash_blocks( leaf_dest, n, &SHA256_IV, leaf_block,
+                            SHA256_PADDED_BLOCKS(LEAF_LEN(n)), leaves );
 
-    /* And the result of the running hash is the public key */
-    unsigned char temp[32];
-    SHA256_Final( temp, &public_ctx );
-    memcpy( public_key, temp, n );
-    zeroize( temp, sizeof temp );
+        q += leaves;
+        count -= leaves;
+        public_key += leaves * n;
+    }
 
-    zeroize( &priv_gen, sizeof priv_gen );
-    zeroize( buf, sizeof buf );
+    /* We don't zeroize buf; we stepped the chains in place, and so all */
+    /* it now holds are the chain tops (which are public) */
+}
 
-    /* Perform the bottom level hash that appears in the Merkle tree */
-    int h = 20;
-    unsigned char ots_sig[LEAF_MAX_LEN];
-    memcpy( ots_sig + LEAF_I, I, I_LEN );
-    put_bigendian( ots_sig + LEAF_R, q + (1<<h), 4 );
-    SET_D( ots_sig + LEAF_D, D_LEAF );
-    memcpy( ots_sig + LEAF_PK, public_key, n );
-    SHA256_Init( &ctx );
-    SHA256_Update( &ctx, ots_sig, LEAF_LEN(n) );
-    SHA256_Final(public_key, &ctx);
-
-    zeroize( &ctx, sizeof ctx );
-    zeroize( ots_sig, sizeof ots_sig );
+void lm_ots_generate_public_key(
+    const unsigned char *I, /* Public key identifier */
+    unsigned q,             /* Diversification string, 4 bytes value */
+    const struct private_key_generator *priv_gen,
+    unsigned char *public_key) {
+    lm_ots_generate_public_keys( I, q, 1, priv_gen, public_key );
 }
 
 int lm_ots_generate_signature(
     const unsigned char *I,  /* Public key identifier */
     unsigned q,             /* Diversification string, 4 bytes value */
-    const void *seed,
+    const struct private_key_generator *priv_gen,
     const void *message,
     size_t message_len,
     unsigned char *signature) {
@@ -108,9 +147,7 @@ int lm_ots_generate_signature(
     int ls = LM_OTS_LS;
     int p = LM_OTS_P;
 
-    /* Set up the secret sauce that generates the private keys */
-    struct private_key_generator priv_gen;
-    init_private_key_gen( &priv_gen, seed, 32, 0, 0 );
+    /* The secret sauce that generates the private keys is in priv_gen */
     uint32_t priv_image[4] = { 0 };
     put_bigendian( (void*)&priv_image[0], q, 4);
 
@@ -120,7 +157,7 @@ int lm_ots_generate_signature(
     /* Select the randomizer */
     priv_image[2] = ~0; /* Make sure it doesn't collide with other uses */
                         /* of priv_gen */
-    do_private_key_gen( signature+4, n, &priv_gen, priv_image );
+    do_private_key_gen( signature+4, n, priv_gen, priv_image );
     priv_image[2] = 0;
     
     SHA256_CTX ctx;
@@ -145,32 +182,42 @@ int lm_ots_generate_signature(
     put_bigendian( &Q[n], lm_ots_compute_checksum(Q, n, w, ls), 2 );
 
     int i;
-    unsigned char tmp[ITER_MAX_LEN];
+    unsigned char tmp[ 64 * SHA256_PADDED_BLOCKS(ITER_MAX_LEN) ];
 
-    /* Preset the parts of tmp that don't change */
+    /* Preset the parts of tmp that don't change (including the padding) */
     memcpy( tmp + ITER_I, I, I_LEN );
     put_bigendian( tmp + ITER_Q, q, 4 );
+    SHA256_pad_blocks( tmp, ITER_LEN(n), 0 );
+
+    /* Generate all the chain starts at once, directly into the signature */
+    uint32_t chain_image[ LM_OTS_P ][4];
+    unsigned char *chain[ LM_OTS_P ];
+    const unsigned char *state[ LM_OTS_P ];
+    for (i=0; i<p; i++) {
+        memcpy( chain_image[i], priv_image, sizeof priv_image );
+        chain_image[i][1] = i | (i << 24);  /* Same on little and big */
+                                            /* endian */
+        chain[i] = &signature[ 4 + n + n*i ];
+        state[i] = (const unsigned char *)chain_image[i];
+    }
+    do_private_key_gen_many( chain, n, priv_gen, state, p );
     
     for (i=0; i<p; i++) {
         put_bigendian( tmp + ITER_K, i, 2 );
-        priv_image[1] = i | (i << 24);  /* Same on little and big endian */
-        do_private_key_gen( tmp + ITER_PREV, n, &priv_gen, priv_image );
+        memcpy( tmp + ITER_PREV, chain[i], n );
         unsigned a = lm_ots_coef( Q, i, w );
         unsigned j;
         for (j=0; j<a; j++) {
             tmp[ITER_J] = j;
-            SHA256_Init( &ctx );
-            SHA256_Update( &ctx, tmp, ITER_LEN(n) );
-            SHA256_Final( tmp + ITER_PREV, &ctx );  /* Note: this will */
-                /* write an extra 8 bytes; we've allocated buf long */
-                /* enough that those extra bytes are harmless */
+            SHA256_hash_blocks( tmp + ITER_PREV, n, &SHA256_IV, tmp,
+                                SHA256_PADDED_BLOCKS(ITER_LEN(n)) );
         }
         memcpy( &signature[ 4 + n + n*i ], tmp + ITER_PREV, n );
     }
 
-    /* Get rid of the incrimidating evidence */
-    zeroize( &ctx, sizeof ctx );
-    zeroize( &priv_gen, sizeof priv_gen );
+    /* There's no incrimidating evidence to get rid of; ctx holds the */
+    /* message and the randomizer, and tmp holds a value we just put in */
+    /* the signature */
 
     return 4 + n + p*n;  /* Return the signature length */
 }
@@ -1,14 +1,25 @@
 #include <stddef.h>
+#include "private_key_gen.h"
 
 void lm_ots_generate_public_key(
     const unsigned char *I, /* Public key identifier */
     unsigned q,             /* Diversification string, 4 bytes value */
-    const void *seed,
+    const struct private_key_generator *priv_gen,
+    unsigned char *public_key);
+/*
+ * Generate the public keys of count consecutive leaves (starting with q);
+ * leaf q+i is written to public_key + 24*i
+ */
+void lm_ots_generate_public_keys(
+    const unsigned char *I, /* Public key identifier */
+    unsigned q,             /* Diversification string of the first leaf */
+    unsigned count,         /* Number of leaves */
+    const struct private_key_generator *priv_gen,
     unsigned char *public_key);
 int lm_ots_generate_signature(
     const unsigned char *I,  /* Public key identifier */
     unsigned q,             /* Diversification string, 4 bytes value */
-    const void *seed,
+    const struct private_key_generator *priv_gen,
     const void *message,
     size_t message_len,
     unsigned char *signature);
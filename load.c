@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sha256.h"
+#include "haraka.h"
 
 #if DUMP_SIG
 #include <stdio.h>
@@ -18,10 +19,16 @@ static void dump( FILE *f, const char *name,
  * a fresh LMS public/private keypair, and signs it with the Sphincs+ key).
  * This takes several seconds; however one it is done, we're ready to start
  * signing
+ * If we're given the acceleration blob from sh_keygen_accel, we take the
+ * top Merkle tree of the hypertree from that, rather than building it
  */
-struct sh_signer *sh_load_signer( const void *sk_buffer,
+struct sh_signer *sh_load_signer_accel( const void *sk_buffer,
+                const void *accel, size_t len_accel,
                 bool (*do_rand)( void *buffer, size_t len_buffer ) ) {
 
+    /* Pick the fastest SHA-256 implementation (if we haven't already) */
+    SHA256_select_backends();
+
     struct sh_signer *signer = malloc( sizeof *signer );
     if (!signer) return false;
     signer->initialized = false;
@@ -39,13 +46,28 @@ struct sh_signer *sh_load_signer( const void *sk_buffer,
     unsigned n;
     signer->n = n = hash_len(signer->hash);
     if (!n) { free(signer); return false; }
+    if ((signer->hash >> HASH_TYPE_SHIFT) ==
+                           (HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT) &&
+        !haraka_constant_time()) {
+        /* Without AES-NI, our Haraka would leak the secret values */
+        /* we'd hash with it through cache timing; refuse to sign */
+        zeroize( signer, sizeof *signer );
+        free(signer);
+        return false;
+    }
 
     memcpy( signer->sk_seed, &sk[4],   n );
     memcpy( signer->sk_prf,  &sk[4+n], n );
     memcpy( signer->pk_seed, &sk[4+2*n], n );
     memcpy( signer->root,    &sk[4+3*n], n );
+    init_private_key_seed( &signer->sk_seed_gen, signer->sk_seed, n );
 
-    SHA256_set_first_block( &signer->pk_seed_pre, signer->pk_seed, n );
+    if (!init_sphincs_seed( &signer->pk_seed_pre, signer->hash,
+                            signer->pk_seed )) {
+        zeroize( signer, sizeof *signer );
+        free(signer);
+        return false;
+    }
 
     // Init the LMS structures
     signer->current_lms_top_subtree = signer->lms_top_1;
@@ -57,6 +79,24 @@ struct sh_signer *sh_load_signer( const void *sk_buffer,
     signer->current_sphincs_sig = signer->sph_sig_1;
     signer->next_sphincs_sig = signer->sph_sig_2;
 
+    /* We haven't built any hypertree trees yet */
+    signer->top_tree.valid = false;
+    signer->defer.active = false;
+#if BUILD_THREAD
+    signer->bg.running = false;
+#endif
+
+    if (accel) {
+        /* It must be for this parameter set, and lead to our root */
+        if (len_accel != 4 + (24 << SPH_T) || n != 24 ||
+                0 != memcmp( accel, sk, 4 ) ||
+                !load_top_tree( signer, (const unsigned char *)accel + 4 )) {
+            zeroize( signer, sizeof *signer );
+            free(signer);
+            return false;
+        }
+    }
+
     signer->build_state = b_init;
 
     /* Ok, wack at the build process until it's completely rebuilt */
@@ -64,7 +104,7 @@ struct sh_signer *sh_load_signer( const void *sk_buffer,
     /* If profiling is enabled, we're also turn on the dummy waits (so */
     /* that the profiled time taken is representative of what they'd be */
     /* while we are generating signatures */
-    while (!step_next( signer, PROFILE )) {
+    while (!step_next_load( signer )) {
         ;
     }
 
@@ -100,8 +140,19 @@ struct sh_signer *sh_load_signer( const void *sk_buffer,
     return signer;
 }
 
+struct sh_signer *sh_load_signer( const void *sk_buffer,
+                bool (*do_rand)( void *buffer, size_t len_buffer ) ) {
+    return sh_load_signer_accel( sk_buffer, NULL, 0, do_rand );
+}
+
 void sh_delete_signer(struct sh_signer *signer) {
     if (signer) {
+#if BUILD_THREAD
+        /* The build thread is using the signer; stop it first */
+        build_thread_stop( signer );
+#endif
+        /* This also wipes the expanded seeds (sk_seed_gen, */
+        /* current_lms_gen, next_lms_gen) */
         zeroize( signer, sizeof *signer );
         free( signer );
     }
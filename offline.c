@@ -0,0 +1,188 @@
+/*
+ * This is the online/offline split of the signing work
+ *
+ * Normally, each sh_sign call does the signature itself (the online part,
+ * which depends on the message), and then a fixed slice of the work of
+ * building the next LMS tree and Sphincs+ signature, and of the next
+ * bottom LMS subtree (the offline part, which doesn't).  Here, we let the
+ * application do the offline part whenever it has the time to spare
+ * (sh_do_offline_work), which leaves sh_sign_online with just the
+ * signature.
+ *
+ * As with the build thread (build_thread.c, which uses the same
+ * bookkeeping), we build the next bottom subtree in a spare buffer, rather
+ * than in place; that way, we can work on the entire subtree ahead of the
+ * signatures.  As sh_sign does, we don't switch to the next LMS tree as
+ * soon as it's ready; we hold it until the current one is used up
+ */
+#include "sphincs-hybrid.h"
+#include "sh_signer.h"
+#include "sha256.h"
+#include <time.h>
+
+void start_deferred( struct sh_signer *signer ) {
+    /* The signer may have been signing on its own up to now; we start */
+    /* the next bottom subtree from scratch, and carry on with the build */
+    /* from wherever it got to */
+    signer->defer.next_ready = signer->build_state == b_done;
+    signer->defer.bottom_subtree = signer->current_lms_index >> LMS_BOTTOM;
+    signer->defer.refresh_index = signer->defer.bottom_subtree << LMS_BOTTOM;
+    signer->defer.spare_lms_bottom_subtree = signer->lms_bottom_3;
+    signer->defer.active = true;
+}
+
+/*
+ * We can fill in the spare buffer with the bottom subtree after the one
+ * the signer is currently using (but not past the end of the LMS tree)
+ */
+bool can_refresh( struct sh_signer *signer ) {
+    merkle_index_t index = signer->defer.refresh_index;
+    return (index >> LMS_BOTTOM) == signer->defer.bottom_subtree &&
+           index + (1 << LMS_BOTTOM) < LMS_END;
+}
+
+bool deferred_handoff( struct sh_signer *signer ) {
+    for (;;) {
+        merkle_index_t index = signer->current_lms_index;
+        if (index == LMS_END) {
+            /* We've used up the current LMS tree; switch to the next */
+            /* one, once it's ready */
+            if (!signer->defer.next_ready) return false;
+            switch_lms_tree( signer );
+            signer->defer.next_ready = false;
+            signer->defer.bottom_subtree = 0;
+            signer->defer.refresh_index = 0;
+        } else if ((index >> LMS_BOTTOM) == signer->defer.bottom_subtree) {
+            return true;    /* We have everything this signature needs */
+        } else if (signer->defer.refresh_index == index) {
+            /* We're moving on to the next bottom subtree, and it's been */
+            /* finished; swap it in (and the buffer we're done with */
+            /* becomes the one we build the subtree after that in) */
+            unsigned char *temp = signer->current_lms_bottom_subtree;
+            signer->current_lms_bottom_subtree =
+                                signer->defer.spare_lms_bottom_subtree;
+            signer->defer.spare_lms_bottom_subtree = temp;
+            signer->defer.bottom_subtree += 1;
+        } else {
+            return false;   /* That subtree isn't finished yet */
+        }
+    }
+}
+
+/* Compute the next leaf of the next bottom subtree, if we can */
+static bool offline_refresh( struct sh_signer *signer ) {
+    if (!can_refresh( signer )) return false;
+    refresh_lms_bottom( signer, signer->defer.refresh_index,
+                        signer->defer.spare_lms_bottom_subtree );
+    signer->defer.refresh_index += 1;
+    return true;
+}
+
+/* Do the next step of building the next LMS tree and Sphincs+ signature, */
+/* if we haven't finished them */
+static bool offline_step( struct sh_signer *signer, bool do_dummy ) {
+    if (signer->defer.next_ready || signer->got_fatal_error) return false;
+    (void)step_next( signer, do_dummy );
+    if (signer->build_state == b_done) {
+        signer->defer.next_ready = true;
+    }
+    return true;
+}
+
+bool deferred_ready( struct sh_signer *signer ) {
+    if (!signer->defer.active) start_deferred( signer );
+    if (signer->got_fatal_error) return false;
+    return deferred_handoff( signer );
+}
+
+bool deferred_catch_up( struct sh_signer *signer ) {
+    if (!signer->defer.active) start_deferred( signer );
+    for (;;) {
+        if (signer->got_fatal_error) return false;
+        if (deferred_handoff( signer )) return true;
+        /* There's always one of these to do if the handoff can't */
+        /* happen yet */
+        if (!offline_refresh( signer ) && !offline_step( signer, false )) {
+            return false;
+        }
+    }
+}
+
+void deferred_work( struct sh_signer *signer, bool do_dummy ) {
+    (void)offline_refresh( signer );
+    (void)offline_step( signer, do_dummy );
+}
+
+/* Wall clock time, in microseconds */
+static long usec_now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return 1000000L * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+bool sh_do_offline_work( struct sh_signer *signer, long budget, int unit ) {
+    if (!signer || !signer->initialized) return false;
+    if (unit != SH_WORK_HASHES && unit != SH_WORK_USEC) return false;
+#if BUILD_THREAD
+    if (signer->bg.running) return false;   /* The thread does it all */
+#endif
+    if (!signer->defer.active) start_deferred( signer );
+
+    long start = (unit == SH_WORK_USEC) ? usec_now() : hash_compression_count;
+    for (;;) {
+        if (signer->got_fatal_error) return false;
+        long spent = (unit == SH_WORK_USEC) ? usec_now() - start :
+                                              hash_compression_count - start;
+        if (spent >= budget) break;
+
+        /* The bottom subtree first; the signatures will need it sooner */
+        if (!offline_refresh( signer ) && !offline_step( signer, false )) {
+            return false;   /* We're all caught up */
+        }
+    }
+
+    /* Is there anything left to do? */
+    return can_refresh( signer ) || !signer->defer.next_ready;
+}
+
+unsigned long sh_signatures_remaining( struct sh_signer *signer ) {
+    if (!signer || !signer->initialized) return 0;
+#if BUILD_THREAD
+    if (signer->bg.running) pthread_mutex_lock( &signer->bg.lock );
+#endif
+    merkle_index_t index = signer->current_lms_index;
+    merkle_index_t bottom_subtree, refresh_index;
+    bool next_ready, failed;
+    if (signer->defer.active) {
+        bottom_subtree = signer->defer.bottom_subtree;
+        refresh_index = signer->defer.refresh_index;
+        next_ready = signer->defer.next_ready;
+    } else {
+        /* This is where start_deferred would put us */
+        bottom_subtree = index >> LMS_BOTTOM;
+        refresh_index = bottom_subtree << LMS_BOTTOM;
+        next_ready = signer->build_state == b_done;
+    }
+#if BUILD_THREAD
+    if (signer->bg.running) {
+        failed = signer->bg.failed;     /* The thread owns got_fatal_error */
+        pthread_mutex_unlock( &signer->bg.lock );
+    } else
+#endif
+    failed = signer->got_fatal_error;
+    if (failed) return 0;
+
+    /* We can sign to the end of the current bottom subtree, and through */
+    /* the next one if we've finished it */
+    merkle_index_t limit = (bottom_subtree + 1) << LMS_BOTTOM;
+    if (limit < LMS_END && refresh_index == limit) {
+        limit += 1 << LMS_BOTTOM;
+    }
+    unsigned long remaining = limit - index;
+    if (limit == LMS_END && next_ready) {
+        /* We can also go through the first bottom subtree of the next */
+        /* LMS tree (which the build gives us) */
+        remaining += 1 << LMS_BOTTOM;
+    }
+    return remaining;
+}
@@ -0,0 +1,122 @@
+/*
+ * Test for the online/offline split (sh_sign_online, sh_do_offline_work,
+ * sh_signatures_remaining)
+ *
+ * First, we sign online (with no offline work) until it fails, and check
+ * that it fails exactly when sh_signatures_remaining said it would.  Then
+ * we carry on signing online, giving sh_do_offline_work a hash budget
+ * every few signatures (and more when we run out), until we've moved on to
+ * the next LMS tree (and so have crossed bottom subtree boundaries, and an
+ * LMS tree switch).  We verify every signature
+ *
+ * 'make offline_test' builds and runs it
+ */
+#include "sphincs-hybrid.h"
+#include "test_common.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+#define BOTTOM_LEAVES 128                 /* Leaves in a bottom subtree */
+
+#define BUDGET 1000      /* Hash compressions of offline work we do */
+#define WORK_EVERY 4     /* after every this many signatures; that's not */
+                         /* enough to keep up, and so we run out (and */
+                         /* then have to do more) every so often */
+
+int main(void) {
+    struct sh_signer *sign = test_load_signer();
+    if (!sign) return 1;
+
+    /* Sign online until we run out */
+    unsigned long remaining = sh_signatures_remaining( sign );
+    unsigned long count = 0;
+    struct leaf_tracker track = { 0 };
+    if (remaining == 0) { printf( "Nothing to sign with\n" ); return 1; }
+    while (test_sign( sign, count, true )) {
+        /* (the failed sh_sign_online wipes sig; note it now) */
+        if (!track_leaf( &track )) return 1;
+        count++;
+        if (sh_signatures_remaining( sign ) != remaining - count) {
+            printf( "sh_signatures_remaining off after %lu signatures\n",
+                    count );
+            return 1;
+        }
+    }
+    if (count != remaining) {
+        printf( "Online signing failed after %lu signatures; expected %lu\n",
+                count, remaining );
+        return 1;
+    }
+    printf( "Online signing ran out after %lu signatures, as predicted\n",
+            count );
+
+    /* Now keep it going with offline work */
+    unsigned long subtree_crossings = 0, ran_out = 0, extra = 0;
+    long over_budget = 0;
+    while (extra < EXTRA_SIGS) {
+        if (count == MAX_SIGS) {
+            printf( "Never switched LMS trees\n" );
+            return 1;
+        }
+        if (sh_signatures_remaining( sign ) == 0) {
+            /* We've run out; online signing must fail now */
+            ran_out++;
+            if (test_sign( sign, count, true )) {
+                printf( "Signed online with no signatures remaining\n" );
+                return 1;
+            }
+        }
+        while (sh_signatures_remaining( sign ) == 0) {
+            long start = sh_hash_count();
+            if (!sh_do_offline_work( sign, BUDGET, SH_WORK_HASHES ) &&
+                sh_signatures_remaining( sign ) == 0) {
+                printf( "Offline work stopped with nothing to sign with\n" );
+                return 1;
+            }
+            if (sh_hash_count() - start < BUDGET &&
+                sh_signatures_remaining( sign ) == 0) {
+                printf( "Offline work stopped short of its budget\n" );
+                return 1;
+            }
+        }
+        remaining = sh_signatures_remaining( sign );
+        if (!test_sign( sign, count, true )) {
+            printf( "Online signature %lu failed with %lu remaining\n",
+                    count, remaining );
+            return 1;
+        }
+        if (sh_signatures_remaining( sign ) != remaining - 1) {
+            printf( "sh_signatures_remaining off after signature %lu\n",
+                    count );
+            return 1;
+        }
+        count++;
+
+        /* Where did that signature land? */
+        unsigned long prev_index = track.prev_index;
+        if (!track_leaf( &track )) return 1;
+        if (track.prev_index / BOTTOM_LEAVES != prev_index / BOTTOM_LEAVES) {
+            subtree_crossings++;
+        }
+        if (track.switched) extra++;
+
+        /* And do some offline work for the next ones */
+        if (count % WORK_EVERY != 0) continue;
+        long start = sh_hash_count();
+        if (sh_do_offline_work( sign, BUDGET, SH_WORK_HASHES ) &&
+            sh_hash_count() - start < BUDGET) {
+            printf( "Offline work stopped short of its budget\n" );
+            return 1;
+        }
+        long over = sh_hash_count() - start - BUDGET;
+        if (over > over_budget) over_budget = over;
+    }
+    sh_delete_signer( sign );
+
+    printf( "Signed and verified %lu signatures, crossing %lu bottom "
+            "subtrees and one LMS tree\n", count, subtree_crossings );
+    printf( "Ran out of signatures %lu times; went over the offline budget "
+            "by up to %ld hashes\n", ran_out, over_budget );
+    printf( "Passed\n" );
+    return 0;
+}
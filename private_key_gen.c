@@ -1,11 +1,16 @@
 #include "private_key_gen.h"
 #if KEYGEN_STRATEGY
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <stdlib.h>
 #else
 #include "sha256.h"
 #endif
 #include <string.h>
 #include "zeroize.h"
+#if KEYGEN_AESNI
+#include <immintrin.h>
+#include <pthread.h>
+#endif
 
 /*
  * This is the engine that produces XMSS and LMS private keys
@@ -25,23 +30,179 @@
  * from random output, assuming a secret key), and it's faster
  * than our hash function; it ends up giving perhaps 5% faster load
  * times in my expirements
+ *
+ * Our callers usually want a lot of keys at once (all the chains of a
+ * WOTS+ or LM-OTS key, a batch of FORS leaves); the AES encryptions for
+ * different keys are independent, so (on CPUs with AES-NI) we interleave
+ * them.  A single AES-256 encryption is 14 dependent AESENC instructions,
+ * each of which has a latency of several cycles, but the CPU can start
+ * one (or, with VAES, four) every cycle; hence by keeping 8 (or 16) blocks
+ * in flight, we keep the AES unit busy
  */
 
-void init_private_key_gen( struct private_key_generator *gen, 
-             const void *secret_key, int len_secret_key,
-             const void *extra, int len_extra ) {
+#if KEYGEN_AESNI
+/* 0 -> use OpenSSL, 1 -> use AES-NI, 2 -> also use VAES */
+static int aes_level;
+static pthread_once_t aes_level_once = PTHREAD_ONCE_INIT;
+
+static void find_aes_level(void) {
+    aes_level = 0;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports( "aes" )) {
+        aes_level = 1;
+        if (__builtin_cpu_supports( "vaes" ) &&
+            __builtin_cpu_supports( "avx512f" )) {
+            aes_level = 2;
+        }
+    }
+}
+
+static int get_aes_level(void) {
+    pthread_once( &aes_level_once, find_aes_level );
+    return aes_level;
+}
+
+/*
+ * The AES-256 key schedule, using AESKEYGENASSIST; this gives the same
+ * round keys as the standard AES-256 key expansion, in the byte order
+ * AESENC wants
+ */
+#define EXPAND_EVEN(rcon)                                       \
+    t = _mm_aeskeygenassist_si128( k1, rcon );                  \
+    t = _mm_shuffle_epi32( t, 0xff );                           \
+    k0 = _mm_xor_si128( k0, _mm_slli_si128( k0, 4 ) );          \
+    k0 = _mm_xor_si128( k0, _mm_slli_si128( k0, 4 ) );          \
+    k0 = _mm_xor_si128( k0, _mm_slli_si128( k0, 4 ) );          \
+    k0 = _mm_xor_si128( k0, t );                                \
+    _mm_storeu_si128( (__m128i *)rk[r++], k0 );
+#define EXPAND_ODD                                              \
+    t = _mm_aeskeygenassist_si128( k0, 0 );                     \
+    t = _mm_shuffle_epi32( t, 0xaa );                           \
+    k1 = _mm_xor_si128( k1, _mm_slli_si128( k1, 4 ) );          \
+    k1 = _mm_xor_si128( k1, _mm_slli_si128( k1, 4 ) );          \
+    k1 = _mm_xor_si128( k1, _mm_slli_si128( k1, 4 ) );          \
+    k1 = _mm_xor_si128( k1, t );                                \
+    _mm_storeu_si128( (__m128i *)rk[r++], k1 );
+
+static __attribute__((target("aes")))
+void expand_key_aesni( unsigned char (*rk)[16], const unsigned char *key ) {
+    __m128i k0 = _mm_loadu_si128( (const __m128i *)key );
+    __m128i k1 = _mm_loadu_si128( (const __m128i *)(key + 16) );
+    __m128i t;
+    int r = 0;
+    _mm_storeu_si128( (__m128i *)rk[r++], k0 );
+    _mm_storeu_si128( (__m128i *)rk[r++], k1 );
+    EXPAND_EVEN(0x01) EXPAND_ODD
+    EXPAND_EVEN(0x02) EXPAND_ODD
+    EXPAND_EVEN(0x04) EXPAND_ODD
+    EXPAND_EVEN(0x08) EXPAND_ODD
+    EXPAND_EVEN(0x10) EXPAND_ODD
+    EXPAND_EVEN(0x20) EXPAND_ODD
+    EXPAND_EVEN(0x40)
+}
+#undef EXPAND_EVEN
+#undef EXPAND_ODD
+
+/* Encrypt count blocks in place, 8 at a time */
+static __attribute__((target("aes")))
+void encrypt_blocks_aesni( unsigned char (*block)[16], unsigned count,
+                           const unsigned char (*rk)[16] ) {
+    __m128i k[15];
+    int r, j;
+    for (r = 0; r < 15; r++) {
+        k[r] = _mm_loadu_si128( (const __m128i *)rk[r] );
+    }
+    for (; count >= 8; count -= 8, block += 8) {
+        __m128i b[8];
+        for (j = 0; j < 8; j++) {
+            b[j] = _mm_xor_si128( k[0],
+                          _mm_loadu_si128( (const __m128i *)block[j] ) );
+        }
+        for (r = 1; r < 14; r++) {
+            for (j = 0; j < 8; j++) {
+                b[j] = _mm_aesenc_si128( b[j], k[r] );
+            }
+        }
+        for (j = 0; j < 8; j++) {
+            b[j] = _mm_aesenclast_si128( b[j], k[14] );
+            _mm_storeu_si128( (__m128i *)block[j], b[j] );
+        }
+    }
+    for (; count > 0; count--, block++) {
+        __m128i b = _mm_xor_si128( k[0],
+                          _mm_loadu_si128( (const __m128i *)block[0] ) );
+        for (r = 1; r < 14; r++) {
+            b = _mm_aesenc_si128( b, k[r] );
+        }
+        b = _mm_aesenclast_si128( b, k[14] );
+        _mm_storeu_si128( (__m128i *)block[0], b );
+    }
+}
+
+/* Encrypt count blocks in place, 16 at a time (4 per register) */
+static __attribute__((target("vaes,avx512f")))
+void encrypt_blocks_vaes( unsigned char (*block)[16], unsigned count,
+                          const unsigned char (*rk)[16] ) {
+    __m512i k[15];
+    int r, j;
+    for (r = 0; r < 15; r++) {
+        k[r] = _mm512_broadcast_i32x4(
+                          _mm_loadu_si128( (const __m128i *)rk[r] ) );
+    }
+    for (; count >= 16; count -= 16, block += 16) {
+        __m512i b[4];
+        for (j = 0; j < 4; j++) {
+            b[j] = _mm512_xor_si512( k[0],
+                          _mm512_loadu_si512( block[4*j] ) );
+        }
+        for (r = 1; r < 14; r++) {
+            for (j = 0; j < 4; j++) {
+                b[j] = _mm512_aesenc_epi128( b[j], k[r] );
+            }
+        }
+        for (j = 0; j < 4; j++) {
+            b[j] = _mm512_aesenclast_epi128( b[j], k[14] );
+            _mm512_storeu_si512( block[4*j], b[j] );
+        }
+    }
+    if (count > 0) {
+        encrypt_blocks_aesni( block, count, rk );
+    }
+}
+#endif
+
+/*
+ * Encrypt count 16 byte blocks (in place) with the generator's key
+ */
 #if KEYGEN_STRATEGY
-    if (len_secret_key >= 32) {
-        AES_set_encrypt_key( secret_key, 256, &gen->expanded_key );
-     } else {
-        /* We could go with AES-192 to handle 24 byte secrets */
-        /* Instead, we opt to stay with AES-256, and fix 64 bits */
-        unsigned char real_key[32] = { 0 };
-        memcpy( real_key, secret_key, len_secret_key );
-        AES_set_encrypt_key( real_key, 256, &gen->expanded_key );
-        zeroize( real_key, len_secret_key );
+static void encrypt_blocks( const struct private_key_generator *gen,
+                            unsigned char (*block)[16], unsigned count ) {
+#if KEYGEN_AESNI
+    switch (get_aes_level()) {
+    case 2: encrypt_blocks_vaes( block, count, gen->round_key ); return;
+    case 1: encrypt_blocks_aesni( block, count, gen->round_key ); return;
+    }
+#endif
+    /* No AES-NI; have OpenSSL do it.  The EVP interface wants a context */
+    /* that it allocates, and so this can fail only if we run out of */
+    /* memory; we don't have a way to report that (and carrying on with */
+    /* the wrong keys would be worse than stopping) */
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+    if (!ctx ||
+        !EVP_EncryptInit_ex( ctx, EVP_aes_256_ecb(), 0, gen->key, 0 ) ||
+        !EVP_CIPHER_CTX_set_padding( ctx, 0 ) ||
+        !EVP_EncryptUpdate( ctx, block[0], &len, block[0], 16 * count )) {
+        abort();
     }
+    EVP_CIPHER_CTX_free( ctx );   /* This also wipes the key schedule */
+}
+#endif
 
+#if KEYGEN_STRATEGY
+/* Compute the CBC-MAC of the extra data (which we xor into each state) */
+static void set_init( struct private_key_generator *gen,
+                      const void *extra, int len_extra ) {
     memset( gen->init, 0, 16 );
     const unsigned char *pc_extra = extra;
     for (; len_extra > 0; ) {
@@ -49,8 +210,34 @@ void init_private_key_gen( struct private_key_generator *gen,
         for (i = 0; i < 16 && len_extra > 0; i++, len_extra--) {
             gen->init[i] ^= *pc_extra++;
         }
-        AES_encrypt( gen->init, gen->init, &gen->expanded_key );
+        encrypt_blocks( gen, &gen->init, 1 );
+    }
+}
+#endif
+
+void init_private_key_gen( struct private_key_generator *gen, 
+             const void *secret_key, int len_secret_key,
+             const void *extra, int len_extra ) {
+#if KEYGEN_STRATEGY
+    /* We could go with AES-192 to handle 24 byte secrets */
+    /* Instead, we opt to stay with AES-256, and fix 64 bits */
+    unsigned char real_key[32] = { 0 };
+    if (len_secret_key > 32) len_secret_key = 32;
+    memcpy( real_key, secret_key, len_secret_key );
+#if KEYGEN_AESNI
+    if (get_aes_level() > 0) {
+        expand_key_aesni( gen->round_key, real_key );
+        memset( gen->key, 0, sizeof gen->key );
+    } else {
+        memset( gen->round_key, 0, sizeof gen->round_key );
+        memcpy( gen->key, real_key, sizeof gen->key );
     }
+#else
+    memcpy( gen->key, real_key, sizeof gen->key );
+#endif
+    zeroize( real_key, sizeof real_key );
+
+    set_init( gen, extra, len_extra );
 #else
     /*
      * What we would like is the have the do_private_key_gen compute
@@ -77,6 +264,37 @@ void init_private_key_gen( struct private_key_generator *gen,
 #endif
 }
 
+void init_private_key_seed( struct private_key_seed *seed,
+             const void *secret_key, int len_secret_key ) {
+    init_private_key_gen( &seed->gen, secret_key, len_secret_key, 0, 0 );
+#if !KEYGEN_STRATEGY
+    if (len_secret_key > 32) len_secret_key = 32;
+    memcpy( seed->secret, secret_key, len_secret_key );
+    seed->len_secret = len_secret_key;
+#endif
+}
+
+void init_private_key_gen_from_seed( struct private_key_generator *gen, 
+             const struct private_key_seed *seed,
+             const void *extra, int len_extra ) {
+    if (len_extra == 0) {
+        *gen = seed->gen;
+        return;
+    }
+#if KEYGEN_STRATEGY
+    /* Reuse the key schedule; all we need to compute is the CBC-MAC */
+#if KEYGEN_AESNI
+    memcpy( gen->round_key, seed->gen.round_key, sizeof gen->round_key );
+#endif
+    memcpy( gen->key, seed->gen.key, sizeof gen->key );
+    set_init( gen, extra, len_extra );
+#else
+    /* The extra is hashed along with the secret; nothing to reuse */
+    init_private_key_gen( gen, seed->secret, seed->len_secret,
+                          extra, len_extra );
+#endif
+}
+
 #if KEYGEN_STRATEGY
 static void do_xor( unsigned char *dest, const unsigned char *a,
                     const unsigned char *b, int len) {
@@ -91,11 +309,11 @@ void do_private_key_gen( void *dest, int n,
 #if KEYGEN_STRATEGY
     unsigned char *pc_dest = dest;
 
-    unsigned char buffer[16]; 
-    do_xor( buffer, state, gen->init, 16 );
+    unsigned char buffer[1][16]; 
+    do_xor( buffer[0], state, gen->init, 16 );
     int i;
     for (i = 0; n > 0; i++) {
-        AES_encrypt( buffer, buffer, &gen->expanded_key );
+        encrypt_blocks( gen, buffer, 1 );
         int this_len;
         if (n > 16) this_len = 16; else this_len = n;
         memcpy( pc_dest, buffer, this_len );
@@ -104,14 +322,73 @@ void do_private_key_gen( void *dest, int n,
     }
     zeroize( buffer, sizeof buffer );
 #else
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, gen->hash, 32 );
-    SHA256_Update(&ctx, state, 16 );
+    unsigned char input[32 + 16];   /* hash || state */
+    memcpy( input, gen->hash, 32 );
+    memcpy( input + 32, state, 16 );
     unsigned char buffer[32];
-    SHA256_Final( buffer, &ctx );
-    zeroize( &ctx, sizeof ctx );
+    const void *input_p = input;
+    unsigned char *buffer_p = buffer;
+    SHA256_multi_secret( &buffer_p, &input_p, sizeof input, 1 );
     memcpy( dest, buffer, n );  /* We assume n <= 32 */
+    zeroize( input, sizeof input );
     zeroize( buffer, sizeof buffer );
 #endif 
 }
+
+void do_private_key_gen_many( unsigned char *const *dest, int n,
+             const struct private_key_generator *gen,
+             const unsigned char *const *state, unsigned count ) {
+#if KEYGEN_STRATEGY
+    /* Each key is a short chain of AES operations; we run the chains */
+    /* of KEYS_AT_ONCE keys side by side */
+#define KEYS_AT_ONCE 16
+    unsigned char buffer[KEYS_AT_ONCE][16];
+    unsigned i, base;
+    for (base = 0; base < count; base += KEYS_AT_ONCE) {
+        unsigned this_count = count - base;
+        if (this_count > KEYS_AT_ONCE) this_count = KEYS_AT_ONCE;
+        for (i=0; i<this_count; i++) {
+            do_xor( buffer[i], state[base+i], gen->init, 16 );
+        }
+        /* The first block is the CBC-MAC of the state; we then go into */
+        /* OFB mode for the rest of the key */
+        int offset;
+        for (offset = 0; offset < n; offset += 16) {
+            encrypt_blocks( gen, buffer, this_count );
+            int this_len = n - offset;
+            if (this_len > 16) this_len = 16;
+            for (i=0; i<this_count; i++) {
+                memcpy( dest[base+i] + offset, buffer[i], this_len );
+            }
+        }
+    }
+    zeroize( buffer, sizeof buffer );
+#else
+    /* Each key is the hash of a 48 byte input; do several at a time */
+#define KEYS_AT_ONCE SHA256_MAX_LANES
+    unsigned char input[KEYS_AT_ONCE][32 + 16];  /* hash || state */
+    unsigned char buffer[KEYS_AT_ONCE][32];
+    const void *input_p[KEYS_AT_ONCE];
+    unsigned char *buffer_p[KEYS_AT_ONCE];
+    unsigned i, base;
+    for (i=0; i<KEYS_AT_ONCE; i++) {
+        memcpy( input[i], gen->hash, 32 );
+        input_p[i] = input[i];
+        buffer_p[i] = buffer[i];
+    }
+    for (base = 0; base < count; base += KEYS_AT_ONCE) {
+        unsigned this_count = count - base;
+        if (this_count > KEYS_AT_ONCE) this_count = KEYS_AT_ONCE;
+        for (i=0; i<this_count; i++) {
+            memcpy( input[i] + 32, state[base+i], 16 );
+        }
+        SHA256_multi_secret( buffer_p, input_p, sizeof input[0],
+                             this_count );
+        for (i=0; i<this_count; i++) {
+            memcpy( dest[base+i], buffer[i], n );  /* We assume n <= 32 */
+        }
+    }
+    zeroize( input, sizeof input );
+    zeroize( buffer, sizeof buffer );
+#endif
+}
@@ -36,14 +36,24 @@
  * with the identifier
  */
 
-#if KEYGEN_STRATEGY
-#include <openssl/aes.h>
+#if KEYGEN_STRATEGY && defined(__GNUC__) && \
+                         (defined(__x86_64__) || defined(__i386__))
+#define KEYGEN_AESNI 1  /* We can use AES-NI (if the CPU has it) */
+#else
+#define KEYGEN_AESNI 0
 #endif
 
 struct private_key_generator {
 #if KEYGEN_STRATEGY
     unsigned char init[16];
-    AES_KEY expanded_key;
+#if KEYGEN_AESNI
+    unsigned char round_key[15][16]; /* The AES-256 key schedule, in the */
+                                 /* form the AES-NI instructions use it */
+                                 /* (only set if the CPU has AES-NI) */
+#endif
+    unsigned char key[32];       /* The AES-256 key, for OpenSSL (which */
+                                 /* does its own key schedule); only set */
+                                 /* if we don't have AES-NI */
 #else
     unsigned char hash[32];
 #endif
@@ -53,7 +63,41 @@ void init_private_key_gen( struct private_key_generator *gen,
              const void *secret_key, int len_secret_key,
              const void *extra, int len_extra );
 
+/*
+ * The part of the private key generator that depends only on the secret
+ * (in AES mode, the key schedule); the signer keeps one of these for each
+ * of its long-lived secrets, so that it doesn't have to redo that work
+ * every time it sets up a generator
+ */
+struct private_key_seed {
+    struct private_key_generator gen;  /* The generator with no extra */
+#if !KEYGEN_STRATEGY
+    unsigned char secret[32];  /* In SHA-256 mode, the extra is hashed */
+    int len_secret;            /* together with the secret */
+#endif
+};
+
+void init_private_key_seed( struct private_key_seed *seed,
+             const void *secret_key, int len_secret_key );
+
+/*
+ * This gives the same generator as init_private_key_gen with the secret
+ * that seed was set up with
+ */
+void init_private_key_gen_from_seed( struct private_key_generator *gen, 
+             const struct private_key_seed *seed,
+             const void *extra, int len_extra );
+
 void do_private_key_gen( void *dest, int n, 
              const struct private_key_generator *gen, const void *state );
 
+/*
+ * Generate count keys at once; dest[i] gets the key for state[i].  This
+ * is faster than count separate calls (we can compute several at once;
+ * with AES-NI, we keep 8 (or, with VAES, 16) blocks in flight)
+ */
+void do_private_key_gen_many( unsigned char *const *dest, int n,
+             const struct private_key_generator *gen,
+             const unsigned char *const *state, unsigned count );
+
 #endif /* PRIVATE_KEY_GEN_H_ */
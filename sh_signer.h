@@ -8,6 +8,9 @@
 #include "lms_common_defs.h"
 #include "sha256.h"
 #include <stdbool.h>
+#if BUILD_THREAD
+#include <pthread.h>
+#endif
 
 /* These defines are about the LMS architecture */
 #define LMS_H     20   /* Total of 20 LMS levels */
@@ -44,6 +47,17 @@
 #define SPH_DLEN (SPH_D * 51) /* Total number of hashes in the WOTS sigs */
 #define LEN_SPHINCS_SIG (24 * (1 + SPH_K*(SPH_A+1) + (SPH_H + SPH_DLEN) ))
 
+/*
+ * A Merkle tree of the hypertree that we've built before, and kept (just
+ * the top one; it's the same tree in every signature)
+ */
+struct hyper_cache_entry {
+    bool valid;              /* Set once we've built (and checked) it */
+    uint64_t tree;           /* Which tree within its layer this is */
+    unsigned char node[ (2 << SPH_T) - 1 ][ 24 ]; /* All the nodes, */
+                             /* indexed by MERKLE_NODE( SPH_T, h, j ) */
+};
+
 struct sh_signer {
     bool initialized;
     bool got_fatal_error;
@@ -52,8 +66,11 @@ struct sh_signer {
     hash_t hash; 
     unsigned n;
     unsigned char sk_seed[MAX_HASH_LEN];
+    struct private_key_seed sk_seed_gen; /* The expanded version of */
+                                  /* sk_seed; every FORS and Merkle */
+                                  /* private key generator starts here */
     unsigned char pk_seed[MAX_HASH_LEN];
-    SHA256_FIRSTBLOCK pk_seed_pre;  /* Preprocessed version of pk_seed */
+    struct sphincs_seed pk_seed_pre;  /* Preprocessed version of pk_seed */
     unsigned char sk_prf[MAX_HASH_LEN];
     unsigned char root[MAX_HASH_LEN];
 
@@ -101,7 +118,7 @@ struct sh_signer {
                                   /* previous Merkle root value */
             unsigned char next_root[ MAX_HASH_LEN ]; /* The root value */
                                   /* for this Merkle tree */
-#if FAULT_STRATEGY
+#if FAULT_RECOMPUTE
             unsigned char redundant_root[ MAX_HASH_LEN ]; /* In redundant */
                                   /* mode, where we place the recomputed */
                                   /* Merkle tree root */
@@ -112,6 +129,9 @@ struct sh_signer {
                            /* 2 -> currently recomputnig on the Merkle */
                            /*      tree (for fault tolerance) */
             unsigned save_sphincs_sig_index; /* In case we need to restart */
+            struct hyper_cache_entry *fill; /* Where in the cache we're */
+                           /* saving the tree we're building (NULL if */
+                           /* we're not) */
             struct build_merkle_state merk;
         } do_hyper;  /* The b_hypertree step */
     } temp;
@@ -122,6 +142,9 @@ struct sh_signer {
         /* The seed (secret values to generate secret values) for this */
         /* LMS tree and the next */
     unsigned char current_lms_seed[32], next_lms_seed[32];
+        /* The private key generators for those seeds (set up when we */
+        /* pick the seed, so we don't expand the key every time we use it) */
+    struct private_key_generator current_lms_gen, next_lms_gen;
         /* The I values (public key identifier) for this LMS tree and */
         /* the next */
     unsigned char current_lms_I[16], next_lms_I[16];
@@ -147,6 +170,43 @@ struct sh_signer {
     unsigned sphincs_sig_index;  /* Where we are in the process of writing */
                                  /* the next_sphincs_sig */
 
+/* The hypertree tree we've kept from previous signatures */
+    struct hyper_cache_entry top_tree;  /* The top tree (layer SPH_D-1) */
+
+/* When the build work is done apart from the signatures (by the build */
+/* thread, or by sh_do_offline_work) */
+    struct {
+        bool active;             /* Set once we've started doing it that */
+                                 /* way; the fields below are used only */
+                                 /* then */
+        bool next_ready;         /* We've finished the next LMS tree and */
+                                 /* Sphincs+ signature; we switch to */
+                                 /* them once we've used up the current */
+                                 /* LMS tree */
+        merkle_index_t bottom_subtree; /* Which bottom subtree of the */
+                                 /* current LMS tree is in */
+                                 /* current_lms_bottom_subtree */
+        merkle_index_t refresh_index; /* The LMS index whose leaf of the */
+                                 /* next bottom subtree we compute next */
+        unsigned char *spare_lms_bottom_subtree; /* Where we build the */
+                                 /* next bottom subtree */
+    } defer;
+
+#if BUILD_THREAD
+/* The background build thread (see sh_start_build_thread) */
+    struct {
+        bool running;            /* Set once the thread has started; */
+                                 /* the fields below are used only then */
+        bool stop;               /* Tells the thread to exit */
+        bool failed;             /* The thread hit a fatal error */
+        pthread_t thread;
+        pthread_mutex_t lock;    /* Protects the above (other than */
+                                 /* running and thread), and defer */
+        pthread_cond_t work;     /* Wakes up the thread */
+        pthread_cond_t ready;    /* Wakes up a signer waiting on it */
+    } bg;
+#endif
+
 /* These are storage areas for large components, where we need to */
 /* switch between current and next; we'd prefer not to do a large copy */
 /* and so we just swap pointers */
@@ -154,6 +214,8 @@ struct sh_signer {
     unsigned char lms_top_2[ 24 * ((2 << LMS_TOP)-2) ];
     unsigned char lms_bottom_1[ 24 * ((2 << LMS_BOTTOM)-2) ];
     unsigned char lms_bottom_2[ 24 * ((2 << LMS_BOTTOM)-2) ];
+    unsigned char lms_bottom_3[ 24 * ((2 << LMS_BOTTOM)-2) ]; /* The */
+                                 /* spare, once defer is active */
     unsigned char sph_sig_1[LEN_SPHINCS_SIG];
     unsigned char sph_sig_2[LEN_SPHINCS_SIG];
 };
@@ -161,4 +223,66 @@ struct sh_signer {
 /* Advance the generation of the next LMS tree and Sphnics+ sig one step */
 bool step_next( struct sh_signer *signer, bool do_dummy );
 
+/*
+ * The same, for use during the load process; if LOAD_THREADS > 1, this
+ * does entire phases at once, spread over several threads
+ */
+bool step_next_load( struct sh_signer *signer );
+
+/*
+ * Switch to the next LMS tree and Sphincs+ signature that we've just
+ * finished building
+ */
+void switch_lms_tree( struct sh_signer *signer );
+
+/*
+ * Compute the leaf of the next bottom LMS subtree that goes with the LMS
+ * index (that is, the leaf 1<<LMS_BOTTOM past it), and place it (and any
+ * internal nodes it completes) into bottom_subtree.  This can be done once
+ * the signature for that index has been generated
+ */
+void refresh_lms_bottom( struct sh_signer *signer, merkle_index_t index,
+                         unsigned char *bottom_subtree );
+
+/*
+ * Doing the build work apart from the signatures (offline.c)
+ * start_deferred switches the signer over to doing it that way
+ * can_refresh returns true if we can compute a leaf of the next bottom
+ * subtree now
+ * deferred_handoff moves to the next bottom subtree or LMS tree if the
+ * next signature needs them, and returns true if everything that
+ * signature needs is in place
+ * deferred_ready and deferred_catch_up do the same when there's no build
+ * thread (starting the deferred mode if need be); deferred_ready fails if
+ * there's work that needs doing first, deferred_catch_up does that work
+ * deferred_work does a refresh and a build step (if there are any to do)
+ */
+#define LMS_END ((merkle_index_t)1 << LMS_ACTUAL) /* The LMS index just */
+                                 /* past the end of the LMS tree */
+void start_deferred( struct sh_signer *signer );
+bool can_refresh( struct sh_signer *signer );
+bool deferred_handoff( struct sh_signer *signer );
+bool deferred_ready( struct sh_signer *signer );
+bool deferred_catch_up( struct sh_signer *signer );
+void deferred_work( struct sh_signer *signer, bool do_dummy );
+
+#if BUILD_THREAD
+/*
+ * The signer's side of the background build thread (build_thread.c)
+ * build_thread_wait waits until everything the signature with the next LMS
+ * index needs is in place (and moves to the next bottom subtree or LMS tree
+ * if it's time); it returns false if the thread failed.  If wait is clear,
+ * it doesn't wait; it returns false if the thread hasn't got that far yet
+ * build_thread_stop stops the thread (if it is running)
+ */
+bool build_thread_wait( struct sh_signer *signer, bool wait );
+void build_thread_stop( struct sh_signer *signer );
+#endif
+
+/*
+ * Fill in the top tree of the hypertree cache from its leaves (each 24
+ * bytes, left to right); returns false if they don't lead to our root
+ */
+bool load_top_tree( struct sh_signer *signer, const unsigned char *leaves );
+
 #endif /* SH_SIGNER_H_ */
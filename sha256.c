@@ -13,18 +13,42 @@
 
 #include <string.h>
 #include "sha256.h"
+#include "sha256_backend.h"
 #include "endian.h"
-long hash_compression_count = 0;  /* Running count of the number of */
-                                  /* SHA-256 hash compression operations */
-                                  /* performed.  Actually only if we're */
-                                  /* using our SHA-256 implementation */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA_NI 1   /* We can use the x86 SHA extensions (if the CPU */
+                   /* has them) */
+#include <immintrin.h>
+#else
+#define SHA_NI 0
+#endif
+_Thread_local long hash_compression_count = 0;  /* Running count of the */
+                                  /* number of SHA-256 hash compression */
+                                  /* operations this thread performed */
+                                  /* (whichever backend did it) */
+
+/* The number of compression operations the last sh_sign, step_next and */
+/* sh_verify call on this thread performed */
+#define NUM_OPS 3
+static _Thread_local long last_count[NUM_OPS];
+
+void SHA256_account( int op, long start ) {
+    last_count[op] = hash_compression_count - start;
+}
 
-#if !USE_OPENSSL
+long sh_hash_count( void ) {
+    return hash_compression_count;
+}
+
+long sh_last_hash_count( int op ) {
+    if (op < 0 || op >= NUM_OPS) return 0;
+    return last_count[op];
+}
 
-/* If we don't have OpenSSL, here's a SHA256 implementation */
+/* Our portable SHA256 implementation (derived from LibTomCrypt) */
 #define SHA256_FINALCOUNT_SIZE  8
 #define SHA256_K_SIZE	        64
-static const uint_fast32_t K[SHA256_K_SIZE] = {
+static const uint32_t K[SHA256_K_SIZE] = {
     0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
     0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
     0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
@@ -40,80 +64,333 @@ static const uint_fast32_t K[SHA256_K_SIZE] = {
     0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
 };
 
-/* Various logical functions */
-
-/* Rotate x right by rot bits */
-static uint_fast32_t RORc(uint_fast32_t x, int rot) {
-    rot &= 31; if (rot == 0) return x;
-    uint_fast32_t right = ((x&0xFFFFFFFFUL)>>rot );
-    uint_fast32_t left  = ((x&0xFFFFFFFFUL)<<(32-rot) );
-    return (right|left) & 0xFFFFFFFFUL;
-}
-#define Ch(x,y,z)       (z ^ (x & (y ^ z)))
-#define Maj(x,y,z)      (((x | y) & z) | (x & y)) 
-#define S(x, n)         RORc((x),(n))
-#define R(x, n)         (((x)&0xFFFFFFFFUL)>>(n))
-#define Sigma0(x)       (S(x, 2) ^ S(x, 13) ^ S(x, 22))
-#define Sigma1(x)       (S(x, 6) ^ S(x, 11) ^ S(x, 25))
-#define Gamma0(x)       (S(x, 7) ^ S(x, 18) ^ R(x, 3))
-#define Gamma1(x)       (S(x, 17) ^ S(x, 19) ^ R(x, 10))
-
-static void sha256_compress (SHA256_CTX * ctx, const void *buf)
+/*
+ * Various logical functions
+ * These all work on uint32_t's, so the compiler knows it doesn't have to
+ * mask anything to 32 bits; it'll also recognize the rotate idiom and turn
+ * it into a single instruction
+ */
+#define ROR(x, n)       (((x) >> (n)) | ((x) << (32-(n))))
+#define Ch(x,y,z)       ((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x,y,z)      ((((x) | (y)) & (z)) | ((x) & (y)))
+#define Sigma0(x)       (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define Sigma1(x)       (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define Gamma0(x)       (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define Gamma1(x)       (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+/* Read a bigendian 32 bit word (inline; this is on our critical path) */
+#define LOAD_BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                      ((uint32_t)(p)[2] <<  8) |  (uint32_t)(p)[3])
+
+/*
+ * The compression function proper.  We compile this twice; once for any
+ * CPU, and (on x86) once for CPUs with the BMI2 instructions (which give us
+ * a non-destructive rotate, and that makes a surprising difference)
+ */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+static ALWAYS_INLINE void compress_body (uint32_t *h, const void *buf)
 {
-hash_compression_count += 1;
-    uint_fast32_t S0, S1, S2, S3, S4, S5, S6, S7, W[SHA256_K_SIZE], t0, t1, t;
+    uint32_t a, b, c, d, e, f, g, hh, W[16], t0, t1, bc;
+    const unsigned char *p = buf;
     int i;
-    const unsigned char *p;
-
-    /* copy state into S */
-    S0 = ctx->h[0];
-    S1 = ctx->h[1];
-    S2 = ctx->h[2];
-    S3 = ctx->h[3];
-    S4 = ctx->h[4];
-    S5 = ctx->h[5];
-    S6 = ctx->h[6];
-    S7 = ctx->h[7];
 
     /*
      * We've been asked to perform the hash computation on this 512-bit string.
-     * SHA256 interprets that as an array of 16 bigendian 32 bit numbers; copy
-     * it, and convert it into 16 unsigned long's of the CPU's native format
+     * SHA256 interprets that as an array of 16 bigendian 32 bit numbers;
+     * convert them into the CPU's native format
+     */
+    for (i=0; i<16; i++, p += 4) {
+        W[i] = LOAD_BE32(p);
+    }
+
+    /* copy state into the working variables */
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+    bc = b ^ c;
+
+    /*
+     * Compress
+     * The rounds are fully unrolled; rather than shuffling the working
+     * variables at the end of each round, we rename them in the next one.
+     * After the first 16 rounds, W[] is a rolling window of the last 16
+     * message schedule words, which we expand in place as we go (this
+     * turns out to be faster than expanding the whole schedule up front,
+     * as it gives the CPU independent work to overlap with the rounds)
+     * We also compute Maj(a,b,c) as b ^ ((a^b) & (b^c)); a^b is the next
+     * round's b^c, and so that saves us an operation per round
+     */
+#define RND(a,b,c,d,e,f,g,h,i)                                        \
+     if (i >= 16) {                                                   \
+         W[(i)&15] += Gamma1(W[((i)-2)&15]) + W[((i)-7)&15] +         \
+                      Gamma0(W[((i)-15)&15]);                         \
+     }                                                                \
+     t0 = h + Sigma1(e) + Ch(e, f, g) + K[i] + W[(i)&15];             \
+     t1 = a ^ b;                                                      \
+     h  = Sigma0(a) + (b ^ (t1 & bc));                                \
+     bc = t1;                                                         \
+     d += t0;                                                         \
+     h += t0;
+#define RND8(i)                                        \
+     RND(a,b,c,d,e,f,g,hh,(i)+0);                      \
+     RND(hh,a,b,c,d,e,f,g,(i)+1);                      \
+     RND(g,hh,a,b,c,d,e,f,(i)+2);                      \
+     RND(f,g,hh,a,b,c,d,e,(i)+3);                      \
+     RND(e,f,g,hh,a,b,c,d,(i)+4);                      \
+     RND(d,e,f,g,hh,a,b,c,(i)+5);                      \
+     RND(c,d,e,f,g,hh,a,b,(i)+6);                      \
+     RND(b,c,d,e,f,g,hh,a,(i)+7);
+
+    RND8( 0) RND8( 8) RND8(16) RND8(24)
+    RND8(32) RND8(40) RND8(48) RND8(56)
+#undef RND8
+#undef RND
+
+    /* feedback */
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static void sha256_compress_portable (uint32_t *h, const void *buf)
+{
+    compress_body( h, buf );
+}
+
+#if SHA_NI
+static __attribute__((target("bmi2")))
+void sha256_compress_bmi2 (uint32_t *h, const void *buf)
+{
+    compress_body( h, buf );
+}
+#endif
+
+#if SHA_NI
+/*
+ * This is the same compression function, using the x86 SHA extensions
+ * (sha256rnds2/sha256msg1/sha256msg2); this is considerably faster than
+ * the portable version above (when the CPU supports it)
+ *
+ * The SHA instructions want the state as the ABEF and CDGH halves, and
+ * they perform two rounds at a time; we run the message schedule four
+ * words (one xmm register) at a time, with MSG[] being a rolling window
+ * of the last 16 message words
+ */
+static __attribute__((target("sha,sse4.1")))
+void sha256_compress_shani (uint32_t *h, const void *buf)
+{
+    static const uint32_t K32[SHA256_K_SIZE] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+        0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+        0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+        0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+        0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+        0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+        0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    /* Converts the bigendian message words into native format */
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    const unsigned char *p = buf;
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save, MSG[4];
+
+    /* Rearrange the state into ABEF/CDGH order */
+    tmp = _mm_loadu_si128((const __m128i *)&h[0]);          /* DCBA */
+    state1 = _mm_loadu_si128((const __m128i *)&h[4]);       /* HGFE */
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                     /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B);               /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);               /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);            /* CDGH */
+    abef_save = state0;
+    cdgh_save = state1;
+
+    /*
+     * Perform rounds 4*k to 4*k+3
+     * While we're at it, we also advance the message schedule:
+     * - sha256msg2 completes the 4 words we'll need next round
+     * - sha256msg1 starts the computation of the 4 words after that
      */
-    p = buf;
-    for (i=0; i<16; i++) {
-        W[i] = get_bigendian( p, 4 );
-        p += 4;
+#define QUAD(k) {                                                          \
+        if ((k) < 4) {                                                     \
+            MSG[k] = _mm_shuffle_epi8(                                     \
+                    _mm_loadu_si128((const __m128i *)(p + 16*(k))), mask); \
+        }                                                                  \
+        msg = _mm_add_epi32(MSG[(k)&3],                                    \
+                    _mm_loadu_si128((const __m128i *)&K32[4*(k)]));        \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);               \
+        if ((k) >= 3 && (k) <= 14) {                                       \
+            tmp = _mm_alignr_epi8(MSG[(k)&3], MSG[((k)-1)&3], 4);          \
+            MSG[((k)+1)&3] = _mm_add_epi32(MSG[((k)+1)&3], tmp);           \
+            MSG[((k)+1)&3] = _mm_sha256msg2_epu32(MSG[((k)+1)&3],          \
+                                                  MSG[(k)&3]);             \
+        }                                                                  \
+        msg = _mm_shuffle_epi32(msg, 0x0E);                                \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);               \
+        if ((k) >= 1 && (k) <= 12) {                                       \
+            MSG[((k)-1)&3] = _mm_sha256msg1_epu32(MSG[((k)-1)&3],          \
+                                                  MSG[(k)&3]);             \
+        }                                                                  \
     }
+    QUAD( 0) QUAD( 1) QUAD( 2) QUAD( 3)
+    QUAD( 4) QUAD( 5) QUAD( 6) QUAD( 7)
+    QUAD( 8) QUAD( 9) QUAD(10) QUAD(11)
+    QUAD(12) QUAD(13) QUAD(14) QUAD(15)
+#undef QUAD
 
-    /* fill W[16..63] */
-    for (i = 16; i < SHA256_K_SIZE; i++) {
-        W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
-    }        
-
-    /* Compress */
-#define RND(a,b,c,d,e,f,g,h,i)                         \
-     t0 = h + Sigma1(e) + Ch(e, f, g) + K[i] + W[i];   \
-     t1 = Sigma0(a) + Maj(a, b, c);                    \
-     d += t0;                                          \
-     h  = t0 + t1;
-
-     for (i = 0; i < SHA256_K_SIZE; ++i) {
-         RND(S0,S1,S2,S3,S4,S5,S6,S7,i);
-         t = S7; S7 = S6; S6 = S5; S5 = S4; 
-         S4 = S3; S3 = S2; S2 = S1; S1 = S0; S0 = t;
-     }
-#undef RND     
- 
     /* feedback */
-    ctx->h[0] = (ctx->h[0] + S0) & 0xffffffff;
-    ctx->h[1] = (ctx->h[1] + S1) & 0xffffffff;
-    ctx->h[2] = (ctx->h[2] + S2) & 0xffffffff;
-    ctx->h[3] = (ctx->h[3] + S3) & 0xffffffff;
-    ctx->h[4] = (ctx->h[4] + S4) & 0xffffffff;
-    ctx->h[5] = (ctx->h[5] + S5) & 0xffffffff;
-    ctx->h[6] = (ctx->h[6] + S6) & 0xffffffff;
-    ctx->h[7] = (ctx->h[7] + S7) & 0xffffffff;
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+
+    /* And put the state back into the normal order */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                  /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);               /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);            /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);               /* HGFE */
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+static void portable_compress( uint32_t *h, const void *blocks,
+                               unsigned num_blocks ) {
+    const unsigned char *p = blocks;
+    for (; num_blocks > 0; num_blocks--, p += 64) {
+        sha256_compress_portable( h, p );
+    }
+}
+
+/* The portable version also serves as a (one lane) multi-lane backend */
+static void portable_compress_multi( uint32_t *state,
+                                     const unsigned char *const *block ) {
+    sha256_compress_portable( state, block[0] );
+}
+
+/*
+ * Hash a message in one go, given the compression function
+ */
+static void hash_message( void (*compress)( uint32_t *, const void * ),
+                          unsigned char *digest,
+                          const void *message, size_t len ) {
+    uint32_t h[8];
+    unsigned char block[128];
+    const unsigned char *p = message;
+    size_t full_blocks = len / 64;
+    unsigned tail = len % 64;
+    unsigned i;
+
+    memcpy( h, SHA256_IV.h, sizeof h );
+    for (; full_blocks > 0; full_blocks--, p += 64) {
+        compress( h, p );
+    }
+    memcpy( block, p, tail );
+    SHA256_pad_blocks( block, tail, len - tail );
+    for (i=0; i<SHA256_PADDED_BLOCKS(tail); i++) {
+        compress( h, block + 64*i );
+    }
+    for (i=0; i<8; i++) {
+        put_bigendian( digest + 4*i, h[i], 4 );
+    }
+}
+
+static void portable_hash( unsigned char *digest,
+                           const void *message, size_t len ) {
+    hash_message( sha256_compress_portable, digest, message, len );
+}
+
+static bool portable_supported( void ) {
+    return true;
+}
+
+const struct sha256_backend sha256_backend_portable = {
+    "portable", portable_supported, portable_hash, portable_compress,
+    portable_compress_multi, 1
+};
+
+#if SHA_NI
+static void bmi2_compress( uint32_t *h, const void *blocks,
+                           unsigned num_blocks ) {
+    const unsigned char *p = blocks;
+    for (; num_blocks > 0; num_blocks--, p += 64) {
+        sha256_compress_bmi2( h, p );
+    }
+}
+
+static void bmi2_compress_multi( uint32_t *state,
+                                 const unsigned char *const *block ) {
+    sha256_compress_bmi2( state, block[0] );
+}
+
+static void bmi2_hash( unsigned char *digest,
+                       const void *message, size_t len ) {
+    hash_message( sha256_compress_bmi2, digest, message, len );
+}
+
+static bool bmi2_supported( void ) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2");
+}
+
+const struct sha256_backend sha256_backend_bmi2 = {
+    "portable-bmi2", bmi2_supported, bmi2_hash, bmi2_compress,
+    bmi2_compress_multi, 1
+};
+
+static void shani_compress( uint32_t *h, const void *blocks,
+                            unsigned num_blocks ) {
+    const unsigned char *p = blocks;
+    for (; num_blocks > 0; num_blocks--, p += 64) {
+        sha256_compress_shani( h, p );
+    }
+}
+
+static void shani_compress_multi( uint32_t *state,
+                                  const unsigned char *const *block ) {
+    sha256_compress_shani( state, block[0] );
+}
+
+static void shani_hash( unsigned char *digest,
+                        const void *message, size_t len ) {
+    hash_message( sha256_compress_shani, digest, message, len );
+}
+
+static bool shani_supported( void ) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+const struct sha256_backend sha256_backend_shani = {
+    "sha-ni", shani_supported, shani_hash, shani_compress,
+    shani_compress_multi, 1
+};
+#else
+static bool not_supported( void ) {
+    return false;
+}
+
+const struct sha256_backend sha256_backend_bmi2 = {
+    "portable-bmi2", not_supported, 0, 0, 0, 0
+};
+const struct sha256_backend sha256_backend_shani = {
+    "sha-ni", not_supported, 0, 0, 0, 0
+};
+#endif
+
+/*
+ * Compress blocks into the midstate h, using whichever backend we've
+ * selected
+ */
+static void compress_blocks( uint32_t *h, const void *blocks,
+                             unsigned num_blocks ) {
+    hash_compression_count += num_blocks;
+    sha256_backend( SH_HASH_MIDSTATE )->compress( h, blocks, num_blocks );
 }
 
 void SHA256_Init (SHA256_CTX *ctx)
@@ -153,7 +430,7 @@ void SHA256_Update (SHA256_CTX *ctx, const void *src, unsigned int count)
         count -= this_step;
         ctx->num = 0;
 
-        sha256_compress( ctx, ctx->data );
+        compress_blocks( ctx->h, ctx->data, 1 );
     }
 }
 
@@ -175,7 +452,7 @@ void SHA256_Final (unsigned char *digest, SHA256_CTX *ctx)
     }
     memset( ctx->data + ctx->num, 0, 56 - ctx->num );
     ctx->num = 56;
-    SHA256_Update(ctx, finalcount, SHA256_FINALCOUNT_SIZE);  /* Should cause a sha256_compress() */
+    SHA256_Update(ctx, finalcount, SHA256_FINALCOUNT_SIZE);  /* Should cause a compress_blocks() */
 
     /*
      * The final state is an array of unsigned long's; place them as a series
@@ -185,19 +462,61 @@ void SHA256_Final (unsigned char *digest, SHA256_CTX *ctx)
         put_bigendian( digest + 4*i, ctx->h[i], 4 );
     }
 }
-#endif
+
+void SHA256_hash( unsigned char *digest, const void *message, size_t len ) {
+    hash_compression_count += len/64 + SHA256_PADDED_BLOCKS(len%64);
+    sha256_backend( SH_HASH_SINGLE )->hash( digest, message, len );
+}
+
+const SHA256_MIDSTATE SHA256_IV = { {
+    0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+    0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+} };
+
+void SHA256_pad_blocks( unsigned char *blocks, unsigned len,
+                        unsigned prefix_len ) {
+    unsigned total = 64 * SHA256_PADDED_BLOCKS(len);
+    uint_fast64_t bit_len = 8 * ((uint_fast64_t)prefix_len + len);
+
+    blocks[len] = 0x80;
+    memset( blocks + len + 1, 0, total - len - 9 );
+    put_bigendian( blocks + total - 8, bit_len >> 32, 4 );
+    put_bigendian( blocks + total - 4, bit_len & 0xffffffff, 4 );
+}
+
+void SHA256_hash_blocks( unsigned char *digest, unsigned len_digest,
+                        const SHA256_MIDSTATE *iv,
+                        const void *blocks, unsigned num_blocks ) {
+    uint32_t h[8];
+    unsigned char buffer[4];
+    unsigned i;
+
+    memcpy( h, iv->h, sizeof h );
+    compress_blocks( h, blocks, num_blocks );
+
+    for (i=0; 4*i+4 <= len_digest; i++) {
+        put_bigendian( digest + 4*i, h[i], 4 );
+    }
+    if (4*i < len_digest) {
+        put_bigendian( buffer, h[i], 4 );
+        memcpy( digest + 4*i, buffer, len_digest - 4*i );
+    }
+}
 
 void SHA256_set_first_block( SHA256_FIRSTBLOCK *first,
                         const unsigned char *data, unsigned data_len ) {
-    SHA256_Init( &first->ctx );
-    SHA256_Update( &first->ctx, data, data_len );
-    if (data_len < 64) {
-        const unsigned char pad[64] = { 0 };
-        SHA256_Update( &first->ctx, pad, 64-data_len );
-    }
+    unsigned char block[64];
+    memcpy( block, data, data_len );
+    memset( block + data_len, 0, 64-data_len );
+
+    memcpy( first->state.h, SHA256_IV.h, sizeof first->state.h );
+    compress_blocks( first->state.h, block, 1 );
 }
 
 void SHA256_init_first_block_ctx( SHA256_CTX *ctx, 
                         const SHA256_FIRSTBLOCK *first ) {
-    *ctx = first->ctx;
+    int i;
+    SHA256_Init( ctx );
+    for (i=0; i<8; i++) ctx->h[i] = first->state.h[i];
+    ctx->Nl = 512;   /* We've processed one block */
 }
@@ -2,20 +2,26 @@
 #define SHA256_H_
 
 #include "tune.h"
+#include <stddef.h>
 #include <stdint.h>
 
 /* Length of a SHA256 hash */
 #define SHA256_LEN		32
 
-#if USE_OPENSSL
-
-#include <openssl/sha.h>
-
-#else
+/*
+ * We always use our own SHA256_CTX and SHA256_Init/Update/Final (which
+ * use whichever backend is fastest; see sha256_backend.c), even if one of
+ * those backends is OpenSSL.  As OpenSSL has functions with the same names
+ * (and we don't want the dynamic linker to confuse the two), we rename ours
+ */
+#define SHA256_CTX    sh_sha256_ctx
+#define SHA256_Init   sh_sha256_init
+#define SHA256_Update sh_sha256_update
+#define SHA256_Final  sh_sha256_final
 
 /* SHA256 context. */
 typedef struct {
-  uint_fast32_t h[8];            /* state; this is in the CPU native format */
+  uint32_t h[8];                 /* state; this is in the CPU native format */
   uint_fast32_t Nl, Nh;          /* number of bits processed so far */
   unsigned num;                  /* number of bytes within the below */
                                  /* buffer */
@@ -30,18 +36,82 @@ void SHA256_Update(SHA256_CTX *, /* context */
 
 void SHA256_Final(unsigned char *,
                  SHA256_CTX *);
-#endif
+
+/*
+ * The number of SHA-256 hash compression operations this thread has
+ * performed (whichever backend did them; for the multi-lane backends, this
+ * counts the lanes that carried real messages).  This is thread local, so
+ * that threads running other signers don't disturb the count
+ */
+extern _Thread_local long hash_compression_count;
+
+/*
+ * Record the number of compression operations performed by the operation
+ * (SH_OP_SIGN, SH_OP_STEP or SH_OP_VERIFY) that this thread started when
+ * hash_compression_count was start (for sh_last_hash_count)
+ */
+void SHA256_account( int op, long start );
+
+/* Hash a message in one go */
+void SHA256_hash( unsigned char *digest, const void *message, size_t len );
+
+/*
+ * Time the SHA-256 backends, and pick the fastest for each job.  This is
+ * called when we load a key or verify a signature; until then (or if it
+ * is never called), we use a reasonable default
+ */
+void SHA256_select_backends( void );
+
+/*
+ * A SHA-256 midstate (chaining value); this is the 32 byte state after
+ * compressing some whole number of 64 byte blocks.  It is in CPU native
+ * format
+ */
+typedef struct {
+    uint32_t h[8];
+} SHA256_MIDSTATE;
+
+extern const SHA256_MIDSTATE SHA256_IV;   /* The initial state */
+
+/*
+ * Fixed-shape hashing
+ * Most of the hashes we compute have a length known at compile time; for
+ * those, we can lay out the message and the SHA-256 padding once in a
+ * buffer of whole blocks, and then go straight to the compression
+ * function, skipping the buffering and byte counting of SHA256_Update and
+ * SHA256_Final.  When we compute a series of hashes of the same shape
+ * (e.g. a hash chain), we need only update the message bytes between them
+ */
+
+/* The number of 64 byte blocks a message of len bytes pads out to */
+#define SHA256_PADDED_BLOCKS(len) (((len) + 9 + 63) / 64)
+
+/*
+ * Write the SHA-256 padding after a len byte message at the start of
+ * blocks (which must have room for SHA256_PADDED_BLOCKS(len) blocks).
+ * prefix_len is the number of bytes that the midstate we'll hash this
+ * from has already processed (so 0 if we start from SHA256_IV)
+ */
+void SHA256_pad_blocks( unsigned char *blocks, unsigned len,
+                        unsigned prefix_len );
+
+/*
+ * Compress num_blocks (already padded) blocks, starting from the midstate
+ * iv, and write the first len_digest bytes of the resulting hash
+ */
+void SHA256_hash_blocks( unsigned char *digest, unsigned len_digest,
+                        const SHA256_MIDSTATE *iv,
+                        const void *blocks, unsigned num_blocks );
 
 /*
  * Also define the first block context
  * This is used if we generate a series of hashes all with the
  * same initial 64 byte block
- * Our first block just saves the initial SHA256_CTX after processing
- * the first block - by assuming the contents of the SHA256_CTX, we could do
- * with about a third of the memory copying
+ * Our first block saves just the midstate after processing the first
+ * block; that's all we need to resume from it
  */
 typedef struct {
-    SHA256_CTX ctx;
+    SHA256_MIDSTATE state;
 } SHA256_FIRSTBLOCK;
 
 void SHA256_set_first_block( SHA256_FIRSTBLOCK *first,
@@ -49,5 +119,49 @@ void SHA256_set_first_block( SHA256_FIRSTBLOCK *first,
 void SHA256_init_first_block_ctx( SHA256_CTX *ctx,
                         const SHA256_FIRSTBLOCK *first );
 
+/*
+ * Multi-buffer SHA-256 (see sha256_multi.c)
+ * These compute count independent hashes in one call, using SIMD lanes if
+ * the CPU has them.  All the messages must be the same length; digest[i]
+ * gets the 32 byte hash of message[i]
+ */
+#define SHA256_MAX_LANES 16   /* The most lanes any engine uses */
+
+/* Hash count messages, each len_message bytes long */
+void SHA256_multi( unsigned char *const *digest,
+                   const void *const *message, unsigned len_message,
+                   unsigned count );
+
+/*
+ * The same as SHA256_multi, except that it wipes its copies of the messages
+ * (and the states computed from them) before returning; for when the
+ * messages are secret.  The other SHA-256 routines don't wipe anything;
+ * most of what we hash is public
+ */
+void SHA256_multi_secret( unsigned char *const *digest,
+                   const void *const *message, unsigned len_message,
+                   unsigned count );
+
+/* Hash count messages, each of which is prefixed by the same first block */
+void SHA256_multi_first_block( unsigned char *const *digest,
+                   const SHA256_FIRSTBLOCK *first,
+                   const void *const *message, unsigned len_message,
+                   unsigned count );
+
+/*
+ * Hash count messages that the caller has already padded (see
+ * SHA256_pad_blocks), each num_blocks blocks long, starting from the state
+ * iv; this writes the first len_digest bytes of each hash to digest[i]
+ * (which may point into block[i]).  This is the multi-buffer version of
+ * SHA256_hash_blocks
+ */
+void SHA256_multi_hash_blocks( unsigned char *const *digest,
+                   unsigned len_digest, const SHA256_MIDSTATE *iv,
+                   const unsigned char *const *block, unsigned num_blocks,
+                   unsigned count );
+
+/* The number of hashes the engine computes in parallel on this CPU */
+unsigned SHA256_multi_lanes( void );
+
 #endif /* ifdef(SHA256_H_) */
 
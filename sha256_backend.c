@@ -0,0 +1,235 @@
+/*
+ * This picks which SHA-256 implementation (backend) we use
+ *
+ * We have several implementations: the OpenSSL one, our portable one (and
+ * a build of it for x86 CPUs with BMI2), one that uses the x86 SHA
+ * extensions, and the SIMD multi-buffer ones.  Which one is fastest
+ * depends on the CPU (and the OpenSSL version), and so rather than having
+ * that be a compile time choice, we pick at runtime.
+ * We pick separately for each of the jobs we do:
+ * - SH_HASH_SINGLE   - hashing a single message in one go
+ * - SH_HASH_MIDSTATE - compressing blocks into a midstate (which is how we
+ *                      compute F, H, the LM-OTS chains, and anything that
+ *                      goes through SHA256_Init/Update/Final)
+ * - SH_HASH_MULTI    - computing several independent hashes at once
+ *
+ * Until told otherwise, we use the first backend in our preference list
+ * that can do the job on this CPU.  On the first sh_keygen,
+ * sh_load_signer or sh_verify call, we time the candidates, and switch to
+ * the fastest.  The application can query or override the choice
+ * (sphincs-hybrid.h)
+ */
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "sha256_backend.h"
+#include "sha256.h"
+
+#define NUM_ROLES 3     /* SH_HASH_SINGLE, SH_HASH_MIDSTATE, SH_HASH_MULTI */
+
+/* All our backends, in order of preference */
+static const struct sha256_backend *const backend_list[] = {
+    &sha256_backend_shani,
+    &sha256_backend_avx512,
+    &sha256_backend_avx2,
+    &sha256_backend_sse41,
+    &sha256_backend_openssl,
+    &sha256_backend_bmi2,
+    &sha256_backend_portable,
+};
+#define NUM_BACKENDS (sizeof backend_list / sizeof *backend_list)
+
+/*
+ * The current selection.  Every hash looks this up, from whatever thread
+ * it's on, and so it's atomic (rather than locked).  Changing it is rare,
+ * and those changes (the benchmark, and the application's overrides) are
+ * serialized by select_lock, so that an override can't be lost to a
+ * benchmark that was running at the time
+ */
+static const struct sha256_backend *_Atomic current[NUM_ROLES];
+static _Atomic bool overridden[NUM_ROLES];  /* The application picked */
+                                    /* this one */
+static _Atomic double role_time[NUM_ROLES]; /* Time per compression of */
+                                    /* the current pick (0 if not timed) */
+static pthread_once_t benchmark_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t select_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Can backend b do the job (on this CPU)? */
+static bool can_do( const struct sha256_backend *b, int role ) {
+    switch (role) {
+    case SH_HASH_SINGLE:   if (!b->hash) return false; break;
+    case SH_HASH_MIDSTATE: if (!b->compress) return false; break;
+    case SH_HASH_MULTI:    if (!b->compress_multi) return false; break;
+    default: return false;
+    }
+    return b->supported();
+}
+
+static const struct sha256_backend *default_backend( int role ) {
+    unsigned i;
+    for (i=0; i<NUM_BACKENDS; i++) {
+        if (can_do( backend_list[i], role )) return backend_list[i];
+    }
+    return &sha256_backend_portable;  /* Can't happen */
+}
+
+const struct sha256_backend *sha256_backend( int role ) {
+    const struct sha256_backend *b = atomic_load( &current[role] );
+    if (!b) {
+        /* Don't overwrite a pick someone else made in the meantime */
+        const struct sha256_backend *expected = 0;
+        b = default_backend(role);
+        if (!atomic_compare_exchange_strong( &current[role], &expected, b )) {
+            b = expected;
+        }
+    }
+    return b;
+}
+
+/*
+ * The benchmark
+ * We time enough hashes to be measurable (but not so many that it has a
+ * noticable effect on the load time), and take the best of a few runs (to
+ * filter out interrupts and the like)
+ */
+#define BENCH_BLOCKS  1024   /* Compression operations per run */
+#define BENCH_RUNS    3
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Returns the time per compression operation of backend b doing the job */
+static double time_backend( const struct sha256_backend *b, int role ) {
+    unsigned char block[ 64 * SHA256_MAX_LANES ];
+    const unsigned char *lane_block[ SHA256_MAX_LANES ];
+    uint32_t state[ 8 * SHA256_MAX_LANES ];
+    double best = 0;
+    unsigned i, run;
+
+    memset( block, 0x5c, sizeof block );
+    memset( state, 0x36, sizeof state );
+    for (i=0; i<SHA256_MAX_LANES; i++) lane_block[i] = block + 64*i;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        double start = now();
+        switch (role) {
+        case SH_HASH_SINGLE:
+            /* A 47 byte message is our most common shape (the LM-OTS */
+            /* chains); feed each hash into the next, so it can't be */
+            /* skipped */
+            for (i=0; i<BENCH_BLOCKS; i++) {
+                b->hash( block, block, 47 );
+            }
+            break;
+        case SH_HASH_MIDSTATE:
+            for (i=0; i<BENCH_BLOCKS; i++) {
+                b->compress( state, block, 1 );
+            }
+            break;
+        case SH_HASH_MULTI:
+            for (i=0; i<BENCH_BLOCKS; i += b->lanes) {
+                b->compress_multi( state, lane_block );
+            }
+            break;
+        }
+        double t = (now() - start) / BENCH_BLOCKS;
+        if (run == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+static void benchmark_role( int role ) {
+    const struct sha256_backend *best = 0;
+    double best_time = 0;
+    unsigned i;
+    for (i=0; i<NUM_BACKENDS; i++) {
+        const struct sha256_backend *b = backend_list[i];
+        if (!can_do( b, role )) continue;
+        double t = time_backend( b, role );
+        if (!best || t < best_time) {
+            best = b;
+            best_time = t;
+        }
+    }
+    /* We time them without the lock (that takes a while); if the */
+    /* application picked one in the meantime, we leave its pick alone */
+    pthread_mutex_lock( &select_lock );
+    if (best && !atomic_load( &overridden[role] )) {
+        atomic_store( &role_time[role], best_time );
+        atomic_store( &current[role], best );
+    }
+    pthread_mutex_unlock( &select_lock );
+}
+
+static void benchmark_all( void ) {
+    int role;
+    for (role = 0; role < NUM_ROLES; role++) {
+        if (!atomic_load( &overridden[role] )) benchmark_role( role );
+    }
+}
+
+void SHA256_select_backends( void ) {
+    pthread_once( &benchmark_once, benchmark_all );
+}
+
+unsigned sha256_multi_crossover( void ) {
+    unsigned lanes = sha256_backend( SH_HASH_MULTI )->lanes;
+    if (lanes <= 1) return 1;
+    double multi_time = atomic_load( &role_time[SH_HASH_MULTI] );
+    double single_time = atomic_load( &role_time[SH_HASH_MIDSTATE] );
+    if (multi_time > 0 && single_time > 0) {
+        /* A pass costs lanes * multi_time; each message costs */
+        /* single_time done singly */
+        unsigned c = 1 + (unsigned)(lanes * multi_time / single_time);
+        return (c < lanes) ? c : lanes;
+    }
+    return lanes / 2;   /* We haven't timed them; a reasonable guess */
+}
+
+/*
+ * The application API
+ */
+const char *sh_get_hash_backend( int role ) {
+    if (role < 0 || role >= NUM_ROLES) return 0;
+    return sha256_backend( role )->name;
+}
+
+bool sh_set_hash_backend( int role, const char *name ) {
+    if (role < 0 || role >= NUM_ROLES) return false;
+    if (!name) {
+        /* Go back to the fastest one */
+        pthread_mutex_lock( &select_lock );
+        atomic_store( &overridden[role], false );
+        pthread_mutex_unlock( &select_lock );
+        benchmark_role( role );
+        return true;
+    }
+    unsigned i;
+    for (i=0; i<NUM_BACKENDS; i++) {
+        const struct sha256_backend *b = backend_list[i];
+        if (0 == strcmp( name, b->name )) {
+            if (!can_do( b, role )) return false;
+            pthread_mutex_lock( &select_lock );
+            atomic_store( &overridden[role], true );
+            atomic_store( &role_time[role], 0.0 );
+            atomic_store( &current[role], b );
+            pthread_mutex_unlock( &select_lock );
+            return true;
+        }
+    }
+    return false;  /* Never heard of it */
+}
+
+const char *sh_list_hash_backends( int role, unsigned index ) {
+    unsigned i;
+    for (i=0; i<NUM_BACKENDS; i++) {
+        if (!can_do( backend_list[i], role )) continue;
+        if (index == 0) return backend_list[i]->name;
+        index -= 1;
+    }
+    return 0;
+}
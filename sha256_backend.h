@@ -0,0 +1,65 @@
+#if !defined(SHA256_BACKEND_H_)
+#define SHA256_BACKEND_H_
+
+/*
+ * This is the internal interface between our SHA-256 front end (sha256.c,
+ * sha256_multi.c) and the various SHA-256 implementations (backends) we
+ * can pick from at runtime
+ *
+ * This deliberately doesn't include sha256.h; our SHA256_* names would
+ * clash with OpenSSL's in the OpenSSL backend
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sphincs-hybrid.h"   /* For the SH_HASH_* roles */
+
+struct sha256_backend {
+    const char *name;
+
+        /* Returns true if this CPU can run this backend */
+    bool (*supported)( void );
+
+        /* Single hashing: write the 32 byte hash of the len byte */
+        /* message.  NULL if the backend doesn't do this */
+    void (*hash)( unsigned char *digest, const void *message, size_t len );
+
+        /* Midstate hashing: compress num_blocks 64 byte blocks into the */
+        /* state h (8 words, CPU native format).  NULL if the backend */
+        /* doesn't do this */
+    void (*compress)( uint32_t *h, const void *blocks, unsigned num_blocks );
+
+        /* Multi-lane hashing: compress one block into each of lanes */
+        /* states (which are stored word by word, so the first lanes */
+        /* entries are the a values of each lane).  NULL if the backend */
+        /* doesn't do this */
+    void (*compress_multi)( uint32_t *state,
+                            const unsigned char *const *block );
+    unsigned lanes;
+};
+
+/* The backends we have (some of which may not be built on this platform) */
+extern const struct sha256_backend sha256_backend_shani;     /* sha256.c */
+extern const struct sha256_backend sha256_backend_bmi2;      /* sha256.c */
+extern const struct sha256_backend sha256_backend_portable;  /* sha256.c */
+extern const struct sha256_backend sha256_backend_avx512;  /* sha256_multi.c */
+extern const struct sha256_backend sha256_backend_avx2;    /* sha256_multi.c */
+extern const struct sha256_backend sha256_backend_sse41;   /* sha256_multi.c */
+extern const struct sha256_backend sha256_backend_openssl;/* sha256_openssl.c */
+
+/*
+ * The backend we currently use for the role (SH_HASH_SINGLE,
+ * SH_HASH_MIDSTATE or SH_HASH_MULTI).  Until we've benchmarked, this is the
+ * first one in our preference list that can do the job
+ */
+const struct sha256_backend *sha256_backend( int role );
+
+/*
+ * The smallest number of messages for which a pass through the SH_HASH_MULTI
+ * backend is faster than hashing them one at a time with the
+ * SH_HASH_MIDSTATE backend (a multi-lane pass costs the same however many
+ * lanes carry real messages)
+ */
+unsigned sha256_multi_crossover( void );
+
+#endif /* SHA256_BACKEND_H_ */
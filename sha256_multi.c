@@ -0,0 +1,323 @@
+/*
+ * Multi-buffer SHA-256
+ *
+ * Nearly all the work we do is computing a large number of independent
+ * short hashes (WOTS+ and LM-OTS chains, FORS leaves).  Rather than
+ * computing them one at a time, this computes several at once, one per
+ * SIMD lane; 4 lanes with SSE4.1, 8 with AVX2 and 16 with AVX-512.  If we
+ * don't have any of those, the backend will be one that does one hash at a
+ * time.
+ *
+ * The SIMD code is written using GCC vector extensions (also supported by
+ * clang); we compile the same kernel (sha256_multi_kernel.h) once for each
+ * width; each is a separate SHA-256 backend (and sha256_backend.c picks
+ * which one we use)
+ */
+#include <string.h>
+#include "sha256.h"
+#include "sha256_backend.h"
+#include "zeroize.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MULTI_SIMD 1    /* We can generate the x86 SIMD kernels */
+#else
+#define MULTI_SIMD 0    /* Portable code only */
+#endif
+
+static const uint32_t multi_K[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+/* The SHA-256 logical functions; these work on both scalars and vectors */
+#define MULTI_ROR(x, n)     (((x) >> (n)) | ((x) << (32-(n))))
+#define MULTI_CH(x,y,z)     ((z) ^ ((x) & ((y) ^ (z))))
+#define MULTI_MAJ(x,y,z)    ((((x) | (y)) & (z)) | ((x) & (y)))
+#define MULTI_SIGMA0(x)  (MULTI_ROR(x, 2) ^ MULTI_ROR(x, 13) ^ MULTI_ROR(x, 22))
+#define MULTI_SIGMA1(x)  (MULTI_ROR(x, 6) ^ MULTI_ROR(x, 11) ^ MULTI_ROR(x, 25))
+#define MULTI_GAMMA0(x)  (MULTI_ROR(x, 7) ^ MULTI_ROR(x, 18) ^ ((x) >> 3))
+#define MULTI_GAMMA1(x)  (MULTI_ROR(x, 17) ^ MULTI_ROR(x, 19) ^ ((x) >> 10))
+
+#if MULTI_SIMD
+/* The SSE4.1 version; 4 lanes */
+#define KERNEL_NAME   compress_4
+#define KERNEL_LANES  4
+#define KERNEL_ATTR   __attribute__((target("sse4.1")))
+#define KERNEL_VEC    vec_4
+#include "sha256_multi_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_ATTR
+#undef KERNEL_VEC
+
+/* The AVX2 version; 8 lanes */
+#define KERNEL_NAME   compress_8
+#define KERNEL_LANES  8
+#define KERNEL_ATTR   __attribute__((target("avx2")))
+#define KERNEL_VEC    vec_8
+#include "sha256_multi_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_ATTR
+#undef KERNEL_VEC
+
+/* The AVX-512 version; 16 lanes */
+#define KERNEL_NAME   compress_16
+#define KERNEL_LANES  16
+#define KERNEL_ATTR   __attribute__((target("avx512f")))
+#define KERNEL_VEC    vec_16
+#include "sha256_multi_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_ATTR
+#undef KERNEL_VEC
+#endif
+
+#if MULTI_SIMD
+static bool sse41_supported( void ) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "sse4.1" );
+}
+static bool avx2_supported( void ) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" );
+}
+static bool avx512_supported( void ) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx512f" );
+}
+
+const struct sha256_backend sha256_backend_sse41 = {
+    "sse4.1", sse41_supported, 0, 0, compress_4, 4
+};
+const struct sha256_backend sha256_backend_avx2 = {
+    "avx2", avx2_supported, 0, 0, compress_8, 8
+};
+const struct sha256_backend sha256_backend_avx512 = {
+    "avx512", avx512_supported, 0, 0, compress_16, 16
+};
+#else
+static bool not_supported( void ) {
+    return false;
+}
+
+const struct sha256_backend sha256_backend_sse41 = {
+    "sse4.1", not_supported, 0, 0, 0, 0
+};
+const struct sha256_backend sha256_backend_avx2 = {
+    "avx2", not_supported, 0, 0, 0, 0
+};
+const struct sha256_backend sha256_backend_avx512 = {
+    "avx512", not_supported, 0, 0, 0, 0
+};
+#endif
+
+unsigned SHA256_multi_lanes( void ) {
+    return sha256_backend( SH_HASH_MULTI )->lanes;
+}
+
+/* Write out a 32 bit value in bigendian format (we do this inline, as */
+/* this is on our critical path) */
+static void put_be32( unsigned char *p, uint32_t x ) {
+    p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+/* Write the first len bytes of the hash in state (lane lane of lanes) */
+static void put_digest( unsigned char *digest, unsigned len,
+                        const uint32_t *state, unsigned lane,
+                        unsigned lanes ) {
+    unsigned i;
+    for (i = 0; 4*i + 4 <= len; i++) {
+        put_be32( digest + 4*i, state[i*lanes + lane] );
+    }
+    if (4*i < len) {
+        unsigned char last[4];
+        put_be32( last, state[i*lanes + lane] );
+        memcpy( digest + 4*i, last, len - 4*i );
+    }
+}
+
+/*
+ * This hashes count messages (each len bytes long), starting from the
+ * state iv (which has already processed prefix_len bytes)
+ * If we have only a few messages left over at the end (fewer than would
+ * make a multi-lane pass worth it), we do those one at a time
+ * If wipe is set, we zeroize our copies of the messages (and the states)
+ * before returning
+ */
+static void hash_multi( unsigned char *const *digest, const uint32_t *iv,
+                        unsigned prefix_len, const void *const *message,
+                        unsigned len, unsigned count, bool wipe ) {
+    const struct sha256_backend *backend = sha256_backend( SH_HASH_MULTI );
+    void (*multi_compress)( uint32_t *, const unsigned char *const * ) =
+                                                    backend->compress_multi;
+    unsigned lanes = backend->lanes;
+    unsigned full_blocks = len / 64;  /* Blocks we can compress in place */
+    unsigned tail = len % 64;         /* Bytes left over after those */
+    unsigned tail_blocks = (tail + 9 <= 64) ? 1 : 2;  /* Blocks we need */
+                                      /* to hold the tail and the padding */
+    uint_fast64_t bit_len = 8 * ((uint_fast64_t)prefix_len + len);
+
+    uint32_t state[8 * SHA256_MAX_LANES];
+    unsigned char pad[SHA256_MAX_LANES][128];
+    const unsigned char *block[SHA256_MAX_LANES];
+    unsigned base, lane, i, b;
+    unsigned crossover = sha256_multi_crossover();
+
+    for (base = 0; base < count; base += lanes) {
+        /* The number of lanes that carry real messages this time; if we */
+        /* have fewer messages than lanes, the spare lanes recompute the */
+        /* last message (and we ignore what they produce) */
+        unsigned active = count - base;
+        if (active > lanes) active = lanes;
+        const unsigned char *const *msg =
+                             (const unsigned char *const *)message + base;
+
+        if (active < crossover) {
+            /* Not enough to fill the lanes; do these singly */
+            void (*compress)( uint32_t *, const void *, unsigned ) =
+                                  sha256_backend( SH_HASH_MIDSTATE )->compress;
+            for (lane = 0; lane < active; lane++) {
+                uint32_t h[8];
+                memcpy( h, iv, sizeof h );
+                if (full_blocks) compress( h, msg[lane], full_blocks );
+                memcpy( pad[0], msg[lane] + 64*full_blocks, tail );
+                pad[0][tail] = 0x80;
+                memset( pad[0] + tail + 1, 0, 64*tail_blocks - tail - 9 );
+                put_be32( pad[0] + 64*tail_blocks - 8, bit_len >> 32 );
+                put_be32( pad[0] + 64*tail_blocks - 4, bit_len );
+                compress( h, pad[0], tail_blocks );
+                put_digest( digest[base+lane], 32, h, 0, 1 );
+                if (wipe) zeroize( h, sizeof h );
+            }
+            break;
+        }
+
+        for (i = 0; i < 8; i++) {
+            for (lane = 0; lane < lanes; lane++) {
+                state[i*lanes + lane] = iv[i];
+            }
+        }
+
+        /* Compress the full blocks directly from the messages */
+        for (b = 0; b < full_blocks; b++) {
+            for (lane = 0; lane < lanes; lane++) {
+                unsigned m = (lane < active) ? lane : active-1;
+                block[lane] = msg[m] + 64*b;
+            }
+            multi_compress( state, block );
+        }
+
+        /* Now the tail of each message, plus the SHA-256 padding */
+        for (lane = 0; lane < active; lane++) {
+            memcpy( pad[lane], msg[lane] + 64*full_blocks, tail );
+            pad[lane][tail] = 0x80;
+            memset( pad[lane] + tail + 1, 0, 64*tail_blocks - tail - 9 );
+            put_be32( pad[lane] + 64*tail_blocks - 8, bit_len >> 32 );
+            put_be32( pad[lane] + 64*tail_blocks - 4, bit_len );
+        }
+        for (b = 0; b < tail_blocks; b++) {
+            for (lane = 0; lane < lanes; lane++) {
+                unsigned m = (lane < active) ? lane : active-1;
+                block[lane] = pad[m] + 64*b;
+            }
+            multi_compress( state, block );
+        }
+
+        /* And write out the hashes */
+        for (lane = 0; lane < active; lane++) {
+            put_digest( digest[base+lane], 32, state, lane, lanes );
+        }
+    }
+
+    if (wipe) {
+        /* The messages are secret; don't leave them (or the states */
+        /* computed from them) around */
+        zeroize( state, sizeof state );
+        zeroize( pad, sizeof pad );
+    }
+
+    hash_compression_count += (long)count * (full_blocks + tail_blocks);
+}
+
+void SHA256_multi_hash_blocks( unsigned char *const *digest,
+                   unsigned len_digest, const SHA256_MIDSTATE *iv,
+                   const unsigned char *const *block, unsigned num_blocks,
+                   unsigned count ) {
+    const struct sha256_backend *backend = sha256_backend( SH_HASH_MULTI );
+    void (*multi_compress)( uint32_t *, const unsigned char *const * ) =
+                                                    backend->compress_multi;
+    unsigned lanes = backend->lanes;
+    unsigned crossover = sha256_multi_crossover();
+    uint32_t state[8 * SHA256_MAX_LANES];
+    const unsigned char *lane_block[SHA256_MAX_LANES];
+    unsigned base, lane, i, b;
+
+    for (base = 0; base < count; base += lanes) {
+        unsigned active = count - base;
+        if (active > lanes) active = lanes;
+
+        if (active < crossover) {
+            /* Not enough to fill the lanes; do these singly */
+            void (*compress)( uint32_t *, const void *, unsigned ) =
+                                  sha256_backend( SH_HASH_MIDSTATE )->compress;
+            for (lane = 0; lane < active; lane++) {
+                uint32_t h[8];
+                memcpy( h, iv->h, sizeof h );
+                compress( h, block[base+lane], num_blocks );
+                put_digest( digest[base+lane], len_digest, h, 0, 1 );
+            }
+            break;
+        }
+
+        for (i = 0; i < 8; i++) {
+            for (lane = 0; lane < lanes; lane++) {
+                state[i*lanes + lane] = iv->h[i];
+            }
+        }
+        for (b = 0; b < num_blocks; b++) {
+            /* Spare lanes recompute the last message */
+            for (lane = 0; lane < lanes; lane++) {
+                unsigned m = (lane < active) ? lane : active-1;
+                lane_block[lane] = block[base+m] + 64*b;
+            }
+            multi_compress( state, lane_block );
+        }
+        for (lane = 0; lane < active; lane++) {
+            put_digest( digest[base+lane], len_digest, state, lane, lanes );
+        }
+    }
+
+    hash_compression_count += (long)count * num_blocks;
+}
+
+void SHA256_multi( unsigned char *const *digest,
+                   const void *const *message, unsigned len_message,
+                   unsigned count ) {
+    hash_multi( digest, SHA256_IV.h, 0, message, len_message, count, false );
+}
+
+void SHA256_multi_secret( unsigned char *const *digest,
+                   const void *const *message, unsigned len_message,
+                   unsigned count ) {
+    hash_multi( digest, SHA256_IV.h, 0, message, len_message, count, true );
+}
+
+void SHA256_multi_first_block( unsigned char *const *digest,
+                   const SHA256_FIRSTBLOCK *first,
+                   const void *const *message, unsigned len_message,
+                   unsigned count ) {
+    hash_multi( digest, first->state.h, 64, message, len_message, count,
+                false );
+}
@@ -0,0 +1,96 @@
+/*
+ * This is the body of the multi-buffer SHA-256 compression function
+ *
+ * It is not a normal include file; instead, sha256_multi.c #include's it
+ * once for each SIMD width it supports, with these defined beforehand:
+ * KERNEL_NAME   - the name of the function to generate
+ * KERNEL_LANES  - the number of hashes the function computes in parallel
+ * KERNEL_ATTR   - function attributes (e.g. the target instruction set)
+ * KERNEL_VEC    - the name of the lane vector type to generate
+ *
+ * With KERNEL_LANES == 1, we use a plain uint32_t as the 'vector'; GCC
+ * vector extensions accept the same operators as scalars do, and so the
+ * same code gives us the portable version
+ */
+#if KERNEL_LANES == 1
+typedef uint32_t KERNEL_VEC;
+#else
+typedef uint32_t KERNEL_VEC __attribute__((vector_size(4*KERNEL_LANES)));
+#endif
+
+/*
+ * This performs one compression operation on each lane
+ * state is the 8 state words, stored lane by lane (so the first
+ *     KERNEL_LANES words are the a values of each lane)
+ * block is an array of KERNEL_LANES pointers to the 64 byte blocks to
+ *     compress; different lanes may point to the same block
+ */
+static KERNEL_ATTR void KERNEL_NAME( uint32_t *state,
+                                     const unsigned char *const *block ) {
+    KERNEL_VEC a, b, c, d, e, f, g, h, t1, t2, W[16];
+    uint32_t words[16][KERNEL_LANES];
+    int i, lane;
+
+    /*
+     * Transpose the message blocks, so that each W[i] holds word i of
+     * every lane's block (converted from bigendian)
+     */
+    for (lane = 0; lane < KERNEL_LANES; lane++) {
+        const unsigned char *p = block[lane];
+        for (i = 0; i < 16; i++, p += 4) {
+            words[i][lane] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                             ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+        }
+    }
+    memcpy( W, words, sizeof W );
+
+    memcpy( &a, state + 0*KERNEL_LANES, sizeof a );
+    memcpy( &b, state + 1*KERNEL_LANES, sizeof b );
+    memcpy( &c, state + 2*KERNEL_LANES, sizeof c );
+    memcpy( &d, state + 3*KERNEL_LANES, sizeof d );
+    memcpy( &e, state + 4*KERNEL_LANES, sizeof e );
+    memcpy( &f, state + 5*KERNEL_LANES, sizeof f );
+    memcpy( &g, state + 6*KERNEL_LANES, sizeof g );
+    memcpy( &h, state + 7*KERNEL_LANES, sizeof h );
+
+    /*
+     * The rounds, 16 at a time, so that the W[] indices are constants (and
+     * so the compiler can keep the message schedule in registers).  After
+     * the first 16 rounds, W[] is a rolling window of the last 16 schedule
+     * words, which we expand in place
+     */
+#define RND(a,b,c,d,e,f,g,h,i) {                                      \
+        if (j) {                                                      \
+            W[i] += MULTI_GAMMA1(W[(i+14) & 15]) + W[(i+9) & 15] +    \
+                    MULTI_GAMMA0(W[(i+1) & 15]);                      \
+        }                                                             \
+        t1 = h + MULTI_SIGMA1(e) + MULTI_CH(e, f, g) +                \
+             multi_K[j+i] + W[i];                                     \
+        t2 = MULTI_SIGMA0(a) + MULTI_MAJ(a, b, c);                    \
+        d += t1;                                                      \
+        h = t1 + t2;                                                  \
+    }
+    int j;
+    for (j = 0; j < 64; j += 16) {
+        RND(a,b,c,d,e,f,g,h, 0); RND(h,a,b,c,d,e,f,g, 1);
+        RND(g,h,a,b,c,d,e,f, 2); RND(f,g,h,a,b,c,d,e, 3);
+        RND(e,f,g,h,a,b,c,d, 4); RND(d,e,f,g,h,a,b,c, 5);
+        RND(c,d,e,f,g,h,a,b, 6); RND(b,c,d,e,f,g,h,a, 7);
+        RND(a,b,c,d,e,f,g,h, 8); RND(h,a,b,c,d,e,f,g, 9);
+        RND(g,h,a,b,c,d,e,f,10); RND(f,g,h,a,b,c,d,e,11);
+        RND(e,f,g,h,a,b,c,d,12); RND(d,e,f,g,h,a,b,c,13);
+        RND(c,d,e,f,g,h,a,b,14); RND(b,c,d,e,f,g,h,a,15);
+    }
+#undef RND
+
+    /* Feedback */
+#define FEEDBACK(word, v) {                                        \
+        KERNEL_VEC old;                                            \
+        memcpy( &old, state + (word)*KERNEL_LANES, sizeof old );   \
+        old += v;                                                  \
+        memcpy( state + (word)*KERNEL_LANES, &old, sizeof old );   \
+    }
+    FEEDBACK(0, a); FEEDBACK(1, b); FEEDBACK(2, c); FEEDBACK(3, d);
+    FEEDBACK(4, e); FEEDBACK(5, f); FEEDBACK(6, g); FEEDBACK(7, h);
+#undef FEEDBACK
+}
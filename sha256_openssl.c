@@ -0,0 +1,50 @@
+/*
+ * The OpenSSL SHA-256 backend
+ *
+ * On CPUs without the SHA extensions, OpenSSL's assembly code is a lot
+ * faster than our portable code.  We use the EVP interface to hash
+ * complete messages.  EVP doesn't give us a way to resume from a given
+ * midstate (and the low level SHA256_Transform interface is deprecated),
+ * and so this backend does only SH_HASH_SINGLE
+ *
+ * Note that this deliberately doesn't include sha256.h (our SHA256_*
+ * names would clash with OpenSSL's)
+ */
+#include "tune.h"
+#include "sha256_backend.h"
+
+#if USE_OPENSSL
+#include <openssl/evp.h>
+#include <pthread.h>
+
+static const EVP_MD *sha256_md;
+static pthread_once_t sha256_md_once = PTHREAD_ONCE_INIT;
+
+static void openssl_init( void ) {
+    sha256_md = EVP_sha256();
+}
+
+static bool openssl_supported( void ) {
+    pthread_once( &sha256_md_once, openssl_init );
+    return sha256_md != 0;
+}
+
+static void openssl_hash( unsigned char *digest,
+                          const void *message, size_t len ) {
+    EVP_Digest( message, len, digest, 0, sha256_md, 0 );
+}
+
+const struct sha256_backend sha256_backend_openssl = {
+    "openssl", openssl_supported, openssl_hash, 0, 0, 0
+};
+
+#else
+/* Configured not to use OpenSSL */
+static bool openssl_supported( void ) {
+    return false;
+}
+
+const struct sha256_backend sha256_backend_openssl = {
+    "openssl", openssl_supported, 0, 0, 0, 0
+};
+#endif
@@ -15,12 +15,75 @@
                  b = temp; \
     }
 
-bool sh_sign( void *signature, size_t len_signature_buf,
+/*
+ * Compute the leaf 1<<LMS_BOTTOM positions past the LMS index (which is in
+ * the next bottom subtree), and place it (and the internal nodes it lets
+ * us complete) into bottom_subtree.  The nodes of the next bottom subtree
+ * go into the positions of the nodes of the current one that the
+ * signatures up to index no longer need
+ */
+void refresh_lms_bottom( struct sh_signer *signer, merkle_index_t index,
+                         unsigned char *bottom_subtree ) {
+    int which = 1 & (index >> LMS_BOTTOM);
+    unsigned leaf = index + (1 << LMS_BOTTOM);
+
+        /* Create that OTS public key (and perform the D_LEAF hash) */
+    unsigned char buffer[24];
+    lm_ots_generate_public_key( signer->current_lms_I, leaf,
+                   &signer->current_lms_gen, buffer );
+
+    unsigned q = leaf | (1 << LMS_H);  /* The node index we tell the */
+                     /* combiner function */
+    /* This is the index of current node (not including the which flag) */
+    unsigned node = (leaf & ((1 << LMS_BOTTOM) - 1)) +
+                                              (1 << LMS_BOTTOM) - 2;
+    for (;;) {
+
+            /* Store this node in its position in the subtree */
+        memcpy( bottom_subtree + 24 * (node ^ which ^ 1), buffer, 24 );
+
+        if ((node & 1) == 0) break;  /* We're the left node; we can't */
+                                     /* go any further up */
+        if (node <= 1) break; /* We're at the top of the bottom tree, */
+                              /* no point in going hihger */
+            /* We're the right node, combine it with the previously */
+            /* computed left node */
+        const unsigned char *left = bottom_subtree + 24 * (node ^ which);
+        q >>= 1;
+        lms_combine_internal_nodes( buffer, left, buffer,
+                                    signer->current_lms_I, 24, q );
+        node = (node >> 1) - 1;
+    }
+}
+
+/*
+ * If online is set, we do only the signature itself, and none of the
+ * building work (that's left to sh_do_offline_work)
+ */
+static bool do_sign( void *signature, size_t len_signature_buf,
               struct sh_signer *signer,
-              const void *message, size_t len_message ) {
+              const void *message, size_t len_message, bool online ) {
     /* Error checking */
     if (!signature) return false;
-    if (!signer || !signer->initialized || signer->got_fatal_error) {
+    if (!signer || !signer->initialized) {
+        goto failed;
+    }
+#if BUILD_THREAD
+    if (signer->bg.running) {
+        /* The build thread owns got_fatal_error; ask it instead (and, */
+        /* unless we're signing online, wait for it if it's behind) */
+        if (!build_thread_wait( signer, !online )) goto failed;
+    } else
+#endif
+    if (online) {
+        /* We can sign only if the offline work has put in place */
+        /* everything this signature needs */
+        if (!deferred_ready( signer )) goto failed;
+    } else if (signer->defer.active) {
+        /* We've been doing the build work apart from the signatures; */
+        /* do whatever this signature needs that hasn't been done */
+        if (!deferred_catch_up( signer )) goto failed;
+    } else if (signer->got_fatal_error) {
         goto failed;
     }
 
@@ -51,7 +114,7 @@ bool sh_sign( void *signature, size_t len_signature_buf,
                                              /* The current index */
         /* Then comes the OTS signature */
     int ots_sig_len = lm_ots_generate_signature(signer->current_lms_I,
-                      signer->current_lms_index, signer->current_lms_seed,
+                      signer->current_lms_index, &signer->current_lms_gen,
                       message, len_message, lm_sig);
     if (ots_sig_len == 0) goto failed;
     lm_sig += ots_sig_len;
@@ -108,41 +171,24 @@ bool sh_sign( void *signature, size_t len_signature_buf,
      * next signature
      */
 
-    /* Update the current_lms_next_subtree subtree */
-    {
-            /* We're doing the leaf that's 1<<LMS_BOTTOM positions from */
-            /* what we just used to sign */
-        unsigned leaf = signer->current_lms_index + (1 << LMS_BOTTOM);
-
-            /* Create that OTS public key (and perform the D_LEAF hash) */
-        unsigned char buffer[24];
-        lm_ots_generate_public_key( signer->current_lms_I, leaf,
-                       signer->current_lms_seed, buffer );
-
-        unsigned q = leaf | (1 << LMS_H);  /* The node index we tell the */
-                         /* combiner function */
-        /* This is the index of current node (not including the which flag) */
-        unsigned index = (leaf & ((1 << LMS_BOTTOM) - 1)) +
-                                                  (1 << LMS_BOTTOM) - 2;
-        for (;;) {
-
-                /* Store this node in its position in the subtree */
-            memcpy( signer->current_lms_bottom_subtree + 24 * (index ^ which ^ 1),
-                                                              buffer, 24 );
-
-            if ((index & 1) == 0) break;  /* We're the left node; we can't */
-                                         /* go any further up */
-            if (index <= 1) break; /* We're at the top of the bottom tree, */
-                                   /* no point in going hihger */
-                /* We're the right node, combine it with the previously */
-                /* computed left node */
-            const unsigned char *left = signer->current_lms_bottom_subtree +
-                                                  24 * (index ^ which);
-            q >>= 1;
-            lms_combine_internal_nodes( buffer, left, buffer,
-                                        signer->current_lms_I, 24, q );
-            index = (index >> 1) - 1;
+    if (signer->defer.active) {
+        signer->current_lms_index += 1;
+#if BUILD_THREAD
+        if (signer->bg.running) {
+            return true;        /* The build thread does the rest */
         }
+#endif
+        /* If the caller didn't ask us not to, do the slice of the */
+        /* build work that sh_sign always does */
+        if (!online) deferred_work( signer, true );
+        return true;
+    }
+
+    /* Update the current_lms_next_subtree subtree (if there is a next */
+    /* subtree in this LMS tree) */
+    if (signer->current_lms_index + (1 << LMS_BOTTOM) < LMS_END) {
+        refresh_lms_bottom( signer, signer->current_lms_index,
+                            signer->current_lms_bottom_subtree );
     }
 
     /* Step to the next LMS index */
@@ -150,11 +196,23 @@ bool sh_sign( void *signature, size_t len_signature_buf,
 
     /* One last task; incrementally build the next LMS tree/Sphincs sig */
     /* This looks simple; however, most of the complexity is here */
-    (void)step_next(signer, true);
-    /* When the step function completes the entire 'build the next tree */
-    /* and signature' process, it'll automatically switch us to the next */
-    /* Sphincs+ signature and LMS tree.  Hence, we can ignore the return */
-    /* value (which tells us when that happens), because we don't care */
+    /* Once it's done, we hold it (and skip the step) until we've used */
+    /* up the current LMS tree; the steps the hypertree cache saves us */
+    /* are signatures that do no build work at all */
+    if (signer->build_state != b_done) {
+        (void)step_next(signer, true);
+    }
+    if (signer->current_lms_index == LMS_END) {
+        /* We've used up the current LMS tree; switch to the next one. */
+        /* The build normally finishes long before this; if it hasn't */
+        /* (because FAULT_STRATEGY 2 had to redo work), finish it now */
+        while (signer->build_state != b_done && !signer->got_fatal_error) {
+            (void)step_next(signer, false);
+        }
+        if (!signer->got_fatal_error) {
+            switch_lms_tree( signer );
+        }
+    }
 
     return true;   /* The signature the caller asked for has been */
                    /* successfully constructed */
@@ -163,6 +221,26 @@ failed:
     return false;  /* Oops, something went wrong */
 }
 
+bool sh_sign( void *signature, size_t len_signature_buf,
+              struct sh_signer *signer,
+              const void *message, size_t len_message ) {
+    long start = hash_compression_count;
+    bool success = do_sign( signature, len_signature_buf, signer,
+                            message, len_message, false );
+    SHA256_account( SH_OP_SIGN, start );
+    return success;
+}
+
+bool sh_sign_online( void *signature, size_t len_signature_buf,
+              struct sh_signer *signer,
+              const void *message, size_t len_message ) {
+    long start = hash_compression_count;
+    bool success = do_sign( signature, len_signature_buf, signer,
+                            message, len_message, true );
+    SHA256_account( SH_OP_SIGN, start );
+    return success;
+}
+
 /*
  * This returns the length of the hybrid signature
  * Currently, it's a function of parameters from tune.h
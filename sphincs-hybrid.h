@@ -31,6 +31,43 @@ bool sh_keygen( int hash_function, int hash_size, int time_space,
                 void *sk_buffer, size_t len_sk_buffer, size_t *size_sk, 
                 void *pk_buffer, size_t len_pk_buffer, size_t *size_pk); 
 
+/*
+ * The same as sh_keygen, except that this also writes out an 'acceleration
+ * blob' to accel_buffer (len_accel_buffer long; the actual length is
+ * written to size_accel, if non-NULL).  This holds the leaves of the top
+ * Merkle tree of the hypertree (which we have to build to compute the
+ * public key anyways); it isn't secret.  If you pass it to
+ * sh_load_signer_accel along with the private key, the load doesn't have
+ * to build that tree again.
+ */
+bool sh_keygen_accel( int hash_function, int hash_size, int time_space,
+                bool (*do_rand)( void *buffer, size_t len_buffer ),
+                void *sk_buffer, size_t len_sk_buffer, size_t *size_sk, 
+                void *pk_buffer, size_t len_pk_buffer, size_t *size_pk,
+                void *accel_buffer, size_t len_accel_buffer,
+                size_t *size_accel );
+
+/* Return the length of the acceleration blob */
+size_t sh_accel_len( int hash_function, int hash_size, int time_space );
+/* Length of the acceleration blob, assuming a 192 bit hash function */
+#define LEN_ACCEL_192 (4 + 256*24)  /* 6148 total */
+
+/*
+ * This generates count keypairs at once, for when you're provisioning keys
+ * in bulk.  The parameters are as for sh_keygen, except that the secret
+ * keys are placed one after the other in sk_buffer (each one
+ * sh_privkey_len bytes long), and the public keys likewise in pk_buffer
+ * (in the same order).
+ * We call do_rand only from the calling thread; building the public keys
+ * is then spread over up to LOAD_THREADS threads (see tune.h).
+ * If this fails, it zeroes both buffers (it doesn't return a partial set)
+ */
+bool sh_keygen_many( int hash_function, int hash_size, int time_space,
+                bool (*do_rand)( void *buffer, size_t len_buffer ),
+                unsigned count,
+                void *sk_buffer, size_t len_sk_buffer,
+                void *pk_buffer, size_t len_pk_buffer );
+
 /* Return the length of the public key, assuming the specified setting */
 size_t sh_pubkey_len( int hash_function, int hash_size, int time_space );
 /* Length of a public key, assuming a 192 bit hash function */
@@ -53,6 +90,17 @@ struct sh_signer;
 struct sh_signer *sh_load_signer( const void *sk_buffer,
                 bool (*do_rand)( void *buffer, size_t len_buffer ) );
 
+/*
+ * The same, using the acceleration blob that sh_keygen_accel wrote for
+ * this key (accel, len_accel bytes long); this lets us skip building the
+ * top Merkle tree of the hypertree, which cuts the load time.  We check
+ * the blob against the root in the private key; this fails if the blob
+ * isn't the one for this key
+ */
+struct sh_signer *sh_load_signer_accel( const void *sk_buffer,
+                const void *accel, size_t len_accel,
+                bool (*do_rand)( void *buffer, size_t len_buffer ) );
+
 /*
  * Remove (and zeroize) the loaded key
  */
@@ -66,6 +114,51 @@ bool sh_sign( void *signature, size_t len_signature_buf,
               const void *message, size_t len_message );
 size_t sh_sig_len( struct sh_signer *signer );
 
+/*
+ * Start a thread that does the work of building the next LMS tree and
+ * Sphincs+ signature in the background (rather than a step of it in each
+ * sh_sign call); that cuts the latency of sh_sign, provided there's a spare
+ * core for the thread to run on.  cpu is the CPU to pin the thread to
+ * (-1 -> don't pin it).  If signing gets ahead of the thread, sh_sign
+ * waits for it, and sh_sign_online fails rather than wait.
+ * sh_delete_signer stops the thread.  This returns false if the thread
+ * couldn't be started (or if this was built without BUILD_THREAD, see
+ * tune.h); the signer then carries on as before
+ */
+bool sh_start_build_thread( struct sh_signer *signer, int cpu );
+
+/*
+ * The online/offline split
+ * sh_sign_online generates a signature (same parameters as sh_sign), doing
+ * only the work that depends on the message; the work of getting ready for
+ * later signatures (building the next LMS tree and Sphincs+ signature) is
+ * left to sh_do_offline_work, which the application can call when it has
+ * time to spare (or to the build thread, if it's running).  sh_sign_online
+ * fails if that work has fallen so far behind that it can't sign without
+ * it; it never does that work itself, nor waits for the thread to do it
+ * (sh_sign still works then; it does or waits for whatever is needed first)
+ */
+bool sh_sign_online( void *signature, size_t len_signature_buf,
+              struct sh_signer *signer,
+              const void *message, size_t len_message );
+
+/*
+ * Do offline work for up to budget units of work (see below); we stop
+ * once we've reached that, and so may go over by up to one step's worth
+ * (roughly a thousand hash compressions).  Returns true if there is still
+ * offline work to do; false if we've caught up (or if the signer has hit
+ * an error, or if the build thread is running, as that does it all)
+ */
+#define SH_WORK_HASHES 0   /* budget is in SHA-256 hash compressions */
+#define SH_WORK_USEC   1   /* budget is in microseconds */
+bool sh_do_offline_work( struct sh_signer *signer, long budget, int unit );
+
+/*
+ * The number of signatures that sh_sign_online can generate before it
+ * needs more offline work
+ */
+unsigned long sh_signatures_remaining( struct sh_signer *signer );
+
 /* The length of a signature in 192 bit slow mode */
 #define LEN_SIG_192_SLOW (17064 + 52 + 1744)  /* 18860 total */
 
@@ -79,4 +172,51 @@ bool sh_verify( const void *message, size_t len_message,
                 const void *signature, size_t len_signature,
                 const void *public_key );
 
+/*
+ * SHA-256 backend selection
+ * We have several SHA-256 implementations (OpenSSL, our portable one, the
+ * x86 SHA extensions, and 4/8/16 lane SIMD ones), and we pick at runtime
+ * which one to use for each of these jobs:
+ */
+#define SH_HASH_SINGLE   0   /* Hashing a single message */
+#define SH_HASH_MIDSTATE 1   /* Compressing blocks from a saved midstate */
+                             /* (most of our hashes) */
+#define SH_HASH_MULTI    2   /* Hashing several messages at once */
+/*
+ * On the first sh_keygen, sh_load_signer or sh_verify call, we time the
+ * ones this CPU can run, and pick the fastest.  These allow the application to see what
+ * we picked, or override it
+ */
+
+/* Return the name of the backend used for the job */
+const char *sh_get_hash_backend( int role );
+
+/* Use the named backend for the job (NULL -> go back to the fastest). */
+/* Returns false if we don't have that backend, or it can't do that job */
+/* on this CPU */
+bool sh_set_hash_backend( int role, const char *name );
+
+/* Return the name of the index'th backend that can do the job (NULL if */
+/* index is past the end of the list) */
+const char *sh_list_hash_backends( int role, unsigned index );
+
+/*
+ * Hash accounting
+ * We count the SHA-256 compression operations each thread performs
+ * (whichever backend does them); as that's where nearly all our time goes,
+ * it's a good measure of the cost of an operation
+ */
+
+/* The number of compression operations this thread has performed so far */
+long sh_hash_count( void );
+
+/* The number of compression operations the most recent call to the */
+/* operation on this thread performed */
+#define SH_OP_SIGN   0   /* sh_sign (including its step) */
+#define SH_OP_STEP   1   /* The step of building the next LMS tree and */
+                         /* Sphincs+ signature that each sh_sign (and */
+                         /* sh_load_signer, many times) performs */
+#define SH_OP_VERIFY 2   /* sh_verify */
+long sh_last_hash_count( int op );
+
 #endif /* SPHINCS_HYBRID_ */
@@ -3,6 +3,9 @@
 #include "zeroize.h"
 #include <stdbool.h>
 #include <stdint.h>
+#if FAULT_INJECTION
+#include <pthread.h>
+#endif
 
 /*
  * This defines the various internal functions that Sphincs+ relies on
@@ -22,43 +25,83 @@ int hash_len( hash_t hash ) {
     return hash_len[ hash & HASH_LEN_MASK ];
 }
 
+bool init_sphincs_seed( struct sphincs_seed *pre, hash_t hash,
+                        const unsigned char *pk_seed ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+
+    switch (hash >> HASH_TYPE_SHIFT) {
+    case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT:
+        SHA256_set_first_block( &pre->sha256, pk_seed, n );
+        return true;
+    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT:
+        haraka_init_ctx( &pre->haraka, pk_seed, n );
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Haraka hashes the full 32 byte ADR structure (as there's no padding to
+ * save, the reference code doesn't bother compressing it); this expands our
+ * compressed version.  The full version has each field as a 32 bit word,
+ * except for the 96 bit tree address
+ */
+#define LEN_FULL_ADR 32
+static void expand_adr( unsigned char *full, adr_t adr ) {
+    memset( full, 0, LEN_FULL_ADR );
+    full[3] = adr[0];                    /* Layer address */
+    memcpy( full + 8, adr + 1, 8 );      /* Tree address */
+    full[19] = adr[9];                   /* Type */
+    memcpy( full + 20, adr + 10, 12 );   /* Key pair/chain/hash addresses, */
+                                         /* or tree height/index */
+}
+
 /*
  * The F function from Sphincs+
  * It assumes that the message m is n bytes long 
  * This zeroizes intermediate contents, because this is used in the
  * WOTS chain, and we don't want to reveal previous states
  */
-bool do_F( void *dest, hash_t hash, const SHA256_FIRSTBLOCK *pk_seed,
+bool do_F( void *dest, hash_t hash, const struct sphincs_seed *pk_seed,
            adr_t adr, const void *m ) {
     int n = hash_len(hash);
     if (!n) return false;
 
-    uint32_t mask[MAX_HASH_LEN/4];
-
     switch (hash >> HASH_TYPE_SHIFT) {
 //    case HASH_TYPE_SHAKE256 >> HASH_TYPE_SHIFT:
 // TO DO: IMPLEMENT THIS CASE
 
     case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT: {
-        SHA256_CTX ctx;
-        SHA256_init_first_block_ctx( &ctx, pk_seed );
-        SHA256_Update( &ctx, adr, LEN_ADR );
-        SHA256_Update( &ctx, m, n );
-        SHA256_Final( (void *)mask, &ctx );
-        zeroize( &ctx, sizeof ctx );
+        /* ADR || m fits (with padding) within a single block */
+        unsigned char block[ 64 * SHA256_PADDED_BLOCKS(LEN_ADR+MAX_HASH_LEN) ];
+        memcpy( block, adr, LEN_ADR );
+        memcpy( block + LEN_ADR, m, n );
+        SHA256_pad_blocks( block, LEN_ADR + n, 64 );
+        SHA256_hash_blocks( dest, n, &pk_seed->sha256.state, block,
+                            SHA256_PADDED_BLOCKS(LEN_ADR + n) );
+        zeroize( block, sizeof block );
         break;
     }
 
-//    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT:
-// TO DO: IMPLEMENT THIS CASE
+    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT: {
+        /* Haraka-512 of ADR || m (zero padded) */
+        unsigned char block[64], output[32];
+        memset( block, 0, sizeof block );
+        expand_adr( block, adr );
+        memcpy( block + LEN_FULL_ADR, m, n );
+        haraka512( output, block, &pk_seed->haraka );
+        memcpy( dest, output, n );
+        zeroize( block, sizeof block );
+        zeroize( output, sizeof output );
+        break;
+    }
 
     default:
         return false;
     }
 
-    memcpy( dest, mask, n );
-
-    zeroize( mask, sizeof mask );
     return true;
 }
 
@@ -66,20 +109,43 @@ bool do_F( void *dest, hash_t hash, const SHA256_FIRSTBLOCK *pk_seed,
  * The H function from Sphincs+
  * It assumes that the messages m1, m2 are n bytes long 
  */
-bool do_H( void *dest, hash_t hash, const SHA256_FIRSTBLOCK *pk_seed,
+bool do_H( void *dest, hash_t hash, const struct sphincs_seed *pk_seed,
     adr_t adr, const void *m1, const void *m2 ) {
     int n = hash_len(hash);
     if (!n) return false;
 
-    uint32_t messages[MAX_HASH_LEN/2];
-    memcpy( messages+0, m1, n );
-    memcpy( messages+n/4, m2, n );
+    switch (hash >> HASH_TYPE_SHIFT) {
+    case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT: {
+        unsigned char block[ 64 *
+                            SHA256_PADDED_BLOCKS(LEN_ADR+2*MAX_HASH_LEN) ];
+        memcpy( block, adr, LEN_ADR );
+        memcpy( block + LEN_ADR, m1, n );
+        memcpy( block + LEN_ADR + n, m2, n );
+        SHA256_pad_blocks( block, LEN_ADR + 2*n, 64 );
+        SHA256_hash_blocks( dest, n, &pk_seed->sha256.state, block,
+                            SHA256_PADDED_BLOCKS(LEN_ADR + 2*n) );
+        break;
+    }
+
+    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT: {
+        /* Haraka-S of ADR || m1 || m2 */
+        unsigned char block[ LEN_FULL_ADR + 2*MAX_HASH_LEN ];
+        expand_adr( block, adr );
+        memcpy( block + LEN_FULL_ADR, m1, n );
+        memcpy( block + LEN_FULL_ADR + n, m2, n );
+        haraka_S( dest, n, block, LEN_FULL_ADR + 2*n, &pk_seed->haraka );
+        break;
+    }
+
+    default:
+        return false;
+    }
 
-    return do_thash( dest, hash, pk_seed, adr, messages, 2*n );
+    return true;
 }
 
 bool do_thash( unsigned char *dest, hash_t hash, 
-               const SHA256_FIRSTBLOCK *pk_seed, adr_t adr,
+               const struct sphincs_seed *pk_seed, adr_t adr,
                const uint32_t *in, size_t in_len ) {
     int n = hash_len(hash);
     if (!n) return false;
@@ -95,14 +161,22 @@ bool do_thash( unsigned char *dest, hash_t hash,
 //        uint32_t masked[ in_len / 4 ];
 //        xor_mask_sha256(masked, in, in_len, hash, 
 //                 pk_seed, adr, &ctx, n);
-        SHA256_init_first_block_ctx( &ctx, pk_seed );
+        SHA256_init_first_block_ctx( &ctx, &pk_seed->sha256 );
         SHA256_Update( &ctx, adr, LEN_ADR );
         SHA256_Update( &ctx, in, in_len );
         SHA256_Final( (void *)output, &ctx );
         break;
     }
-//    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT:
-// TO DO: IMPLEMENT THIS CASE
+    case HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT: {
+        struct haraka_S_state state;
+        unsigned char full_adr[ LEN_FULL_ADR ];
+        expand_adr( full_adr, adr );
+        haraka_S_init( &state );
+        haraka_S_absorb( &state, full_adr, LEN_FULL_ADR, &pk_seed->haraka );
+        haraka_S_absorb( &state, in, in_len, &pk_seed->haraka );
+        haraka_S_squeeze( output, n, &state, &pk_seed->haraka );
+        break;
+    }
 
     default:
         return false;
@@ -112,6 +186,454 @@ bool do_thash( unsigned char *dest, hash_t hash,
     return true;
 }
 
+/*
+ * The SHA-256/192 specialized versions
+ */
+void init_F_sha256_192( unsigned char *block ) {
+    SHA256_pad_blocks( block, LEN_ADR + 24, 64 );
+}
+
+void init_H_sha256_192( unsigned char *block ) {
+    SHA256_pad_blocks( block, LEN_ADR + 2*24, 64 );
+}
+
+void init_thash_sha256_192( unsigned char *block, size_t in_len ) {
+    SHA256_pad_blocks( block, LEN_ADR + in_len, 64 );
+}
+
+void do_F_sha256_192( unsigned char *dest, const struct sphincs_seed *pk_seed,
+                      unsigned char *block, const void *m ) {
+    if (m != block + LEN_ADR) memcpy( block + LEN_ADR, m, 24 );
+    SHA256_hash_blocks( dest, 24, &pk_seed->sha256.state, block, 1 );
+}
+
+void do_H_sha256_192( unsigned char *dest, const struct sphincs_seed *pk_seed,
+                      unsigned char *block, const void *m1, const void *m2 ) {
+    if (m1 != block + LEN_ADR) memcpy( block + LEN_ADR, m1, 24 );
+    if (m2 != block + LEN_ADR + 24) memcpy( block + LEN_ADR + 24, m2, 24 );
+    SHA256_hash_blocks( dest, 24, &pk_seed->sha256.state, block, 2 );
+}
+
+void do_F_sha256_192_many( unsigned char *const *dest,
+                           const struct sphincs_seed *pk_seed,
+                           const unsigned char *const *block,
+                           unsigned count ) {
+    SHA256_multi_hash_blocks( dest, 24, &pk_seed->sha256.state, block, 1,
+                              count );
+}
+
+void do_H_sha256_192_many( unsigned char *const *dest,
+                           const struct sphincs_seed *pk_seed,
+                           const unsigned char *const *block,
+                           unsigned count ) {
+    SHA256_multi_hash_blocks( dest, 24, &pk_seed->sha256.state, block, 2,
+                              count );
+}
+
+void do_thash_sha256_192( unsigned char *dest,
+                          const struct sphincs_seed *pk_seed,
+                          const unsigned char *block, size_t in_len ) {
+    SHA256_hash_blocks( dest, 24, &pk_seed->sha256.state, block,
+                        SHA256_PADDED_BLOCKS( LEN_ADR + in_len ) );
+}
+
+/*
+ * The batched versions of the above; these compute count independent
+ * hashes (each with its own ADR) at once.  dest[i] may be the same as the
+ * corresponding input (we compute all the hashes before writing any
+ * result).
+ * For SHA-256, this feeds the multi-buffer engine (which computes up to
+ * SHA256_MAX_LANES hashes at once using SIMD); we don't have a batched
+ * Haraka, and so that just does the hashes one at a time
+ */
+#define HASH_BATCH SHA256_MAX_LANES  /* Hashes we set up at once */
+
+bool do_F_many( unsigned char *const *dest, hash_t hash,
+                const struct sphincs_seed *pk_seed,
+                const unsigned char *const *adr,
+                const unsigned char *const *m, unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned i, base;
+
+    switch (hash >> HASH_TYPE_SHIFT) {
+    case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT: {
+        unsigned char msg[ HASH_BATCH ][ LEN_ADR + MAX_HASH_LEN ];
+        unsigned char output[ HASH_BATCH ][ 32 ];
+        const void *msg_p[ HASH_BATCH ];
+        unsigned char *output_p[ HASH_BATCH ];
+        for (i=0; i<HASH_BATCH; i++) {
+            msg_p[i] = msg[i];
+            output_p[i] = output[i];
+        }
+        for (base = 0; base < count; base += HASH_BATCH) {
+            unsigned this_count = count - base;
+            if (this_count > HASH_BATCH) this_count = HASH_BATCH;
+            for (i=0; i<this_count; i++) {
+                memcpy( msg[i], adr[base+i], LEN_ADR );
+                memcpy( msg[i] + LEN_ADR, m[base+i], n );
+            }
+            SHA256_multi_first_block( output_p, &pk_seed->sha256, msg_p,
+                                      LEN_ADR + n, this_count );
+            for (i=0; i<this_count; i++) {
+                memcpy( dest[base+i], output[i], n );
+            }
+        }
+        /* These are WOTS chain values; don't leave them around */
+        zeroize( msg, sizeof msg );
+        zeroize( output, sizeof output );
+        return true;
+    }
+
+    default:
+        for (i=0; i<count; i++) {
+            if (!do_F( dest[i], hash, pk_seed, (adr_t)adr[i], m[i] )) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+bool do_H_many( unsigned char *const *dest, hash_t hash,
+                const struct sphincs_seed *pk_seed,
+                const unsigned char *const *adr,
+                const unsigned char *const *m1,
+                const unsigned char *const *m2, unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned i, base;
+
+    switch (hash >> HASH_TYPE_SHIFT) {
+    case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT: {
+        unsigned char msg[ HASH_BATCH ][ LEN_ADR + 2*MAX_HASH_LEN ];
+        unsigned char output[ HASH_BATCH ][ 32 ];
+        const void *msg_p[ HASH_BATCH ];
+        unsigned char *output_p[ HASH_BATCH ];
+        for (i=0; i<HASH_BATCH; i++) {
+            msg_p[i] = msg[i];
+            output_p[i] = output[i];
+        }
+        for (base = 0; base < count; base += HASH_BATCH) {
+            unsigned this_count = count - base;
+            if (this_count > HASH_BATCH) this_count = HASH_BATCH;
+            for (i=0; i<this_count; i++) {
+                memcpy( msg[i], adr[base+i], LEN_ADR );
+                memcpy( msg[i] + LEN_ADR, m1[base+i], n );
+                memcpy( msg[i] + LEN_ADR + n, m2[base+i], n );
+            }
+            SHA256_multi_first_block( output_p, &pk_seed->sha256, msg_p,
+                                      LEN_ADR + 2*n, this_count );
+            for (i=0; i<this_count; i++) {
+                memcpy( dest[base+i], output[i], n );
+            }
+        }
+        return true;
+    }
+
+    default:
+        for (i=0; i<count; i++) {
+            if (!do_H( dest[i], hash, pk_seed, (adr_t)adr[i],
+                       m1[i], m2[i] )) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+/* Each of the inputs is in_len bytes long */
+bool do_thash_many( unsigned char *const *dest, hash_t hash,
+                const struct sphincs_seed *pk_seed,
+                const unsigned char *const *adr,
+                const uint32_t *const *in, size_t in_len, unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned i, base;
+
+    switch (hash >> HASH_TYPE_SHIFT) {
+    case HASH_TYPE_SHA256 >> HASH_TYPE_SHIFT: {
+        unsigned char msg[ HASH_BATCH ][ LEN_ADR + in_len ];
+        unsigned char output[ HASH_BATCH ][ 32 ];
+        const void *msg_p[ HASH_BATCH ];
+        unsigned char *output_p[ HASH_BATCH ];
+        for (i=0; i<HASH_BATCH; i++) {
+            msg_p[i] = msg[i];
+            output_p[i] = output[i];
+        }
+        for (base = 0; base < count; base += HASH_BATCH) {
+            unsigned this_count = count - base;
+            if (this_count > HASH_BATCH) this_count = HASH_BATCH;
+            for (i=0; i<this_count; i++) {
+                memcpy( msg[i], adr[base+i], LEN_ADR );
+                memcpy( msg[i] + LEN_ADR, in[base+i], in_len );
+            }
+            SHA256_multi_first_block( output_p, &pk_seed->sha256, msg_p,
+                                      LEN_ADR + in_len, this_count );
+            for (i=0; i<this_count; i++) {
+                memcpy( dest[base+i], output[i], n );
+            }
+        }
+        return true;
+    }
+
+    default:
+        for (i=0; i<count; i++) {
+            if (!do_thash( dest[i], hash, pk_seed, (adr_t)adr[i],
+                           in[i], in_len )) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+/*
+ * The duplicated lane versions.  We take the hashes DUP_BATCH at a time,
+ * and hand the underlying function twice that many: the originals in
+ * order, followed by the copies in reverse order.  Hash i then goes into
+ * positions i and 2*c-1-i; those differ by an odd amount, and every
+ * multi-lane engine has an even number of lanes, and so the two copies
+ * never land in the same lane (and with c <= SHA256_MAX_LANES/2, they
+ * run in the same SIMD operation).  The results go into a scratch area,
+ * and we copy them to dest only once they agree (so a dest that is also
+ * an input isn't updated twice)
+ */
+#define DUP_BATCH (SHA256_MAX_LANES / 2)
+#if FAULT_STRATEGY == 2
+#define DUP_ATTEMPTS 3   /* On a mismatch, we recompute up to twice more */
+#else
+#define DUP_ATTEMPTS 1   /* On a mismatch, we give up immediately */
+#endif
+
+#if FAULT_INJECTION
+long fault_injection_countdown = 0;
+static pthread_mutex_t fault_injection_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool fault_injection_fire( void ) {
+    pthread_mutex_lock( &fault_injection_lock );
+    bool fire = fault_injection_countdown > 0 &&
+                --fault_injection_countdown == 0;
+    pthread_mutex_unlock( &fault_injection_lock );
+    return fire;
+}
+#endif
+
+/* Place hashes base..base+c-1 of in, and then their copies, into out */
+static void dup_order( const unsigned char **out,
+                       const unsigned char *const *in,
+                       unsigned base, unsigned c ) {
+    unsigned i;
+    for (i=0; i<c; i++) {
+        out[i] = in[base+i];
+        out[2*c-1-i] = in[base+i];
+    }
+}
+
+/* Check that both copies of each hash agree; if so, write them to dest */
+static bool dup_check( unsigned char *const *dest,
+                       unsigned char (*out)[MAX_HASH_LEN],
+                       unsigned c, int n ) {
+    unsigned i;
+#if FAULT_INJECTION
+    if (fault_injection_fire()) {
+        out[0][0] ^= 1;   /* Pretend lane 0 miscomputed */
+    }
+#endif
+    for (i=0; i<c; i++) {
+        if (0 != memcmp( out[i], out[2*c-1-i], n )) return false;
+    }
+    for (i=0; i<c; i++) {
+        memcpy( dest[i], out[i], n );
+    }
+    return true;
+}
+
+bool do_F_sha256_192_many_dup( unsigned char *const *dest,
+                               const struct sphincs_seed *pk_seed,
+                               const unsigned char *const *block,
+                               unsigned count ) {
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *block_p[2*DUP_BATCH];
+    unsigned i, base, attempt;
+    bool ok = true;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; ok && base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( block_p, block, base, c );
+        for (attempt = 0;; attempt++) {
+            do_F_sha256_192_many( out_p, pk_seed, block_p, 2*c );
+            if (dup_check( &dest[base], out, c, 24 )) break;
+            if (attempt+1 == DUP_ATTEMPTS) { ok = false; break; }
+        }
+    }
+    /* These may be WOTS chain values; don't leave them around */
+    zeroize( out, sizeof out );
+    return ok;
+}
+
+bool do_H_sha256_192_many_dup( unsigned char *const *dest,
+                               const struct sphincs_seed *pk_seed,
+                               const unsigned char *const *block,
+                               unsigned count ) {
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *block_p[2*DUP_BATCH];
+    unsigned i, base, attempt;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( block_p, block, base, c );
+        for (attempt = 0;; attempt++) {
+            do_H_sha256_192_many( out_p, pk_seed, block_p, 2*c );
+            if (dup_check( &dest[base], out, c, 24 )) break;
+            if (attempt+1 == DUP_ATTEMPTS) return false;
+        }
+    }
+    return true;
+}
+
+bool do_thash_sha256_192_many_dup( unsigned char *const *dest,
+                                   const struct sphincs_seed *pk_seed,
+                                   const unsigned char *const *block,
+                                   size_t in_len, unsigned count ) {
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *block_p[2*DUP_BATCH];
+    unsigned num_blocks = SHA256_PADDED_BLOCKS( LEN_ADR + in_len );
+    unsigned i, base, attempt;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( block_p, block, base, c );
+        for (attempt = 0;; attempt++) {
+            SHA256_multi_hash_blocks( out_p, 24, &pk_seed->sha256.state,
+                                      block_p, num_blocks, 2*c );
+            if (dup_check( &dest[base], out, c, 24 )) break;
+            if (attempt+1 == DUP_ATTEMPTS) return false;
+        }
+    }
+    return true;
+}
+
+bool do_F_many_dup( unsigned char *const *dest, hash_t hash,
+                    const struct sphincs_seed *pk_seed,
+                    const unsigned char *const *adr,
+                    const unsigned char *const *m, unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *adr_p[2*DUP_BATCH];
+    const unsigned char *m_p[2*DUP_BATCH];
+    unsigned i, base, attempt;
+    bool ok = true;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; ok && base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( adr_p, adr, base, c );
+        dup_order( m_p, m, base, c );
+        for (attempt = 0;; attempt++) {
+            if (!do_F_many( out_p, hash, pk_seed, adr_p, m_p, 2*c )) {
+                ok = false;
+                break;
+            }
+            if (dup_check( &dest[base], out, c, n )) break;
+            if (attempt+1 == DUP_ATTEMPTS) { ok = false; break; }
+        }
+    }
+    zeroize( out, sizeof out );
+    return ok;
+}
+
+bool do_H_many_dup( unsigned char *const *dest, hash_t hash,
+                    const struct sphincs_seed *pk_seed,
+                    const unsigned char *const *adr,
+                    const unsigned char *const *m1,
+                    const unsigned char *const *m2, unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *adr_p[2*DUP_BATCH];
+    const unsigned char *m1_p[2*DUP_BATCH];
+    const unsigned char *m2_p[2*DUP_BATCH];
+    unsigned i, base, attempt;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( adr_p, adr, base, c );
+        dup_order( m1_p, m1, base, c );
+        dup_order( m2_p, m2, base, c );
+        for (attempt = 0;; attempt++) {
+            if (!do_H_many( out_p, hash, pk_seed, adr_p, m1_p, m2_p, 2*c )) {
+                return false;
+            }
+            if (dup_check( &dest[base], out, c, n )) break;
+            if (attempt+1 == DUP_ATTEMPTS) return false;
+        }
+    }
+    return true;
+}
+
+bool do_thash_many_dup( unsigned char *const *dest, hash_t hash,
+                        const struct sphincs_seed *pk_seed,
+                        const unsigned char *const *adr,
+                        const uint32_t *const *in, size_t in_len,
+                        unsigned count ) {
+    int n = hash_len(hash);
+    if (!n) return false;
+    unsigned char out[2*DUP_BATCH][MAX_HASH_LEN];
+    unsigned char *out_p[2*DUP_BATCH];
+    const unsigned char *adr_p[2*DUP_BATCH];
+    const unsigned char *in_p[2*DUP_BATCH];
+    unsigned i, base, attempt;
+    for (i=0; i<2*DUP_BATCH; i++) out_p[i] = out[i];
+
+    for (base = 0; base < count; base += DUP_BATCH) {
+        unsigned c = count - base;
+        if (c > DUP_BATCH) c = DUP_BATCH;
+        dup_order( adr_p, adr, base, c );
+        dup_order( in_p, (const unsigned char *const *)in, base, c );
+        for (attempt = 0;; attempt++) {
+            if (!do_thash_many( out_p, hash, pk_seed, adr_p,
+                                (const uint32_t *const *)in_p, in_len,
+                                2*c )) {
+                return false;
+            }
+            if (dup_check( &dest[base], out, c, n )) break;
+            if (attempt+1 == DUP_ATTEMPTS) return false;
+        }
+    }
+    return true;
+}
+
+bool do_H_dup( unsigned char *dest, hash_t hash,
+               const struct sphincs_seed *pk_seed,
+               unsigned char *block, const void *m1, const void *m2 ) {
+    const unsigned char *block_p = block;
+    if (hash == HASH_SHA256_192) {
+        if (m1 != block + LEN_ADR) memcpy( block + LEN_ADR, m1, 24 );
+        if (m2 != block + LEN_ADR + 24) memcpy( block + LEN_ADR + 24, m2, 24 );
+        return do_H_sha256_192_many_dup( &dest, pk_seed, &block_p, 1 );
+    } else {
+        const unsigned char *m1_p = m1, *m2_p = m2;
+        return do_H_many_dup( &dest, hash, pk_seed, &block_p,
+                              &m1_p, &m2_p, 1 );
+    }
+}
+
 struct bit_extract {
     const unsigned char *p;
     int len;      /* Number of bytes remaining */
@@ -192,37 +714,53 @@ static void round_bit_extract( struct bit_extract *bit ) {
  * - idx_tree - the index (distance from the left-most edge of the entire
  *        hypertree) of the bottom-most Merkle tree.  This contains all the
  *        indicies of the trees above it.
+ * pk_seed_pre is the preprocessed version of seed; Haraka needs it (for the
+ * tweaked constants), SHA-256 doesn't
  */
 void do_compute_digest_index( uint32_t *md, uint64_t *idx_tree,
             unsigned *idx_leaf,
-            int n, const unsigned char *r, const unsigned char *seed, 
+            hash_t hash, const unsigned char *r, const unsigned char *seed, 
+            const struct sphincs_seed *pk_seed_pre,
             const unsigned char *root, const void *message, size_t len_message,
             int k, int a, int h, int d) {
-    unsigned char hash[32];
-    SHA256_CTX ctx;
-
-    /* Do the initial hash */
-    SHA256_Init( &ctx );
-    SHA256_Update( &ctx, r, n );
-    SHA256_Update( &ctx, seed, n );
-    SHA256_Update( &ctx, root, n );
-    SHA256_Update( &ctx, message, len_message );
-    SHA256_Final( hash, &ctx );
+    int n = hash_len(hash);
 
     /* Number of bytes of H_msg output we'll need */
     int m = (k*a + 7)/8 + (h - h/d + 7)/8 + (h/d + 7)/8;
     unsigned char buffer[ m + 31 ];
+    int i;
+
+    if ((hash >> HASH_TYPE_SHIFT) == (HASH_TYPE_HARAKA >> HASH_TYPE_SHIFT)) {
+        /* Haraka-S produces an arbitrary length output itself */
+        struct haraka_S_state state;
+        haraka_S_init( &state );
+        haraka_S_absorb( &state, r, n, &pk_seed_pre->haraka );
+        haraka_S_absorb( &state, seed, n, &pk_seed_pre->haraka );
+        haraka_S_absorb( &state, root, n, &pk_seed_pre->haraka );
+        haraka_S_absorb( &state, message, len_message, &pk_seed_pre->haraka );
+        haraka_S_squeeze( buffer, m, &state, &pk_seed_pre->haraka );
+    } else {
+        unsigned char digest[32];
+        SHA256_CTX ctx;
 
-    /* Generate the MGF1-output into buffer, producing a long output */
-    int i, index;
-    unsigned char count[4] = { 0 };
-    for (i=0, index = 0; i<m; i+=32, index++) {
+        /* Do the initial hash */
         SHA256_Init( &ctx );
-        SHA256_Update( &ctx, hash, 32 );
-        count[3] = index;  /* We never need 8k of output, hence setting */
-                           /* the lsbyte sufficies */
-        SHA256_Update( &ctx, count, 4 );
-        SHA256_Final( &buffer[i], &ctx );
+        SHA256_Update( &ctx, r, n );
+        SHA256_Update( &ctx, seed, n );
+        SHA256_Update( &ctx, root, n );
+        SHA256_Update( &ctx, message, len_message );
+        SHA256_Final( digest, &ctx );
+
+        /* Generate the MGF1-output into buffer, producing a long output */
+        int index;
+        unsigned char seed_count[32 + 4];   /* hash || count */
+        memcpy( seed_count, digest, 32 );
+        memset( seed_count + 32, 0, 4 );
+        for (i=0, index = 0; i<m; i+=32, index++) {
+            seed_count[35] = index;  /* We never need 8k of output, hence */
+                                     /* setting the lsbyte sufficies */
+            SHA256_hash( &buffer[i], seed_count, sizeof seed_count );
+        }
     }
 
     /* Now, parse that output into the individual values */
@@ -9,18 +9,179 @@
 #include <stdbool.h>
 #include <string.h>
 #include "sha256.h"
+#include "haraka.h"
+#include "tune.h"
 
-bool do_F( void *dest, hash_t hash, const SHA256_FIRSTBLOCK *pk_seed,
+/*
+ * The preprocessed version of PK.seed; every Sphincs+ hash depends on it,
+ * and so we do the work that depends only on it once (when we load the key)
+ */
+struct sphincs_seed {
+    SHA256_FIRSTBLOCK sha256;  /* SHA-256: the state after the first block */
+                               /* (PK.seed and padding) */
+    struct haraka_ctx haraka;  /* Haraka: the tweaked round constants */
+};
+
+/*
+ * Set up the preprocessed PK.seed for the given hash type
+ * Returns false if we don't support that hash
+ */
+bool init_sphincs_seed( struct sphincs_seed *pre, hash_t hash,
+                        const unsigned char *pk_seed );
+
+bool do_F( void *dest, hash_t hash, const struct sphincs_seed *pk_seed,
            adr_t adr, const void *m ); 
-bool do_H( void *dest, hash_t hash, const SHA256_FIRSTBLOCK *pk_seed,
+bool do_H( void *dest, hash_t hash, const struct sphincs_seed *pk_seed,
            adr_t adr, const void *m1, const void *m2 );
 bool do_thash( unsigned char *dest, hash_t hash, 
-           const SHA256_FIRSTBLOCK *pk_seed, adr_t adr,
+           const struct sphincs_seed *pk_seed, adr_t adr,
            const uint32_t *in, size_t in_len );
 
+/*
+ * Specialized versions for SHA-256/192 (the parameter set we normally
+ * use); these skip the hash type dispatch, and work on a message block
+ * that the caller keeps formatted between calls.  The block starts with
+ * the ADR structure (so the caller can update it in place with the
+ * set_*_address functions, and pass the block as the adr_t to the generic
+ * functions), followed by the message and the SHA-256 padding
+ */
+#define HASH_SHA256_192 (HASH_TYPE_SHA256 | HASH_LEN_192)
+#define F_SHA256_192_BLOCK_LEN  64    /* ADR || m || padding */
+#define H_SHA256_192_BLOCK_LEN 128    /* ADR || m1 || m2 || padding */
+
+/*
+ * The T_l message block (ADR || in_len byte message || padding); we use
+ * these for the WOTS+ public key compression (in_len is 51*24), and for
+ * the FORS root compression (in_len is SPH_K*24)
+ */
+#define THASH_SHA256_192_BLOCK_LEN(in_len) \
+                      (64 * SHA256_PADDED_BLOCKS( LEN_ADR + (in_len) ))
+
+/* Set up the padding; we need do this once per block */
+void init_F_sha256_192( unsigned char *block );
+void init_H_sha256_192( unsigned char *block );
+void init_thash_sha256_192( unsigned char *block, size_t in_len );
+
+/*
+ * Compute F or H, using the ADR at the start of the block; the message
+ * is copied into the block (unless it's already there, that is, m ==
+ * block + LEN_ADR; dest may also be that).  Note that these leave the
+ * message in the block; the caller is responsible for zeroizing it when
+ * it's done
+ */
+void do_F_sha256_192( unsigned char *dest, const struct sphincs_seed *pk_seed,
+           unsigned char *block, const void *m );
+void do_H_sha256_192( unsigned char *dest, const struct sphincs_seed *pk_seed,
+           unsigned char *block, const void *m1, const void *m2 );
+/* T_l on a block the caller has filled in (both the ADR and the message) */
+void do_thash_sha256_192( unsigned char *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *block, size_t in_len );
+
+/*
+ * Multi-lane versions; these compute F or H on count preformatted blocks
+ * (with the messages already in place) at once; dest[i] may point into
+ * block[i] (e.g. at the message, to step a WOTS+ chain in place)
+ */
+void do_F_sha256_192_many( unsigned char *const *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *block, unsigned count );
+void do_H_sha256_192_many( unsigned char *const *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *block, unsigned count );
+
+/*
+ * Batched versions of the above; these compute count independent hashes,
+ * the i-th one with adr[i] and message(s) m[i] into dest[i] (which may be
+ * the same buffer as its input).  The tree builders use these whenever
+ * they have several hashes that don't depend on each other, as we can
+ * compute several at once using SIMD instructions
+ */
+bool do_F_many( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const unsigned char *const *m, unsigned count );
+bool do_H_many( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const unsigned char *const *m1,
+           const unsigned char *const *m2, unsigned count );
+bool do_thash_many( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const uint32_t *const *in, size_t in_len, unsigned count );
+
+/*
+ * With FAULT_STRATEGY set, FAULT_LANES selects how we check the hashes that
+ * lead up to a value that a WOTS+ signature signs: either we build each
+ * FORS/Merkle tree a second time and compare the roots (FAULT_RECOMPUTE),
+ * or we compute each hash twice as we go (FAULT_DUP_LANES)
+ */
+#define FAULT_RECOMPUTE (FAULT_STRATEGY && !FAULT_LANES)
+#define FAULT_DUP_LANES (FAULT_STRATEGY && FAULT_LANES)
+
+/*
+ * Duplicated lane versions of the multi-lane/batched functions; these
+ * compute each hash twice, within the same multi-lane operation, and
+ * with the second copy in a different lane than the first (so that a
+ * fault in a single lane can't corrupt both the same way); we write dest
+ * only once the two copies agree.
+ * These return false if the copies disagreed (with FAULT_STRATEGY 2, we
+ * first try recomputing the hashes a few times)
+ */
+bool do_F_sha256_192_many_dup( unsigned char *const *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *block, unsigned count );
+bool do_H_sha256_192_many_dup( unsigned char *const *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *block, unsigned count );
+bool do_thash_sha256_192_many_dup( unsigned char *const *dest,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *block, size_t in_len,
+           unsigned count );
+bool do_F_many_dup( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const unsigned char *const *m, unsigned count );
+bool do_H_many_dup( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const unsigned char *const *m1,
+           const unsigned char *const *m2, unsigned count );
+bool do_thash_many_dup( unsigned char *const *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           const unsigned char *const *adr,
+           const uint32_t *const *in, size_t in_len, unsigned count );
+
+/*
+ * The same for a single H (as we compute when walking a node up a tree);
+ * block is an H message block (as for do_H_sha256_192), whose ADR we use
+ * for any hash type
+ */
+bool do_H_dup( unsigned char *dest, hash_t hash,
+           const struct sphincs_seed *pk_seed,
+           unsigned char *block, const void *m1, const void *m2 );
+
+#if FAULT_INJECTION
+/*
+ * Test hook: when this counts down to zero (it's decremented once per
+ * batch of duplicated hashes, and once per pair of roots we compare after
+ * a parallel recompute), we corrupt the result in one lane (or one of the
+ * roots)
+ */
+extern long fault_injection_countdown;
+
+/*
+ * Count down fault_injection_countdown; returns true if the caller should
+ * corrupt its result.  This is safe to call from several threads
+ */
+bool fault_injection_fire( void );
+#endif
+
 void do_compute_digest_index( uint32_t *md, uint64_t *idx_tree, 
             unsigned *idx_leaf,
-            int n, const unsigned char *r, const unsigned char *seed,
+            hash_t hash, const unsigned char *r, const unsigned char *seed,
+            const struct sphincs_seed *pk_seed_pre,
             const unsigned char *root, const void *message, size_t len_message,
             int k, int a, int h, int d);
 
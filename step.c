@@ -16,6 +16,7 @@
 #include "wots.h"
 #include "lm_ots_param.h"
 #include "tune.h"
+#include "thread_pool.h"
 
 #if PROFILE
 #include <stdio.h>
@@ -97,6 +98,437 @@ static void dummy_load( int steps ) {
 #endif
 }
 
+/*
+ * This computes the root of a subtree of the current FORS tree; the subtree
+ * has height 'height', and its leftmost leaf is first_leaf.  We compute all
+ * its leaves at once, and then each level of internal nodes at once, so
+ * that the multi-lane hash engine has something to work on
+ * This also writes the revealed leaf and the nodes of the authentication
+ * path that are within this subtree into the signature (the caller handles
+ * the nodes above the subtree)
+ * adr is the FORS ADR (with the layer, tree and key pair addresses set),
+ * and sig is where the signature of this FORS tree goes
+ * This returns false if we detected a fault (with FAULT_DUP_LANES)
+ */
+#define FORS_BATCH_HEIGHT 5   /* We work on subtrees of up to 32 leaves */
+#define FORS_BATCH (1 << FORS_BATCH_HEIGHT)
+
+static bool fors_subtree( struct sh_signer *signer,
+                          const struct private_key_generator *gen,
+                          const unsigned char *adr, unsigned tree,
+                          unsigned char *sig, unsigned first_leaf,
+                          unsigned height, unsigned char *root ) {
+    unsigned target = signer->temp.do_fors.md[ tree ];
+    bool fast = (signer->hash == HASH_SHA256_192);
+    unsigned width = 1 << height;  /* The number of nodes on this level */
+    unsigned level, j;
+
+    /*
+     * Each leaf has an F message block, and each internal node has an H
+     * message block; each hash writes its result directly into its
+     * parent's block (the level 1 blocks come first, then level 2, etc)
+     */
+    unsigned char f_block[FORS_BATCH][F_SHA256_192_BLOCK_LEN];
+    unsigned char h_block[FORS_BATCH-1][H_SHA256_192_BLOCK_LEN];
+    const unsigned char *block_p[FORS_BATCH];
+    const unsigned char *key_state[FORS_BATCH];
+    unsigned char *value[FORS_BATCH];
+    unsigned char *dest[FORS_BATCH];
+
+    /* Generate the leaf private values */
+    init_F_sha256_192( f_block[0] );
+    for (j = 0; j < width; j++) {
+        if (j > 0) {
+            memcpy( f_block[j] + LEN_ADR, f_block[0] + LEN_ADR,
+                    F_SHA256_192_BLOCK_LEN - LEN_ADR );
+        }
+        memcpy( f_block[j], adr, LEN_ADR );
+        set_tree_height( f_block[j], 0 );
+        set_tree_index( f_block[j], first_leaf + j + (tree << SPH_A) );
+        block_p[j] = f_block[j];
+        key_state[j] = &f_block[j][LEN_ADR-16];
+        value[j] = f_block[j] + LEN_ADR;
+    }
+    do_private_key_gen_many( value, 24, gen, key_state, width );
+    if (target - first_leaf < width) {
+        /* We're talking about the leaf we reveal */
+        memcpy( sig, value[target - first_leaf], 24 );
+    }
+
+    unsigned char (*parent)[H_SHA256_192_BLOCK_LEN] = h_block;
+    for (level = 0;; level++) {
+        /* Compute this level, placing each result where its parent */
+        /* will want it */
+        for (j = 0; j < width; j++) {
+            dest[j] = (width == 1) ? root :
+                              &parent[j/2][LEN_ADR + 24*(j & 1)];
+        }
+#if FAULT_DUP_LANES
+        bool ok;
+        if (level == 0) {
+            if (fast) {
+                ok = do_F_sha256_192_many_dup( dest, &signer->pk_seed_pre,
+                                      block_p, width );
+            } else {
+                ok = do_F_many_dup( dest, signer->hash, &signer->pk_seed_pre,
+                           block_p, (const unsigned char *const *)value,
+                           width );
+            }
+        } else {
+            if (fast) {
+                ok = do_H_sha256_192_many_dup( dest, &signer->pk_seed_pre,
+                                      block_p, width );
+            } else {
+                ok = do_H_many_dup( dest, signer->hash, &signer->pk_seed_pre,
+                           block_p, (const unsigned char *const *)value,
+                           (const unsigned char *const *)&value[width],
+                           width );
+            }
+        }
+        if (!ok) {
+            zeroize( f_block, (1 << height) * F_SHA256_192_BLOCK_LEN );
+            return false;
+        }
+#else
+        if (level == 0) {
+            if (fast) {
+                do_F_sha256_192_many( dest, &signer->pk_seed_pre,
+                                      block_p, width );
+            } else {
+                do_F_many( dest, signer->hash, &signer->pk_seed_pre,
+                           block_p, (const unsigned char *const *)value,
+                           width );
+            }
+        } else {
+            if (fast) {
+                do_H_sha256_192_many( dest, &signer->pk_seed_pre,
+                                      block_p, width );
+            } else {
+                do_H_many( dest, signer->hash, &signer->pk_seed_pre,
+                           block_p, (const unsigned char *const *)value,
+                           (const unsigned char *const *)&value[width],
+                           width );
+            }
+        }
+#endif
+        if (width == 1) break;   /* We've computed the root */
+
+        /* If any of these nodes is on the authentication path, write */
+        /* it out */
+        unsigned auth = (target >> level) ^ 1;
+        if (auth - (first_leaf >> level) < width) {
+            memcpy( sig + 24*(1+level), dest[auth - (first_leaf >> level)],
+                    24 );
+        }
+
+        /* Set up the next level up */
+        width /= 2;
+        for (j = 0; j < width; j++) {
+            memcpy( parent[j], adr, LEN_ADR );
+            init_H_sha256_192( parent[j] );
+            set_tree_height( parent[j], level+1 );
+            set_tree_index( parent[j], (first_leaf >> (level+1)) + j +
+                                       (tree << (SPH_A - (level+1))) );
+            block_p[j] = parent[j];
+            value[j] = &parent[j][LEN_ADR];              /* Left child */
+            value[width+j] = &parent[j][LEN_ADR + 24];   /* Right child */
+        }
+        parent += width;
+    }
+
+    zeroize( f_block, (1 << height) * F_SHA256_192_BLOCK_LEN );
+    return true;
+}
+
+/*
+ * This walks the root of a FORS subtree (height 'height', leftmost leaf
+ * 'leaf', value in buffer) up the FORS tree; we combine it with the left
+ * nodes we've saved in stack as far as we can (and save it there if it's a
+ * left node).  Any node on the authentication path is written to sig.
+ * Once we've done the last subtree, buffer holds the FORS root
+ * h_block is the ADR (and message block) for the internal nodes
+ * This returns false if we detected a fault (with FAULT_DUP_LANES)
+ */
+static bool fors_walk( struct sh_signer *signer, unsigned tree,
+                       unsigned char *sig, unsigned char *h_block,
+                       unsigned char *stack, unsigned leaf, unsigned height,
+                       unsigned char *buffer ) {
+    unsigned target = signer->temp.do_fors.md[ tree ];
+    unsigned node = leaf >> height;
+    unsigned full_node_name = node + (tree << (SPH_A - height));
+    int level;
+    for (level = height; level < SPH_A; ) {
+        if ((node^1) == (target >> level)) {
+            /* This node is on the authentication path */
+            memcpy( sig + 24*(1+level), buffer, 24 );
+        }
+        if (node & 1) {
+            /* This is the right node, combine it with the left node */
+            /* we have previous computed */
+            node >>= 1;
+            full_node_name >>= 1;
+            set_tree_index( h_block, full_node_name );
+            set_tree_height( h_block, level+1 );
+#if FAULT_DUP_LANES
+            if (!do_H_dup( buffer, signer->hash, &signer->pk_seed_pre,
+                           h_block, &stack[level * 24], buffer )) {
+                return false;
+            }
+#else
+            if (signer->hash == HASH_SHA256_192) {
+                do_H_sha256_192( buffer, &signer->pk_seed_pre,
+                      h_block, &stack[level * 24], buffer );
+            } else {
+                do_H( buffer, signer->hash,
+                      &signer->pk_seed_pre, h_block,
+                      &stack[level * 24], buffer );
+            }
+#endif
+            level++;
+        } else {
+            /* This is the left node, store so we can combine it */
+            /* later iwith the right node */ 
+            memcpy( &stack[level * 24], buffer, 24 );
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * This generates the WOTS+ signature of msg with the key at leaf 'leaf' of
+ * Merkle tree 'tree' at hypertree layer 'level', and writes it to target
+ * This returns the (approximate) number of hash compression operations we
+ * did, or -1 on failure
+ */
+static int hypertree_wots_sign( struct sh_signer *signer, int level,
+                                uint64_t tree, unsigned leaf,
+                                const unsigned char *msg,
+                                unsigned char *target ) {
+    int hc_done_so_far = 0; /* Count of the number of hash */
+                            /* computations we've done */
+    unsigned char digits[51];
+    
+    if (51 != expand_wots_digits( digits, 51, msg, 24 )) {
+        return -1;
+    }
+    /* The ADR is at the start of the F message block; we update */
+    /* it in place */
+    unsigned char f_block[F_SHA256_192_BLOCK_LEN];
+    unsigned char *adr = f_block;
+    set_layer_address( adr, level );
+    set_tree_address( adr, tree );
+    set_type( adr, WOTS_HASH_ADDRESS );
+    set_key_pair_address( adr, leaf );
+    init_F_sha256_192( f_block );
+
+    int i;
+    struct private_key_generator gen;
+    init_private_key_gen_from_seed( &gen, &signer->sk_seed_gen, adr,
+                          ADR_CONST_FOR_TREE );
+    hc_done_so_far += 1; /* init_key_gen does about 1 hash comp */
+
+    /* Generate the starts of all the chains at once */
+    {
+        unsigned char key_adr[51][LEN_ADR];
+        unsigned char *key[51];
+        const unsigned char *state[51];
+        for (i=0; i<51; i++) {
+            memcpy( key_adr[i], adr, LEN_ADR );
+            set_chain_address( key_adr[i], i );
+            set_hash_address( key_adr[i], 0 );
+            key[i] = target + 24*i;
+            state[i] = &key_adr[i][LEN_ADR-16];
+        }
+        do_private_key_gen_many( key, 24, &gen, state, 51 );
+        hc_done_so_far += 51; /* private_key_gen does 1 hash */
+                              /* comp per key */
+    }
+
+    /* Compute the WOTS signature */
+    for (i=0; i<51; i++) {
+        set_chain_address( adr, i );
+        int j;
+        for (j=0; j<digits[i]; j++) {
+            set_hash_address( adr, j );
+            if (signer->hash == HASH_SHA256_192) {
+                do_F_sha256_192( target, &signer->pk_seed_pre,
+                                 f_block, target );
+            } else {
+                do_F( target, signer->hash,
+                         &signer->pk_seed_pre, adr, target );
+            }
+            hc_done_so_far += 1; /* F does 1 hash comp */
+        }
+        target += 24;
+    }
+
+    zeroize( &gen, sizeof gen );
+    zeroize( f_block, sizeof f_block );
+    return hc_done_so_far;
+}
+
+/*
+ * The hypertree cache.  The top Merkle tree of the hypertree is the same
+ * tree in every signature; once we've built it, we keep all its nodes
+ * (about 12k), and never build it again.  That saves an eighth of the
+ * hypertree work of every Sphincs+ signature after the first.  (We don't
+ * keep any trees from the layer below; there are 256 of them, and each
+ * signature lands on a random one, so a few of them would hardly ever
+ * save us anything)
+ *
+ * With FAULT_STRATEGY, whenever we take the tree from the cache, we first
+ * recompute it from its leaves (which is cheap compared to building the
+ * leaves), in case the cache contents have been corrupted since
+ */
+
+/* Look for this tree in the cache; returns NULL if we don't have it */
+static struct hyper_cache_entry *hyper_cache_find( struct sh_signer *signer,
+                                      int level, uint64_t tree ) {
+    if (level == SPH_D-1 && signer->top_tree.valid) {
+        return &signer->top_tree;
+    }
+    return NULL;
+}
+
+/*
+ * Pick where we'll save this tree while we build it; the caller marks it
+ * valid once it has accepted the root.  Returns NULL if we don't keep
+ * trees at this layer
+ */
+static struct hyper_cache_entry *hyper_cache_slot( struct sh_signer *signer,
+                                      int level, uint64_t tree ) {
+    if (level != SPH_D-1) return NULL;
+    struct hyper_cache_entry *e = &signer->top_tree;
+    e->valid = false;
+    e->tree = tree;
+    return e;
+}
+
+/*
+ * Given the leaves of the tree at this position in the hypertree (in node,
+ * indexed by MERKLE_NODE), compute the rest of the nodes
+ */
+static void hyper_tree_nodes( struct sh_signer *signer, int level,
+                              uint64_t tree, unsigned char (*node)[24] ) {
+    unsigned char h_block[H_SHA256_192_BLOCK_LEN];
+    set_layer_address( h_block, level );
+    set_tree_address( h_block, tree );
+    set_type( h_block, HASH_TREE_ADDRESS );
+    init_H_sha256_192( h_block );
+    int h;
+    unsigned j;
+    for (h = 1; h <= SPH_T; h++) {
+        set_tree_height( h_block, h );
+        for (j = 0; j < (1 << (SPH_T - h)); j++) {
+            set_tree_index( h_block, j );
+            unsigned char *dest = node[ MERKLE_NODE( SPH_T, h, j ) ];
+            const unsigned char *left = node[ MERKLE_NODE( SPH_T, h-1, 2*j ) ];
+            const unsigned char *right = node[ MERKLE_NODE( SPH_T, h-1, 2*j+1 ) ];
+            if (signer->hash == HASH_SHA256_192) {
+                do_H_sha256_192( dest, &signer->pk_seed_pre, h_block,
+                                 left, right );
+            } else {
+                do_H( dest, signer->hash, &signer->pk_seed_pre, h_block,
+                      left, right );
+            }
+        }
+    }
+}
+
+/*
+ * Take the authentication path for leaf, and the root, from a cached tree
+ * With FAULT_STRATEGY, we first recompute the tree from the cached leaves,
+ * in case the cache has been corrupted since we built it (we're about to
+ * sign that root).  If the root doesn't match, we drop the tree from the
+ * cache, and return false (so the caller builds it the hard way); if it
+ * does, we take the authentication path from the nodes we've just
+ * recomputed (as a corrupted internal node of the cache wouldn't change
+ * the root)
+ */
+static bool hyper_cache_use( struct sh_signer *signer,
+                             struct hyper_cache_entry *e, int level,
+                             unsigned leaf, unsigned char *auth_path,
+                             unsigned char *root ) {
+#if FAULT_STRATEGY
+    unsigned char node[ (2 << SPH_T) - 1 ][ 24 ];
+    memcpy( node[ MERKLE_NODE( SPH_T, 0, 0 ) ],
+            e->node[ MERKLE_NODE( SPH_T, 0, 0 ) ], 24 << SPH_T );
+    hyper_tree_nodes( signer, level, e->tree, node );
+    if (0 != memcmp( node[ MERKLE_NODE( SPH_T, SPH_T, 0 ) ],
+                     e->node[ MERKLE_NODE( SPH_T, SPH_T, 0 ) ], 24 )) {
+        e->valid = false;
+        return false;
+    }
+#else
+    unsigned char (*node)[24] = e->node;
+#endif
+    int i;
+    for (i = 0; i < SPH_T; i++) {
+        memcpy( auth_path + 24*i,
+                node[ MERKLE_NODE( SPH_T, i, (leaf >> i) ^ 1 ) ], 24 );
+    }
+    memcpy( root, node[ MERKLE_NODE( SPH_T, SPH_T, 0 ) ], 24 );
+    return true;
+}
+
+/*
+ * Fill in the top tree of the cache from its leaves (as written by
+ * sh_keygen_accel).  These aren't secret, but we don't take them on faith;
+ * we compute the rest of the tree, and accept it only if that gives us the
+ * root from the private key
+ */
+bool load_top_tree( struct sh_signer *signer, const unsigned char *leaves ) {
+    struct hyper_cache_entry *e = &signer->top_tree;
+    memcpy( e->node[ MERKLE_NODE( SPH_T, 0, 0 ) ], leaves, 24 << SPH_T );
+    hyper_tree_nodes( signer, SPH_D-1, 0, e->node );
+    if (0 != memcmp( e->node[ MERKLE_NODE( SPH_T, SPH_T, 0 ) ],
+                     signer->root, 24 )) {
+        e->valid = false;
+        return false;
+    }
+    e->tree = 0;
+    e->valid = true;
+    return true;
+}
+
+/*
+ * We've accepted the root of the Merkle tree at the current layer of the
+ * hypertree (in next_root); move up to the next layer
+ */
+static void next_hyper_layer( struct sh_signer *signer ) {
+    memcpy( signer->temp.do_hyper.prev_root,
+            signer->temp.do_hyper.next_root, 24 );
+
+    signer->sphincs_sig_index += SPH_T * 24;
+    signer->idx_leaf = signer->idx_tree & ((1 << SPH_T) - 1);
+    signer->idx_tree >>= SPH_T;
+    signer->temp.do_hyper.do_tree = 0;
+    signer->temp.do_hyper.level++;
+    if (signer->temp.do_hyper.level == SPH_D) {
+        /* There are no higher levels; we've generated the */
+        /* full signature */
+        signer->build_state = b_done;
+    }
+}
+
+/*
+ * This picks the private key for the next LMS tree, and sets things up
+ * to build it
+ */
+static bool start_lms_tree( struct sh_signer *signer ) {
+    if (!read_drbg( signer->next_lms_seed, 32, &signer->drbg ) ||
+        !read_drbg( signer->next_lms_I, 16, &signer->drbg )) {
+        return false;
+    }
+        /* Expand it now; every leaf of the new tree will use it */
+    init_private_key_gen( &signer->next_lms_gen, signer->next_lms_seed,
+                          32, 0, 0 );
+    signer->build_state = b_do_lms;
+    signer->temp.do_lms.leaf = 0;
+    return true;
+}
+
 /*
  * The goal of this function is to perform the next step of the process
  * of creating a signed LMS public key
@@ -108,13 +540,12 @@ static void dummy_load( int steps ) {
  * introducing busy work (during the load process, we don't care; we just
  * want this done as soon as possible)
  */
-bool step_next( struct sh_signer *signer, bool do_dummy ) {
+static bool do_step( struct sh_signer *signer, bool do_dummy ) {
     if (signer->got_fatal_error) return true;
 
 #if PROFILE
-    extern long hash_compression_count; /* Most of the work is done */
-                                 /* computing hashes, hence we use that */
-                                 /* as the metric we try to balance */
+    /* Most of the work is done computing hashes, hence we use the */
+    /* count of hash compressions as the metric we try to balance */
     long start_hc = hash_compression_count; /* Remember the count */
                                  /* at the begining of the step */
     static int count[b_count];   /* Note: the profiling logic currently */
@@ -132,25 +563,25 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
         memset( max_seen, 0, sizeof max_seen );
 #endif
         /* We're just kicking off the process */
-
-        /* Pick the new LMS private key */
-        if (!read_drbg( signer->next_lms_seed, 32, &signer->drbg ) ||
-            !read_drbg( signer->next_lms_I, 16, &signer->drbg )) {
+        if (!start_lms_tree( signer )) {
             goto failure_state;
         }
-        signer->build_state = b_do_lms;
-        signer->temp.do_lms.leaf = 0;
             /* The above took hardly any time; start on the first leaves */
             /* of the LMS tree */
         /* FALLTHROUGH */
     case b_do_lms: {  /* We're building the next LMS tree */
         int i;
+            /* Generate this step's OTS public keys together (so that the */
+            /* hash engine can work on both leaves' chains at once) */
+        unsigned char pub_key[LMS_LEAF_PER_ITER][24];
+        lm_ots_generate_public_keys( signer->next_lms_I,
+                       signer->temp.do_lms.leaf, LMS_LEAF_PER_ITER,
+                       &signer->next_lms_gen, pub_key[0] );
         for (i=0; i<LMS_LEAF_PER_ITER; i++) {
             int leaf = signer->temp.do_lms.leaf++;
 
             unsigned char buffer[24];
-            lm_ots_generate_public_key( signer->next_lms_I, leaf,
-                       signer->next_lms_seed, buffer );
+            memcpy( buffer, pub_key[i], 24 );
 
             int level;
             unsigned node = leaf;
@@ -238,7 +669,8 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
         /* expand it to the digit index that Sphincs+ expects */
         do_compute_digest_index( signer->temp.do_fors.md,
                &signer->idx_tree, &signer->idx_leaf,
-               24, r, signer->pk_seed, signer->root,
+               signer->hash, r, signer->pk_seed, &signer->pk_seed_pre,
+               signer->root,
                signer->next_lms_pub_key, LEN_LMS_PUBLIC_KEY,
                SPH_K, SPH_A, SPH_H, SPH_D);
         /* And now we arrange the next step to start building the FORS */
@@ -259,14 +691,22 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
         set_tree_address( adr, signer->idx_tree );
         set_type( adr, FORS_TREE_ADDRESS );
         struct private_key_generator gen;
-        init_private_key_gen( &gen, signer->sk_seed, 24, adr,
+        init_private_key_gen_from_seed( &gen, &signer->sk_seed_gen, adr,
                               ADR_CONST_FOR_TREE );
 
         unsigned leaf = signer->temp.do_fors.leaf;
-        unsigned target = signer->temp.do_fors.md[ signer->temp.do_fors.tree ];
+        unsigned tree = signer->temp.do_fors.tree;
+        unsigned char *sig =
+                 &signer->next_sphincs_sig[ signer->sphincs_sig_index ];
         int i;
         set_key_pair_address( adr, signer->idx_leaf );
         unsigned char buffer[32];
+        /* The ADR (and, for SHA-256/192, message block) for the internal */
+        /* nodes above the subtrees; the walk below only updates the */
+        /* height and index */
+        unsigned char h_block[H_SHA256_192_BLOCK_LEN];
+        memcpy( h_block, adr, LEN_ADR );
+        init_H_sha256_192( h_block );
 #if SPEED_SETTING
 #define FORS_LEAFS_PER_ITER 220  /* Generating this many FORS leaves takes */
            /* approximately the same time as the LMS step with W=2 */
@@ -274,56 +714,38 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
 #define FORS_LEAFS_PER_ITER 410  /* Generating this many FORS leaves takes */
            /* approximately the same time as the LMS step with W=4 */
 #endif
-        for (i = 0; i < FORS_LEAFS_PER_ITER; i++) {
-            set_tree_height( adr, 0 );
-            set_tree_index( adr, 0 );
-            unsigned node = leaf;
-            unsigned full_node_name = leaf +
-                                       (signer->temp.do_fors.tree << SPH_A);
-            set_tree_index( adr, full_node_name );
-
-            do_private_key_gen(buffer, 24, &gen, &adr[LEN_ADR-16] );
-            if (leaf == target) {
-                /* We're talking about the leaf we reveal */
-                memcpy( &signer->next_sphincs_sig[signer->sphincs_sig_index],
-                        buffer, 24 );
+        for (i = 0; i < FORS_LEAFS_PER_ITER; ) {
+            /* Compute the largest aligned subtree starting at this leaf */
+            /* that fits in what's left of this iteration (these are */
+            /* mostly full FORS_BATCH subtrees; we use smaller ones to */
+            /* get aligned after we resume, and before we stop) */
+            unsigned height = FORS_BATCH_HEIGHT;
+            while ((leaf & ((1 << height) - 1)) != 0 ||
+                   i + (1 << height) > FORS_LEAFS_PER_ITER) {
+                height--;
             }
-            do_F( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                       &signer->pk_seed_pre, adr, buffer );
-            int level;
-            for (level = 0; level < SPH_A; ) {
-                if ((node^1) == (target >> level)) {
-                    /* This node is on the authentication path */
-                    int write_index = signer->sphincs_sig_index + 24*(1+level);
-                    memcpy( &signer->next_sphincs_sig[ write_index ],
-                        buffer, 24 );
-                }
-                if (node & 1) {
-                    /* This is the right node, combine it with the left node */
-                    /* we have previous computed */
-                    node >>= 1;
-                    full_node_name >>= 1;
-                    set_tree_index( adr, full_node_name );
-                    set_tree_height( adr, level+1 );
-                    do_H( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                          &signer->pk_seed_pre, adr,
-                          &signer->temp.do_fors.stack[level * 24], buffer );
-                    level++;
-                } else {
-                    /* This is the left node, store so we can combine it */
-                    /* later iwith the right node */ 
-                    memcpy(&signer->temp.do_fors.stack[level * 24], buffer, 24);
-                    break;
-                }
+            if (!fors_subtree( signer, &gen, adr, tree, sig, leaf, height,
+                               buffer )) {
+                zeroize( &gen, sizeof gen );
+                goto failure_state;
             }
-            leaf++;
+            i += 1 << height;
+
+            /* Now, walk the subtree root up the tree */
+            if (!fors_walk( signer, tree, sig, h_block,
+                            signer->temp.do_fors.stack,
+                            leaf, height, buffer )) {
+                zeroize( &gen, sizeof gen );
+                goto failure_state;
+            }
+            leaf += 1 << height;
             if (leaf == (1 << SPH_A)) {
                 /* We hit the root */
                 void *target = &signer->temp.do_fors.fors_roots[
                          (24/4) * signer->temp.do_fors.tree ];
                 leaf = 0; /* We're always restart at the beginning (either */
                           /* this FORS tree or the next) */
-#if FAULT_STRATEGY
+#if FAULT_RECOMPUTE
                 if (!signer->temp.do_fors.redundant_pass) {
                     /* This is the first pass; rerun with the second */
                     memcpy( target, buffer, 24 );
@@ -355,7 +777,6 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
             }
         }
         signer->temp.do_fors.leaf = leaf;
-        zeroize( buffer, sizeof buffer );
         zeroize( &gen, sizeof gen );
 
         if (signer->temp.do_fors.tree == SPH_K) {
@@ -374,18 +795,29 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
         set_tree_address( adr, signer->idx_tree );
         set_type( adr, FORS_TREE_ROOT_COMPRESS );
         set_key_pair_address( adr, signer->idx_leaf );
+        /* We compute it twice, and see if we come up with the same */
+        /* answer; we do this even if we're not in redundant mode, because */
+        /* it's so cheap */
         unsigned char buffer[ MAX_HASH_LEN ];
-        do_thash( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                  &signer->pk_seed_pre, adr,
-                  signer->temp.do_fors.fors_roots, SPH_K * 24 );
-
-        /* Now, compute it again, and see if we come up with the same answer */
-        /* We do this even if we're not in redundant mode, because it's */
-        /* so cheap */
         unsigned char buffer2[ MAX_HASH_LEN ];
-        do_thash( buffer2, HASH_TYPE_SHA256 | HASH_LEN_192,
-                  &signer->pk_seed_pre, adr,
-                  signer->temp.do_fors.fors_roots, SPH_K * 24 );
+        if (signer->hash == HASH_SHA256_192) {
+            unsigned char t_block[ THASH_SHA256_192_BLOCK_LEN( SPH_K * 24 ) ];
+            init_thash_sha256_192( t_block, SPH_K * 24 );
+            memcpy( t_block, adr, LEN_ADR );
+            memcpy( t_block + LEN_ADR, signer->temp.do_fors.fors_roots,
+                    SPH_K * 24 );
+            do_thash_sha256_192( buffer, &signer->pk_seed_pre,
+                                 t_block, SPH_K * 24 );
+            do_thash_sha256_192( buffer2, &signer->pk_seed_pre,
+                                 t_block, SPH_K * 24 );
+        } else {
+            do_thash( buffer, signer->hash,
+                      &signer->pk_seed_pre, adr,
+                      signer->temp.do_fors.fors_roots, SPH_K * 24 );
+            do_thash( buffer2, signer->hash,
+                      &signer->pk_seed_pre, adr,
+                      signer->temp.do_fors.fors_roots, SPH_K * 24 );
+        }
 
         if (0 != memcmp( buffer, buffer2, 24 )) {
 #if FAULT_STRATEGY == 2
@@ -409,8 +841,6 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
     }
     case b_hypertree:  /* We're building the Sphincs+ hypertree */
         if (signer->temp.do_hyper.do_tree == 0) {
-            int hc_done_so_far = 0; /* Count of the number of hash */
-                                    /* computations we've done */
             /* We're working on a WOTS+ signature within the hypertree */
             signer->temp.do_hyper.save_sphincs_sig_index =
                   signer->sphincs_sig_index; /* In case we need to restart */
@@ -419,61 +849,49 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
              * that's because we don't use this OTS signature to compute the
              * next root; hence a failure here doesn't allow anyone to forge
              */
-            unsigned char digits[51];
-            
-            if (51 != expand_wots_digits( digits, 51,
-                                signer->temp.do_hyper.prev_root, 24 )) {
+            int hc_done_so_far = hypertree_wots_sign( signer,
+                       signer->temp.do_hyper.level,
+                       signer->idx_tree, signer->idx_leaf,
+                       signer->temp.do_hyper.prev_root,
+                       &signer->next_sphincs_sig[ signer->sphincs_sig_index ] );
+            if (hc_done_so_far < 0) {
                 goto failure_state;
             }
-            unsigned char adr[LEN_ADR];
-            set_layer_address( adr, signer->temp.do_hyper.level );
-            set_tree_address( adr, signer->idx_tree );
-            set_type( adr, WOTS_HASH_ADDRESS );
-            set_key_pair_address( adr, signer->idx_leaf );
-
-            int i;
-            unsigned char *target = &signer->next_sphincs_sig[
-                                               signer->sphincs_sig_index ];
-            struct private_key_generator gen;
-            init_private_key_gen( &gen, signer->sk_seed, 24, adr,
-                                  ADR_CONST_FOR_TREE );
-            hc_done_so_far += 1; /* init_key_gen does about 1 hash comp */
-
-            /* Compute the WOTS signature */
-            for (i=0; i<51; i++) {
-                set_chain_address( adr, i );
-                set_hash_address( adr, 0 );
-                do_private_key_gen( target, 24, &gen, &adr[LEN_ADR-16] );
-                hc_done_so_far += 1; /* private_key_gen does 1 hash comp */
-                int j;
-                for (j=0; j<digits[i]; j++) {
-                    set_hash_address( adr, j );
-                    do_F( target, HASH_TYPE_SHA256|HASH_LEN_192,
-                             &signer->pk_seed_pre, adr, target );
-                    hc_done_so_far += 1; /* F does 1 hash comp */
-                }
-                target += 24;
-            }
-
-            zeroize( &gen, sizeof gen );
 
             /* This step was cheaper than our goal; even it out */
             if (do_dummy) dummy_load( DUMMY_TARGET - hc_done_so_far );
 
             /* We've generated the OTS; now start on the auth path */
             signer->sphincs_sig_index += 51 * 24;
-            signer->temp.do_hyper.do_tree = 1;
+            int level = signer->temp.do_hyper.level;
+            unsigned char *auth_path =
+                      &signer->next_sphincs_sig[ signer->sphincs_sig_index ];
 
+            /* If we've built this tree before, we needn't do it again */
+            struct hyper_cache_entry *cached = hyper_cache_find( signer,
+                                       level, signer->idx_tree );
+            if (cached && hyper_cache_use( signer, cached, level,
+                                   signer->idx_leaf, auth_path,
+                                   signer->temp.do_hyper.next_root )) {
+                next_hyper_layer( signer );
+                break;
+            }
+
+            signer->temp.do_hyper.do_tree = 1;
             init_build_merkle( &signer->temp.do_hyper.merk,
-                               signer->sk_seed, signer->pk_seed,
-                               HASH_TYPE_SHA256|HASH_LEN_192,
+                               &signer->sk_seed_gen, signer->pk_seed,
+                               signer->hash,
                                SPH_T,
-                               signer->temp.do_hyper.level,
+                               level,
                                signer->idx_tree,
                                signer->idx_leaf,
-                               &signer->next_sphincs_sig[
-                                          signer->sphincs_sig_index],
+                               auth_path,
                                signer->temp.do_hyper.next_root);
+            /* If it's one we keep, save all the nodes as we go */
+            struct hyper_cache_entry *fill = hyper_cache_slot( signer,
+                                       level, signer->idx_tree );
+            signer->temp.do_hyper.fill = fill;
+            if (fill) signer->temp.do_hyper.merk.nodes = fill->node[0];
             break;
         } else {
             int hc_done_so_far = 0;
@@ -485,7 +903,12 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
 
             if (completed_merkle) {
                 /* We're done with this tree */
-#if FAULT_STRATEGY
+                if (signer->temp.do_hyper.merk.failed) {
+                    /* The duplicated hashes disagreed (even after */
+                    /* retrying, with FAULT_STRATEGY 2) */
+                    goto failure_state;
+                }
+#if FAULT_RECOMPUTE
                 /* Note: if we're the very top tree, we don't have to */
                 /* confirm it (as there is no higher level WOTS signature */
                 /* Currently, we check it anyways (as skipping the check */
@@ -495,8 +918,8 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
                     /* Start recomputing the tree */
                     signer->temp.do_hyper.do_tree = 2;
                     init_build_merkle( &signer->temp.do_hyper.merk,
-                               signer->sk_seed, signer->pk_seed,
-                               HASH_TYPE_SHA256|HASH_LEN_192,
+                               &signer->sk_seed_gen, signer->pk_seed,
+                               signer->hash,
                                SPH_T,
                                signer->temp.do_hyper.level,
                                signer->idx_tree,
@@ -523,28 +946,24 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
 
                 }
 #endif
-                /* Accept this root */
-                memcpy( signer->temp.do_hyper.prev_root,
-                        signer->temp.do_hyper.next_root, 24 );
+                /* Accept this root (and, if we saved the tree, we can */
+                /* use it next time) */
+                if (signer->temp.do_hyper.fill) {
+                    signer->temp.do_hyper.fill->valid = true;
+                }
 
                 /* Step to the next higher layer */
-                signer->sphincs_sig_index += SPH_T * 24;
-                signer->idx_leaf = signer->idx_tree & ((1 << SPH_T) - 1);
-                signer->idx_tree >>= SPH_T;
-                signer->temp.do_hyper.do_tree = 0;
-                signer->temp.do_hyper.level++;
-                if (signer->temp.do_hyper.level == SPH_D) {
-                    /* There are no higher levels; we've generated the */
-                    /* full signature */
-                    signer->build_state = b_done;
-                }
+                next_hyper_layer( signer );
             }
         }
         break;
     case b_done:    /* And, we've done the work, now we have a new LMS */
                     /* tree, and the Sphincs+ signature of that tree.  Now */
                     /* switch to using those (so that the next signature */
-                    /* operation will use them) */
+                    /* operation will use them).  We get here only during */
+                    /* the load; when signing, the caller holds the new */
+                    /* tree until the current one is used up, and does */
+                    /* the switch itself */
 #if PROFILE
        /* We're at the end of the run */
        /* Print out the statistics */
@@ -558,25 +977,7 @@ bool step_next( struct sh_signer *signer, bool do_dummy ) {
 #endif
         /* Everything's in place; now switch to the newly generated */
         /* LMS tree and signature */
-        memcpy( signer->current_lms_seed, signer->next_lms_seed, 32 );
-        memcpy( signer->current_lms_I, signer->next_lms_I, 16 );
-        swap( signer->current_lms_top_subtree, signer->next_lms_top_subtree,
-                                                           unsigned char *);
-        swap( signer->current_lms_bottom_subtree,
-                          signer->next_lms_bottom_subtree, unsigned char *);
-         
-        swap( signer->current_sphincs_sig, signer->next_sphincs_sig, 
-                                                          unsigned char *);
-        memcpy( signer->current_lms_pub_key, signer->next_lms_pub_key,
-                                                       LEN_LMS_PUBLIC_KEY );
-#if LMS_FAKE
-        memcpy( signer->current_fake, signer->next_fake, 24 * LMS_FAKE );
-#endif
-            /* We're starting at the begining of the new LMS tree */
-        signer->current_lms_index = 0;
-            /* And the next time, we start all over with creating a new */
-            /* Merkle tree and signature (our work is never done) */
-        signer->build_state = b_init;
+        switch_lms_tree( signer );
 
         /* This step was quite cheap, add a dummy load */
         if (do_dummy) dummy_load( DUMMY_TARGET - 20 );
@@ -604,3 +1005,465 @@ failure_state:
     return true;   /* Signal that we might as well give up if we're in */
                    /* the initialization phase */
 }
+
+void switch_lms_tree( struct sh_signer *signer ) {
+    memcpy( signer->current_lms_seed, signer->next_lms_seed, 32 );
+    signer->current_lms_gen = signer->next_lms_gen;
+    memcpy( signer->current_lms_I, signer->next_lms_I, 16 );
+    swap( signer->current_lms_top_subtree, signer->next_lms_top_subtree,
+                                                       unsigned char *);
+    swap( signer->current_lms_bottom_subtree,
+                      signer->next_lms_bottom_subtree, unsigned char *);
+     
+    swap( signer->current_sphincs_sig, signer->next_sphincs_sig, 
+                                                      unsigned char *);
+    memcpy( signer->current_lms_pub_key, signer->next_lms_pub_key,
+                                                   LEN_LMS_PUBLIC_KEY );
+#if LMS_FAKE
+    memcpy( signer->current_fake, signer->next_fake, 24 * LMS_FAKE );
+#endif
+        /* We're starting at the begining of the new LMS tree */
+    signer->current_lms_index = 0;
+        /* And the next time, we start all over with creating a new */
+        /* Merkle tree and signature (our work is never done) */
+    signer->build_state = b_init;
+}
+
+bool step_next( struct sh_signer *signer, bool do_dummy ) {
+    long start = hash_compression_count;
+    bool done = do_step( signer, do_dummy );
+    SHA256_account( SH_OP_STEP, start );
+    return done;
+}
+
+#if LOAD_THREADS > 1
+/*
+ * This is the parallel version of the build process, used only during the
+ * load (when we don't care about equalizing step sizes; we just want it
+ * done as soon as possible)
+ */
+
+/*
+ * Where we keep the node at the given height and index of the LMS tree
+ * we're building, or 0 if we don't keep it (we keep the top subtree, the
+ * leftmost bottom subtree and the root; that's the layout that sh_sign
+ * expects)
+ */
+static unsigned char *lms_node( struct sh_signer *signer,
+                                int height, unsigned node_id ) {
+    if (height < LMS_BOTTOM) {
+        if (node_id >= (1U << (LMS_BOTTOM-height))) {
+            return 0;  /* Not in the leftmost bottom subtree */
+        }
+        return signer->next_lms_bottom_subtree + 24 * (
+                    node_id + (1 << (LMS_BOTTOM-height)) - 2);
+    }
+    height -= LMS_BOTTOM;
+    if (height < LMS_TOP) {
+        return signer->next_lms_top_subtree + 24 * (
+                    node_id + (1 << (LMS_TOP-height)) - 2);
+    }
+    return signer->next_lms_root;
+}
+
+/*
+ * We split the LMS tree into 2**LMS_SPLIT subtrees (chunks), each of which
+ * a thread builds independently; we make that quite a bit larger than the
+ * number of threads, so that the threads finish at about the same time.
+ * The chunk roots are in the top subtree, so we keep them all
+ */
+#define LMS_SPLIT (LMS_TOP < 6 ? LMS_TOP : 6)
+#define LMS_CHUNK_HEIGHT (LMS_ACTUAL - LMS_SPLIT)
+
+static void build_lms_chunk( void *ctx, unsigned chunk ) {
+    struct sh_signer *signer = ctx;
+    unsigned char stack[LMS_CHUNK_HEIGHT+1][24]; /* The left nodes we're */
+                                 /* waiting to combine with a right node */
+    unsigned first_leaf = chunk << LMS_CHUNK_HEIGHT;
+    unsigned end_leaf = first_leaf + (1 << LMS_CHUNK_HEIGHT);
+    unsigned leaf;
+
+    for (leaf = first_leaf; leaf < end_leaf; leaf += LMS_LEAF_PER_ITER) {
+        unsigned char pub_key[LMS_LEAF_PER_ITER][24];
+        lm_ots_generate_public_keys( signer->next_lms_I, leaf,
+                       LMS_LEAF_PER_ITER, &signer->next_lms_gen, pub_key[0] );
+        int i;
+        for (i=0; i<LMS_LEAF_PER_ITER; i++) {
+            unsigned char *buffer = pub_key[i];
+            int level;
+            unsigned node = leaf + i;
+            unsigned q = node | (1 << LMS_H);
+            for (level = 0;; level++, node >>= 1, q >>= 1) {
+                unsigned char *dest = lms_node( signer, level, node );
+                if (dest) {
+                    memcpy( dest, buffer, 24 );
+                }
+                if (level == LMS_CHUNK_HEIGHT) break; /* That's the root */
+                                                      /* of the chunk */
+                if ((node & 1) == 0) {
+                    /* We're a left node; wait for our sibling */
+                    memcpy( stack[level], buffer, 24 );
+                    break;
+                }
+                lms_combine_internal_nodes( buffer, stack[level], buffer,
+                               signer->next_lms_I, 24, q>>1);
+            }
+        }
+    }
+}
+
+/*
+ * Build the entire LMS tree, leaving us in the b_lms_finished state
+ */
+static void build_lms_parallel( struct sh_signer *signer ) {
+    run_parallel( 1 << LMS_SPLIT, build_lms_chunk, signer );
+
+    /* Now combine the chunk roots into the rest of the top subtree */
+    int height;
+    for (height = LMS_CHUNK_HEIGHT+1; height <= LMS_ACTUAL; height++) {
+        unsigned node;
+        for (node = 0; node < (1U << (LMS_ACTUAL-height)); node++) {
+            lms_combine_internal_nodes( lms_node( signer, height, node ),
+                             lms_node( signer, height-1, 2*node ),
+                             lms_node( signer, height-1, 2*node+1 ),
+                             signer->next_lms_I, 24,
+                             node + (1 << (LMS_H-height)) );
+        }
+    }
+    signer->build_state = b_lms_finished;
+}
+
+/*
+ * The FORS trees depend only on the message digest, and not on each
+ * other, so we build each in its own job.  Each job writes the revealed
+ * leaf and the authentication path directly into that tree's part of
+ * next_sphincs_sig, and the root into its slot of fors_roots
+ *
+ * With FAULT_RECOMPUTE, each tree has a second job (next to it in the job
+ * order, so another thread picks it up at the same time) which does the
+ * redundant computation into a scratch area; we compare the two roots
+ * once both are done.  With FAULT_DUP_LANES, each job checks its own
+ * hashes as it goes, and reports whether they all agreed
+ */
+struct fors_job {
+    struct sh_signer *signer;
+    bool ok[SPH_K];             /* Set if we built this tree without */
+                                /* detecting a fault */
+#if FAULT_RECOMPUTE
+    unsigned count;             /* The number of trees we're building */
+    unsigned tree[SPH_K];       /* Which trees those are */
+    unsigned char check[SPH_K][24];  /* The redundantly computed roots */
+    unsigned char scratch[SPH_K][24 * (1 + SPH_A)]; /* Where the */
+                                /* redundant pass writes its signature */
+#endif
+};
+
+static bool build_fors_tree_once( struct sh_signer *signer, unsigned tree,
+                                  unsigned char *sig, unsigned char *root ) {
+    unsigned char adr[LEN_ADR];
+    set_layer_address( adr, 0 );
+    set_tree_address( adr, signer->idx_tree );
+    set_type( adr, FORS_TREE_ADDRESS );
+    struct private_key_generator gen;
+    init_private_key_gen_from_seed( &gen, &signer->sk_seed_gen, adr,
+                          ADR_CONST_FOR_TREE );
+    set_key_pair_address( adr, signer->idx_leaf );
+    unsigned char h_block[H_SHA256_192_BLOCK_LEN];
+    memcpy( h_block, adr, LEN_ADR );
+    init_H_sha256_192( h_block );
+
+    unsigned char stack[SPH_A*24];
+    unsigned leaf;
+    bool ok = true;
+    for (leaf = 0; ok && leaf < (1 << SPH_A); leaf += FORS_BATCH) {
+        ok = fors_subtree( signer, &gen, adr, tree, sig, leaf,
+                           FORS_BATCH_HEIGHT, root ) &&
+             fors_walk( signer, tree, sig, h_block, stack, leaf,
+                        FORS_BATCH_HEIGHT, root );
+    }
+    zeroize( &gen, sizeof gen );
+    return ok;
+}
+
+static void build_fors_tree( void *ctx, unsigned index ) {
+    struct fors_job *job = ctx;
+    struct sh_signer *signer = job->signer;
+#if FAULT_RECOMPUTE
+    unsigned tree = job->tree[ index / 2 ];
+    if (index & 1) {
+        /* This is the redundant computation */
+        build_fors_tree_once( signer, tree, job->scratch[tree],
+                              job->check[tree] );
+        return;
+    }
+#else
+    unsigned tree = index;
+#endif
+    job->ok[tree] = build_fors_tree_once( signer, tree,
+                 &signer->next_sphincs_sig[
+                     signer->sphincs_sig_index + tree * 24 * (1 + SPH_A) ],
+                 (unsigned char *)
+                     &signer->temp.do_fors.fors_roots[ (24/4) * tree ] );
+}
+
+/*
+ * Build all the FORS trees, leaving us in the b_complete_fors state
+ */
+static bool build_fors_parallel( struct sh_signer *signer ) {
+    struct fors_job job;
+    job.signer = signer;
+
+#if FAULT_RECOMPUTE
+    unsigned i;
+    for (i=0; i<SPH_K; i++) {
+        job.tree[i] = i;
+    }
+    job.count = SPH_K;
+    for (;;) {
+        run_parallel( 2 * job.count, build_fors_tree, &job );
+
+        /* Check if both passes came up with the same roots */
+        unsigned miscomputed = 0;
+        for (i=0; i<job.count; i++) {
+            unsigned tree = job.tree[i];
+            unsigned char *root = (unsigned char *)
+                         &signer->temp.do_fors.fors_roots[ (24/4) * tree ];
+#if FAULT_INJECTION
+            if (fault_injection_fire()) {
+                root[0] ^= 1;  /* Pretend the first pass miscomputed */
+            }
+#endif
+            if (0 != memcmp( job.check[tree], root, 24 )) {
+                job.tree[ miscomputed++ ] = tree;
+            }
+        }
+        if (miscomputed == 0) break;
+#if FAULT_STRATEGY == 2
+        /* We miscomputed, try those trees again */
+        job.count = miscomputed;
+#else
+        /* We miscomputed, give up */
+        return false;
+#endif
+    }
+#else
+    run_parallel( SPH_K, build_fors_tree, &job );
+#endif
+    unsigned k;
+    for (k=0; k<SPH_K; k++) {
+        if (!job.ok[k]) return false;  /* The duplicated hashes disagreed */
+    }
+
+    signer->temp.do_fors.tree = SPH_K;
+    signer->sphincs_sig_index += SPH_K * 24 * (1 + SPH_A);
+    signer->build_state = b_complete_fors;
+    return true;
+}
+
+/*
+ * The Merkle trees in the hypertree depend only on idx_tree and idx_leaf
+ * (which we know once we've computed the message digest); it's only the
+ * WOTS+ signatures that need the root of the layer below.  So we build all
+ * SPH_D trees (their roots and authentication paths) at the same time, and
+ * then do the WOTS+ signatures in a quick sequential pass.  We skip the
+ * trees we have in the hypertree cache
+ *
+ * As with the FORS trees, with FAULT_RECOMPUTE each tree has a second job
+ * that recomputes the root, and we compare at the join
+ */
+struct hyper_job {
+    struct sh_signer *signer;
+    unsigned sig_index;  /* Where the bottom layer goes in the signature */
+    unsigned char root[SPH_D][24];
+    bool ok[SPH_D];      /* Set if we built this tree without detecting */
+                         /* a fault */
+    struct hyper_cache_entry *fill[SPH_D]; /* Where in the cache we're */
+                         /* saving each tree (NULL if we're not) */
+    unsigned count;             /* The number of trees we're building */
+    unsigned level[SPH_D];      /* Which layers those are */
+#if FAULT_RECOMPUTE
+    unsigned char check[SPH_D][24];  /* The redundantly computed roots */
+#endif
+};
+
+/* Where the layer's tree is, and which leaf we sign with */
+static void hyper_position( struct sh_signer *signer, int level,
+                            uint64_t *tree, unsigned *leaf ) {
+    *tree = signer->idx_tree;
+    *leaf = signer->idx_leaf;
+    for (; level > 0; level--) {
+        *leaf = *tree & ((1 << SPH_T) - 1);
+        *tree >>= SPH_T;
+    }
+}
+
+/* Where the layer's authentication path goes in the signature */
+static unsigned char *hyper_auth_path( struct hyper_job *job, int level ) {
+    return &job->signer->next_sphincs_sig[
+                     job->sig_index + level * 24 * (51 + SPH_T) + 51 * 24 ];
+}
+
+static bool build_merkle_tree( struct hyper_job *job, int level,
+                               unsigned char *auth_path,
+                               unsigned char *root,
+                               struct hyper_cache_entry *fill ) {
+    struct sh_signer *signer = job->signer;
+    uint64_t tree;
+    unsigned leaf;
+    hyper_position( signer, level, &tree, &leaf );
+
+    struct build_merkle_state merk;
+    init_build_merkle( &merk, &signer->sk_seed_gen, signer->pk_seed,
+                       signer->hash, SPH_T, level, tree, leaf,
+                       auth_path, root );
+    if (fill) merk.nodes = fill->node[0];
+    while (!step_build_merkle( &merk, 0 )) {
+        ;
+    }
+    return !merk.failed;
+}
+
+static void build_hyper_tree( void *ctx, unsigned index ) {
+    struct hyper_job *job = ctx;
+#if FAULT_RECOMPUTE
+    unsigned level = job->level[ index / 2 ];
+    if (index & 1) {
+        /* This is the redundant computation */
+        build_merkle_tree( job, level, NULL, job->check[level], NULL );
+        return;
+    }
+#else
+    unsigned level = job->level[ index ];
+#endif
+    job->ok[level] = build_merkle_tree( job, level,
+                 hyper_auth_path( job, level ), job->root[level],
+                 job->fill[level] );
+}
+
+/*
+ * Build the entire hypertree signature, leaving us in the b_done state
+ */
+static bool build_hypertree_parallel( struct sh_signer *signer ) {
+    struct hyper_job job;
+    job.signer = signer;
+    job.sig_index = signer->sphincs_sig_index;
+    int level;
+
+    /* Take the trees we've built before from the cache; line up jobs to */
+    /* build the rest */
+    job.count = 0;
+    for (level = 0; level < SPH_D; level++) {
+        uint64_t tree;
+        unsigned leaf;
+        hyper_position( signer, level, &tree, &leaf );
+        struct hyper_cache_entry *cached = hyper_cache_find( signer,
+                                                       level, tree );
+        job.ok[level] = true;
+        job.fill[level] = NULL;
+        if (cached && hyper_cache_use( signer, cached, level, leaf,
+                          hyper_auth_path( &job, level ), job.root[level] )) {
+            continue;
+        }
+        job.fill[level] = hyper_cache_slot( signer, level, tree );
+        job.level[ job.count++ ] = level;
+    }
+
+#if FAULT_RECOMPUTE
+    unsigned i;
+    for (;;) {
+        run_parallel( 2 * job.count, build_hyper_tree, &job );
+
+        /* Check if both passes came up with the same roots */
+        unsigned miscomputed = 0;
+        for (i=0; i<job.count; i++) {
+            level = job.level[i];
+#if FAULT_INJECTION
+            if (fault_injection_fire()) {
+                job.root[level][0] ^= 1;  /* Pretend the first pass */
+                                          /* miscomputed */
+            }
+#endif
+            if (0 != memcmp( job.check[level], job.root[level], 24 )) {
+                job.level[ miscomputed++ ] = level;
+            }
+        }
+        if (miscomputed == 0) break;
+#if FAULT_STRATEGY == 2
+        /* Came up with two different answers: redo those trees */
+        job.count = miscomputed;
+#else
+        /* Came up with two different answers: error */
+        return false;
+#endif
+    }
+#else
+    run_parallel( job.count, build_hyper_tree, &job );
+#endif
+    for (level = 0; level < SPH_D; level++) {
+        if (!job.ok[level]) return false;  /* The duplicated hashes */
+                                           /* disagreed */
+    }
+    /* We've accepted all the roots; the trees we saved can be used */
+    /* next time */
+    for (level = 0; level < SPH_D; level++) {
+        if (job.fill[level]) job.fill[level]->valid = true;
+    }
+
+    /* Now sign each layer's message (the FORS public key at the bottom, */
+    /* the root of the layer below above that) */
+    const unsigned char *msg = signer->temp.do_hyper.prev_root;
+    for (level = 0; level < SPH_D; level++) {
+        uint64_t tree;
+        unsigned leaf;
+        hyper_position( signer, level, &tree, &leaf );
+        if (hypertree_wots_sign( signer, level, tree, leaf, msg,
+               &signer->next_sphincs_sig[ signer->sphincs_sig_index ] ) < 0) {
+            return false;
+        }
+        signer->sphincs_sig_index += (51 + SPH_T) * 24;
+        msg = job.root[level];
+    }
+    memcpy( signer->temp.do_hyper.prev_root, msg, 24 );
+    signer->temp.do_hyper.level = SPH_D;
+    signer->build_state = b_done;
+    return true;
+}
+#endif
+
+bool step_next_load( struct sh_signer *signer ) {
+    long start = hash_compression_count;
+    bool done;
+#if LOAD_THREADS > 1
+    switch (signer->build_state) {
+    case b_init:
+        if (!start_lms_tree( signer )) {
+            signer->got_fatal_error = true;
+            return true;
+        }
+        build_lms_parallel( signer );
+        done = false;
+        break;
+    case b_fors:
+        if (!build_fors_parallel( signer )) {
+            signer->got_fatal_error = true;
+            return true;
+        }
+        done = false;
+        break;
+    case b_hypertree:
+        if (!build_hypertree_parallel( signer )) {
+            signer->got_fatal_error = true;
+            return true;
+        }
+        done = false;
+        break;
+    default:
+        done = do_step( signer, PROFILE );
+        break;
+    }
+#else
+    done = do_step( signer, PROFILE );
+#endif
+    SHA256_account( SH_OP_STEP, start );
+    return done;
+}
@@ -1,6 +1,14 @@
 #include "sphincs-hybrid.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
+
+/* Wall clock time, in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
 
 static bool do_rand( void *buffer, size_t len_buffer ) {
     unsigned char *p = buffer;
@@ -12,9 +20,11 @@ static bool do_rand( void *buffer, size_t len_buffer ) {
 int main(void) {
     unsigned char sk_buffer[1024]; size_t len_sk;
     unsigned char pk_buffer[1024]; size_t len_pk;
-    bool flag =  sh_keygen( 1, 192, 1, do_rand,
+    static unsigned char accel_buffer[LEN_ACCEL_192]; size_t len_accel;
+    bool flag =  sh_keygen_accel( 1, 192, 1, do_rand,
                     sk_buffer, sizeof sk_buffer, &len_sk,
-                    pk_buffer, sizeof pk_buffer, &len_pk);
+                    pk_buffer, sizeof pk_buffer, &len_pk,
+                    accel_buffer, sizeof accel_buffer, &len_accel);
     if (!flag) { printf( "It failed\n" ); return 0; }
 
 #if 0
@@ -31,12 +41,26 @@ int main(void) {
 #endif
 
     printf( "Loading signer\n" );
+    double start = now();
     struct sh_signer *sign = sh_load_signer( sk_buffer, do_rand );
     if (!sign) { printf( "Loading signer failed\n" ); return 0; }
-    printf( "Loaded signer\n" );
+    printf( "Loaded signer (%.3f sec)\n", now() - start );
+    sh_delete_signer(sign);
+
+    /* Now, load it again, this time with the acceleration blob */
+    start = now();
+    sign = sh_load_signer_accel( sk_buffer, accel_buffer, len_accel, do_rand );
+    if (!sign) { printf( "Loading signer failed\n" ); return 0; }
+    printf( "Loaded signer with acceleration blob (%.3f sec)\n",
+            now() - start );
+    printf( "SHA-256 backends: single %s, midstate %s, multi %s\n",
+            sh_get_hash_backend( SH_HASH_SINGLE ),
+            sh_get_hash_backend( SH_HASH_MIDSTATE ),
+            sh_get_hash_backend( SH_HASH_MULTI ) );
 
     int count;
     const char *did_verify = "";
+    start = now();
     for (count = 0; count < 1000000; count++) {
         unsigned char sig[LEN_SIG_192_FAST];
         int r = sh_sign( sig, sizeof sig, sign, "Hello", 5 );
@@ -48,7 +72,8 @@ int main(void) {
         did_verify = "and verified ";
 #endif
     }
-    printf( "Generated %s%d signatures\n", did_verify, count );
+    printf( "Generated %s%d signatures (%.1f usec each)\n", did_verify, count,
+            1e6 * (now() - start) / count );
 
     sh_delete_signer(sign);
 
@@ -0,0 +1,82 @@
+/*
+ * Setup shared by offline_test.c and build_thread_test.c
+ */
+#include "test_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned char pk_buffer[1024];
+unsigned char sig[LEN_SIG_192_FAST];
+static unsigned char sk_buffer[1024];
+static bool have_key;
+
+static bool do_rand( void *buffer, size_t len_buffer ) {
+    unsigned char *p = buffer;
+    int i;
+    for (i=0; i<len_buffer; i++) *p++ = i;
+    return true;
+}
+
+struct sh_signer *test_load_signer( void ) {
+    if (!have_key) {
+        size_t len_sk, len_pk;
+        if (!sh_keygen( 1, 192, 1, do_rand,
+                        sk_buffer, sizeof sk_buffer, &len_sk,
+                        pk_buffer, sizeof pk_buffer, &len_pk)) {
+            printf( "Keygen failed\n" );
+            return 0;
+        }
+        have_key = true;
+    }
+    struct sh_signer *signer = sh_load_signer( sk_buffer, do_rand );
+    if (!signer) {
+        printf( "Loading signer failed\n" );
+        return 0;
+    }
+    if (sh_sig_len( signer ) != sizeof sig) {
+        printf( "Unexpected signature length\n" );
+        sh_delete_signer( signer );
+        return 0;
+    }
+    return signer;
+}
+
+bool test_sign( struct sh_signer *signer, unsigned long count, bool online ) {
+    char message[30];
+    size_t len = sprintf( message, "Message %lu", count );
+    bool ok = online ?
+              sh_sign_online( sig, sizeof sig, signer, message, len ) :
+              sh_sign( sig, sizeof sig, signer, message, len );
+    if (!ok) return false;
+    if (!sh_verify( message, len, sig, sizeof sig, pk_buffer )) {
+        printf( "Signature %lu didn't verify\n", count );
+        exit(1);
+    }
+    return true;
+}
+
+unsigned long get_index( const unsigned char *s ) {
+    const unsigned char *p = s + OFF_LMS_INDEX;
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool track_leaf( struct leaf_tracker *t ) {
+    unsigned long index = get_index( sig );
+    if (!t->started) {
+        memcpy( t->root, sig + OFF_LMS_ROOT, 24 );
+        t->started = true;
+    } else if (0 != memcmp( t->root, sig + OFF_LMS_ROOT, 24 )) {
+        if (t->switched || index != 0) {
+            printf( "Switched LMS trees at leaf %lu\n", index );
+            return false;
+        }
+        memcpy( t->root, sig + OFF_LMS_ROOT, 24 );
+        t->switched = true;
+    } else if (index != t->prev_index + 1) {
+        printf( "Leaf %lu followed leaf %lu\n", index, t->prev_index );
+        return false;
+    }
+    t->prev_index = index;
+    return true;
+}
@@ -0,0 +1,63 @@
+#if !defined( TEST_COMMON_H_ )
+#define TEST_COMMON_H_
+
+/*
+ * Setup shared by the tests that sign through an LMS tree switch
+ * (offline_test.c and build_thread_test.c)
+ */
+#include "sphincs-hybrid.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A (fast) signature is the Sphincs+ signature, then the LMS public key it
+ * signed, then the LMS signature.  We find the latter two by counting back
+ * from the end, using their RFC 8554 formats (with n=24, h=20, and the W=2
+ * LM-OTS parameter set, which has p=101)
+ */
+#define LEN_TEST_LMS_SIG (4 + 4 + (4 + 24 + 24 * 101) + 4 + 24 * 20)
+#define LEN_TEST_LMS_PK  (4 + 4 + 4 + 16 + 24)
+#define OFF_LMS_PK    (LEN_SIG_192_FAST - LEN_TEST_LMS_SIG - LEN_TEST_LMS_PK)
+#define OFF_LMS_ROOT  (OFF_LMS_PK + 4 + 4 + 4 + 16) /* The LMS root */
+#define OFF_LMS_INDEX (OFF_LMS_PK + LEN_TEST_LMS_PK + 4)  /* q in the */
+                                                  /* LMS signature */
+
+#define EXTRA_SIGS 300   /* Signatures we do in the next LMS tree */
+#define MAX_SIGS 100000  /* If we haven't switched LMS trees by then, */
+                         /* something's wrong */
+
+extern unsigned char pk_buffer[1024];
+extern unsigned char sig[LEN_SIG_192_FAST];
+
+/*
+ * Load a signer for our test key (which we generate, into pk_buffer, on
+ * the first call); returns NULL (and says why) on failure
+ */
+struct sh_signer *test_load_signer( void );
+
+/*
+ * Sign the count'th message into sig, with sh_sign (or sh_sign_online, if
+ * online is set); returns false if that failed.  A signature that doesn't
+ * verify fails the test on the spot
+ */
+bool test_sign( struct sh_signer *signer, unsigned long count, bool online );
+
+/* The LMS leaf that the signature in sig used */
+unsigned long get_index( const unsigned char *s );
+
+/*
+ * This follows which LMS tree and leaf each signature used; each must use
+ * the leaf after the one the previous signature did, or (once) the first
+ * leaf of the next LMS tree
+ */
+struct leaf_tracker {
+    bool started;
+    bool switched;                  /* We've moved on to the next LMS tree */
+    unsigned char root[24];         /* The LMS tree we're signing with */
+    unsigned long prev_index;       /* The leaf the last signature used */
+};
+/* Note the signature in sig; returns false (and says why) if it's out of */
+/* order */
+bool track_leaf( struct leaf_tracker *t );
+
+#endif /* TEST_COMMON_H_ */
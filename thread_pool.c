@@ -0,0 +1,92 @@
+/*
+ * This is the fork/join helper we use to build things in parallel during
+ * the load process
+ *
+ * We don't keep threads around between calls; we use this only a handful
+ * of times per load, and each call runs for a good fraction of a second,
+ * so the cost of creating the threads is noise
+ *
+ * The hash compression count is per thread; the threads we create hand
+ * theirs back to the caller (so that sh_hash_count and sh_last_hash_count
+ * see all the work, just as if the caller had done it all)
+ */
+#include "thread_pool.h"
+#include "tune.h"
+
+#if LOAD_THREADS > 1
+#include <pthread.h>
+#include "sha256.h"
+
+struct pool {
+    pthread_mutex_t lock;
+    unsigned next;          /* The next job nobody has picked up yet */
+    unsigned count;
+    void (*job)( void *ctx, unsigned index );
+    void *ctx;
+    long hashes;            /* Hash compressions done by the threads we */
+                            /* created */
+};
+
+/* Each thread (including the caller) grabs jobs until there are none left */
+static void *worker( void *arg ) {
+    struct pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock( &pool->lock );
+        unsigned index = pool->next;
+        if (index < pool->count) pool->next++;
+        pthread_mutex_unlock( &pool->lock );
+        if (index >= pool->count) break;
+
+        pool->job( pool->ctx, index );
+    }
+    return 0;
+}
+
+/* The threads we create also report the hashes they did */
+static void *worker_thread( void *arg ) {
+    struct pool *pool = arg;
+    long start = hash_compression_count;
+    (void)worker( pool );
+    pthread_mutex_lock( &pool->lock );
+    pool->hashes += hash_compression_count - start;
+    pthread_mutex_unlock( &pool->lock );
+    return 0;
+}
+#endif
+
+void run_parallel( unsigned count, void (*job)( void *ctx, unsigned index ),
+                   void *ctx ) {
+#if LOAD_THREADS > 1
+    struct pool pool;
+    if (0 == pthread_mutex_init( &pool.lock, 0 )) {
+        pool.next = 0;
+        pool.count = count;
+        pool.job = job;
+        pool.ctx = ctx;
+        pool.hashes = 0;
+
+        pthread_t thread[LOAD_THREADS-1];
+        int i, num_threads;
+        for (num_threads = 0; num_threads < LOAD_THREADS-1 &&
+                              num_threads+1 < count; num_threads++) {
+            if (0 != pthread_create( &thread[num_threads], 0,
+                                     worker_thread, &pool )) {
+                break;  /* Couldn't create a thread; we'll make do with */
+                        /* the ones we have */
+            }
+        }
+        (void)worker( &pool );
+        for (i = 0; i < num_threads; i++) {
+            pthread_join( thread[i], 0 );
+        }
+        hash_compression_count += pool.hashes;
+        pthread_mutex_destroy( &pool.lock );
+        return;
+    }
+#endif
+    /* Single threaded version */
+    unsigned i;
+    for (i = 0; i < count; i++) {
+        job( ctx, i );
+    }
+}
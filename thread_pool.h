@@ -0,0 +1,20 @@
+#if !defined( THREAD_POOL_H_ )
+#define THREAD_POOL_H_
+
+/*
+ * A minimal fork/join helper, used to spread the initial build of the
+ * LMS tree and Sphincs+ signature (at load time), and bulk key generation,
+ * over several cores
+ *
+ * This runs job( ctx, 0 ), job( ctx, 1 ), ..., job( ctx, count-1 ), using
+ * up to LOAD_THREADS threads (the calling thread is one of them), and
+ * returns once all of them have finished.  The jobs must be independent;
+ * they may run in any order, and at the same time
+ *
+ * If LOAD_THREADS <= 1 (or we can't create threads), the calling thread
+ * just runs all the jobs itself
+ */
+void run_parallel( unsigned count, void (*job)( void *ctx, unsigned index ),
+                   void *ctx );
+
+#endif /* THREAD_POOL_H_ */
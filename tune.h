@@ -81,7 +81,9 @@
  *
  * Costs of this protection:
  * - The load time approximately doubles (FAULT_STRATEGY 1) or quadruples
- *   (FAULT_STRATEGY 2)
+ *   (FAULT_STRATEGY 2).  With LOAD_THREADS > 1, the redundant computations
+ *   during the load run on their own threads, alongside the ones they
+ *   check; with a spare core, that hides most of this cost
  * - The memory consumed by a loaded private key increases somewhat (circa
  *   20k in my experience)
  * It does not increase the signature generation time (surprisingly enough)
@@ -89,6 +91,7 @@
  * Changing this does not modify the signatures, nor does it invalidate any
  * generated public keys
  */
+#if !defined( FAULT_STRATEGY )
 #define FAULT_STRATEGY 0 /* 0 -> we don't add any protection */
                        /* 1 -> we protect against failures; on a detected */
                        /*      failure, we go into an error state */
@@ -96,26 +99,109 @@
                        /*      failure, we attempt a recovery (by */
                        /*      rerunning the steps which came up with */
                        /*      inconsistent results). */
+#endif
 
 /*
- * This defines whether we use OpenSSL to compute SHA-256 hashes, or we use
- * our own implementation.
+ * If FAULT_STRATEGY is nonzero, this selects how we do the redundant
+ * computation.
  *
- * Reasons to use OpenSSL: it's a *lot* faster (>2x in my tests, and that's
- * without the new-fangled SHA-256 instructions; if you do have those, I'd
- * expected the speed-up to be even more extreme).
+ * By default, we recompute later: once we've built a FORS tree or a Merkle
+ * tree of the hypertree, we build it again, and compare the two roots.
  *
- * Reasons to use our own implementation: it has extra instrumentation that
- * counts the number of times you perform a hash compression operation,
- * which is useful during profiling.  Also, it's possible that there is some
- * platform that doesn't provide OpenSSL.
+ * The alternative is to duplicate lanes: the tree builders compute most of
+ * their hashes several at a time with the multi-lane SHA-256 engine, and
+ * here we hand it each hash twice, with the copy placed in a different lane
+ * than the original (so that a fault that hits a single lane can't make
+ * both copies come out wrong the same way); we compare the two results
+ * before we use them.  Strategy 1 goes into the error state on a mismatch;
+ * strategy 2 recomputes just the hashes that disagreed (and gives up only
+ * if they keep disagreeing).
+ *
+ * We still compute each hash twice either way; what duplicating lanes saves
+ * is everything around the hashes (such as generating the private FORS and
+ * WOTS+ values a second time), and it fills lanes that would otherwise sit
+ * idle (the upper levels of a tree have fewer nodes than the engine has
+ * lanes).  It also catches a fault right where it happened, and so on a
+ * recovery, we redo a few hashes rather than an entire tree.
+ *
+ * Changing this does not modify the signatures, nor does it invalidate any
+ * generated public keys
+ */
+#if !defined( FAULT_LANES )
+#define FAULT_LANES 0  /* 0 -> recompute each tree, and compare the roots */
+                       /* 1 -> compute each hash in two different lanes, */
+                       /*      and compare the results */
+#endif
+
+/*
+ * This defines whether OpenSSL is one of the SHA-256 implementations we
+ * can use.  We don't pick the implementation here; instead, we time the
+ * ones we have (OpenSSL, our portable one, the one using the x86 SHA
+ * extensions, and the SIMD multi-buffer ones) the first time we load a key
+ * or verify a signature, and use the fastest (see sha256_backend.c; the
+ * application can also override that choice).  Whichever we use, we count
+ * the number of hash compression operations performed, which is useful
+ * during profiling.
+ *
+ * Reasons to include OpenSSL: on CPUs without the SHA-256 instructions, it's
+ * a *lot* faster than our portable version (>2x in my tests).  We use it
+ * only through EVP, to hash complete messages; it can't resume from a
+ * midstate (which is how we do most of our hashes) that way.
+ *
+ * Reasons not to: it's possible that there is some platform that doesn't
+ * provide OpenSSL.
  *
  * Changing this does not effect the validity of any existing signatures or
  * public/private keys
  */
-#define USE_OPENSSL 1   /* 0 -> Use our own instrumented SHA-256 */
-                        /*      implementation */
-                        /* 1 -> Use the OpenSSL implementation */
+#define USE_OPENSSL 1   /* 0 -> Use only our own SHA-256 implementations */
+                        /* 1 -> Also consider the OpenSSL implementation */
+
+/*
+ * Loading a key means building an entire LMS tree and Sphincs+ signature
+ * before we can sign anything; done one step at a time, that takes a while.
+ * However, the LMS leaves are independent of each other (as are the 14 FORS
+ * trees, and the 8 Merkle trees of the hypertree), and so during the load
+ * (and only then), we can split them over several threads.  With this
+ * set to N > 1, sh_load_signer uses up to N threads (including the one that
+ * called it); the load time then drops roughly in proportion to the number
+ * of cores available.  Once the key is loaded, signature generation is
+ * single threaded, as always.  sh_keygen_many also uses up to N threads,
+ * each generating its own share of the keys.
+ *
+ * This requires pthreads.
+ *
+ * Changing this does not effect the validity of any existing signatures or
+ * public/private keys (the values we compute are the same either way)
+ */
+#if !defined( LOAD_THREADS )
+#define LOAD_THREADS 0  /* 0 or 1 -> load in a single thread */
+                        /* N -> use up to N threads while loading */
+#endif
+
+/*
+ * Normally, each sh_sign call also does one step of building the next LMS
+ * tree and Sphincs+ signature, and computes one leaf of the next bottom LMS
+ * subtree; that's most of the cost of a signature.  With this set, the
+ * application can call sh_start_build_thread once it has loaded a key;
+ * from then on, a thread of that signer's own (optionally pinned to a CPU)
+ * does all that work in the background, and sh_sign is left with just the
+ * LM-OTS signature and copying out the rest.  If signing gets ahead of that
+ * thread (it has used up the current LMS tree before the thread has the
+ * next one ready), sh_sign waits for it (and sh_sign_online fails).
+ *
+ * This pays off only if there's a spare core for that thread.  It
+ * requires pthreads.  (If you'd rather not have another thread, see
+ * sh_sign_online and sh_do_offline_work, which let the application do the
+ * same work at times of its choosing.)
+ *
+ * Changing this does not effect the validity of any existing signatures or
+ * public/private keys
+ */
+#if !defined( BUILD_THREAD )
+#define BUILD_THREAD 0  /* 0 -> sh_sign does the build work itself */
+                        /* 1 -> sh_start_build_thread is available */
+#endif
 
 /*
  * We try to keep most of the step operations to be approximately equal cost
@@ -158,9 +244,7 @@
  *
  * It counts 'expense' as 'number of times we've computed a SHA-256 hash
  * compression operation; because that's the major expense for each step,
- * that serves as a good guide.  However, in order for these stats to be
- * nonzero, we have to have USE_OPENSSL to be 0 (as the OpenSSL code is not
- * instrumented to update these stats).  In addition, for this test run,
+ * that serves as a good guide.  In addition, for this test run,
  * you may want to set KEYGEN_STATEGY to be 0 (so that those are also counted
  * as part of the cost.  Also, during a profile run, you should have only one
  * thread calling this (because the internal profiling datastructures is kept
@@ -187,5 +271,19 @@
  */
 #define DUMP_SIG 0     /* 0 -> don't dump them */
                        /* 1 -> do write them to a file */
+
+/*
+ * This compiles in a hook that allows a test to deliberately corrupt the
+ * result in one lane of a duplicated hash computation (see FAULT_LANES),
+ * or, when we recompute the trees during a load with LOAD_THREADS > 1, one
+ * of the roots we compare, so that it can check that we notice (and, with
+ * FAULT_STRATEGY 2, that we recover).  The Makefile's fault_test target
+ * turns this on for its own builds; there's no reason for it to be on
+ * anywhere else
+ */
+#if !defined( FAULT_INJECTION )
+#define FAULT_INJECTION 0  /* 0 -> no hook */
+                           /* 1 -> include fault_injection_countdown */
+#endif
  
 #endif /* TUNE_H_ */
@@ -12,7 +12,7 @@
 /*
  * Verify a signature
  */
-bool sh_verify( const void *message, size_t len_message,
+static bool do_verify( const void *message, size_t len_message,
                 const void *signature, size_t len_signature,
                 const void *public_key ) {
 
@@ -23,6 +23,9 @@ bool sh_verify( const void *message, size_t len_message,
         /* Check on the parameter set this signature uses */
     if (len_signature < off_lm_pk + 12) return false;
     unsigned n = 24;  /* All defined parameter sets currently use n=24 */
+    hash_t hash = ((const unsigned char *)public_key)[3];  /* The Sphincs+ */
+                      /* hash function; the LMS tree is always SHA-256 */
+    if (hash_len(hash) != n) return false;
     unsigned w;
     unsigned p;
     unsigned ls;
@@ -119,11 +122,13 @@ bool sh_verify( const void *message, size_t len_message,
                                 PBLC_PREFIX_LEN );
 
         int i;
-        unsigned char tmp[ITER_MAX_LEN];
+        unsigned char tmp[ 64 * SHA256_PADDED_BLOCKS(ITER_MAX_LEN) ];
 
-        /* Preset the parts of tmp that don't change */
+        /* Preset the parts of tmp that don't change (including the */
+        /* padding) */
         memcpy( tmp + ITER_I, I, I_LEN );
         put_bigendian( tmp + ITER_Q, lms_leaf, 4 );
+        SHA256_pad_blocks( tmp, ITER_LEN(n), 0 );
 
         unsigned max_digit = (1<<w) - 1;
         const unsigned char *y = lm_ots_sig + 12 + n;
@@ -134,9 +139,8 @@ bool sh_verify( const void *message, size_t len_message,
             unsigned j;
             for (j=a; j<max_digit; j++) {
                 tmp[ITER_J] = j;
-                SHA256_Init(&ctx);
-                SHA256_Update(&ctx, tmp, ITER_LEN(n) );
-                SHA256_Final(tmp + ITER_PREV, &ctx);
+                SHA256_hash_blocks( tmp + ITER_PREV, n, &SHA256_IV, tmp,
+                                    SHA256_PADDED_BLOCKS(ITER_LEN(n)) );
             }
 
             SHA256_Update(&final_ctx, tmp + ITER_PREV, n );
@@ -152,19 +156,20 @@ bool sh_verify( const void *message, size_t len_message,
         unsigned node_num = lms_leaf + (1<<LMS_H);
 
         /* The lowest level leaf hash */
-        unsigned char ots_sig[LEAF_MAX_LEN];
+        unsigned char ots_sig[ 64 * SHA256_PADDED_BLOCKS(LEAF_MAX_LEN) ];
         memcpy( ots_sig + LEAF_I, I, I_LEN );
         put_bigendian( ots_sig + LEAF_R, node_num, 4 );
         SET_D( ots_sig + LEAF_D, D_LEAF );
         memcpy( ots_sig + LEAF_PK, buffer, n );
-        SHA256_Init( &ctx );
-        SHA256_Update( &ctx, ots_sig, LEAF_LEN(n) );
-        SHA256_Final(buffer, &ctx);
+        SHA256_pad_blocks( ots_sig, LEAF_LEN(n), 0 );
+        SHA256_hash_blocks( buffer, n, &SHA256_IV, ots_sig,
+                            SHA256_PADDED_BLOCKS(LEAF_LEN(n)) );
 
         /* Now, walk up the authentication path */
-        unsigned char prehash[ INTR_MAX_LEN ];
+        unsigned char prehash[ 64 * SHA256_PADDED_BLOCKS(INTR_MAX_LEN) ];
         memcpy( prehash + INTR_I, I, I_LEN );
         SET_D( prehash + INTR_D, D_INTR );
+        SHA256_pad_blocks( prehash, INTR_LEN(n), 0 );
         while (node_num > 1) {
             if (node_num % 2) {
                 memcpy( prehash + INTR_PK + 0, y, n );
@@ -176,9 +181,8 @@ bool sh_verify( const void *message, size_t len_message,
             y += n;
             node_num /= 2;
             put_bigendian( prehash + INTR_R, node_num, 4 );
-            SHA256_Init( &ctx );
-            SHA256_Update( &ctx, prehash, INTR_LEN(n) );
-            SHA256_Final(buffer, &ctx);
+            SHA256_hash_blocks( buffer, n, &SHA256_IV, prehash,
+                                SHA256_PADDED_BLOCKS(INTR_LEN(n)) );
         }
     }
 
@@ -199,8 +203,10 @@ bool sh_verify( const void *message, size_t len_message,
                 /* hash the message that was signed (the LMS public key) */
     sphincs_sig += n;
     const unsigned char *s_pk_seed = (unsigned char *)public_key + 4;
-    SHA256_FIRSTBLOCK pk_seed_pre;
-    SHA256_set_first_block( &pk_seed_pre, s_pk_seed, n );
+    struct sphincs_seed pk_seed_pre;
+    if (!init_sphincs_seed( &pk_seed_pre, hash, s_pk_seed )) {
+        return false;  /* Unsupported hash function */
+    }
     
     const unsigned char *s_root = (unsigned char *)public_key + 4 + n;
     /* We use the 192-S parameter set, summarized by these settings */
@@ -219,14 +225,24 @@ bool sh_verify( const void *message, size_t len_message,
     /* revealed FORS digits, and the exact branch in the hypertree that */
     /* the FORS trees hang off of */
     do_compute_digest_index( buffer2, &idx_tree, &idx_leaf,
-               24, r, s_pk_seed, s_root,
+               hash, r, s_pk_seed, &pk_seed_pre, s_root,
                lm_pk, LEN_LMS_PUBLIC_KEY,
                SPH_K, SPH_A, SPH_H, SPH_D);
 
     /* Now, walk up the FORS trees */
     {
         uint32_t fors_roots[SPH_K*(24/4)];
-        unsigned char adr[LEN_ADR];
+        /* For SHA-256/192, we put the roots straight into the T_l block */
+        unsigned char t_block[THASH_SHA256_192_BLOCK_LEN( SPH_K * 24 )];
+        unsigned char *roots = (unsigned char *)fors_roots;
+        if (hash == HASH_SHA256_192) {
+            init_thash_sha256_192( t_block, SPH_K * 24 );
+            roots = t_block + LEN_ADR;
+        }
+        /* The ADR is at the start of the H message block */
+        unsigned char h_block[H_SHA256_192_BLOCK_LEN];
+        unsigned char *adr = h_block;
+        init_H_sha256_192( h_block );
         set_layer_address( adr, 0 );
         set_tree_address( adr, idx_tree );
         set_type( adr, FORS_TREE_ADDRESS );
@@ -235,22 +251,27 @@ bool sh_verify( const void *message, size_t len_message,
         for (i=0; i < SPH_K; i++) {
             int node = buffer2[i];
             node += (i << SPH_A);
-            uint32_t *buffer = &fors_roots[ i * 24/4 ];
+            unsigned char *buffer = &roots[ i * 24 ];
             set_tree_index( adr, node );
             set_tree_height( adr, 0 );
-            do_F( buffer, HASH_TYPE_SHA256 | HASH_LEN_192, &pk_seed_pre, adr,
+            do_F( buffer, hash, &pk_seed_pre, adr,
                  sphincs_sig );
             sphincs_sig += 24;
             int level;
             for (level = 0; level < SPH_A; level++, node >>= 1) {
                 set_tree_index( adr, node >> 1 );
                 set_tree_height( adr, level+1 );
+                const void *left, *right;
                 if (node & 1) {
-                    do_H( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                          &pk_seed_pre, adr, sphincs_sig, buffer );
+                    left = sphincs_sig; right = buffer;
                 } else {
-                    do_H( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                          &pk_seed_pre, adr, buffer, sphincs_sig );
+                    left = buffer; right = sphincs_sig;
+                }
+                if (hash == HASH_SHA256_192) {
+                    do_H_sha256_192( buffer, &pk_seed_pre, h_block,
+                                     left, right );
+                } else {
+                    do_H( buffer, hash, &pk_seed_pre, adr, left, right );
                 }
                 sphincs_sig += n;
              }
@@ -259,14 +280,28 @@ bool sh_verify( const void *message, size_t len_message,
          /* Hash all the roots together to come up with the FORS public key */
          set_type( adr, FORS_TREE_ROOT_COMPRESS );
          set_key_pair_address( adr, idx_leaf );
-         do_thash( buffer, HASH_TYPE_SHA256 | HASH_LEN_192,
-                      &pk_seed_pre, adr, fors_roots, SPH_K * 24 );
+         if (hash == HASH_SHA256_192) {
+             memcpy( t_block, adr, LEN_ADR );
+             do_thash_sha256_192( buffer, &pk_seed_pre,
+                                  t_block, SPH_K * 24 );
+         } else {
+             do_thash( buffer, hash,
+                       &pk_seed_pre, adr, fors_roots, SPH_K * 24 );
+         }
     }
 
         /* Now, step up the hypertree */
     {
         int level;
-        unsigned char adr[LEN_ADR];
+        /* The ADR is at the start of the F message block (and we copy it */
+        /* to the start of the H message block when we get to the tree) */
+        unsigned char f_block[F_SHA256_192_BLOCK_LEN];
+        unsigned char h_block[H_SHA256_192_BLOCK_LEN];
+        unsigned char t_block[THASH_SHA256_192_BLOCK_LEN( 51 * 24 )];
+        unsigned char *adr = f_block;
+        init_F_sha256_192( f_block );
+        init_H_sha256_192( h_block );
+        init_thash_sha256_192( t_block, 51 * 24 );
         for (level = 0; level < SPH_D; level++) {
             unsigned char digits[51];
             expand_wots_digits( digits, 51, buffer, 24 );
@@ -276,34 +311,52 @@ bool sh_verify( const void *message, size_t len_message,
             set_type( adr, WOTS_HASH_ADDRESS );
             set_key_pair_address( adr, idx_leaf );
             uint32_t wots_root[51 * 24/4];
+            /* For SHA-256/192, we step the chains in the T_l block */
+            unsigned char *tops = (unsigned char *)wots_root;
+            if (hash == HASH_SHA256_192) tops = t_block + LEN_ADR;
             int i;
             for (i = 0; i<51; i++) {
-                uint32_t *p = &wots_root[ i * 24/4 ];
+                unsigned char *p = &tops[ i * 24 ];
                 memcpy( p, sphincs_sig, 24 );
                 sphincs_sig += 24;
                 set_chain_address( adr, i );
                 int j;
                 for (j = digits[i]; j < 15; j++) {
                     set_hash_address( adr, j );
-                    do_F( p, HASH_TYPE_SHA256|HASH_LEN_192,
-                          &pk_seed_pre, adr, p );
+                    if (hash == HASH_SHA256_192) {
+                        do_F_sha256_192( p, &pk_seed_pre, f_block, p );
+                    } else {
+                        do_F( p, hash, &pk_seed_pre, adr, p );
+                    }
                 }
             }
             set_type( adr, WOTS_KEY_COMPRESSION );
             set_key_pair_address( adr, idx_leaf );
-            do_thash( buffer, HASH_TYPE_SHA256|HASH_LEN_192, &pk_seed_pre,
-                      adr, wots_root, 24 * 51 );
+            if (hash == HASH_SHA256_192) {
+                memcpy( t_block, adr, LEN_ADR );
+                do_thash_sha256_192( buffer, &pk_seed_pre,
+                                     t_block, 24 * 51 );
+            } else {
+                do_thash( buffer, hash, &pk_seed_pre,
+                          adr, wots_root, 24 * 51 );
+            }
 
-            set_type( adr, HASH_TREE_ADDRESS );
+            memcpy( h_block, adr, LEN_ADR );
+            set_type( h_block, HASH_TREE_ADDRESS );
             for (i = 0; i < SPH_D; i++, idx_leaf >>= 1) {
-                set_tree_height(adr, i+1 );
-                set_tree_index(adr, idx_leaf >> 1 );
+                set_tree_height(h_block, i+1 );
+                set_tree_index(h_block, idx_leaf >> 1 );
+                const void *left, *right;
                 if (idx_leaf & 1) {
-                    do_H(buffer, HASH_TYPE_SHA256|HASH_LEN_192, &pk_seed_pre,
-                             adr, sphincs_sig, buffer );
+                    left = sphincs_sig; right = buffer;
+                } else {
+                    left = buffer; right = sphincs_sig;
+                }
+                if (hash == HASH_SHA256_192) {
+                    do_H_sha256_192( buffer, &pk_seed_pre, h_block,
+                                     left, right );
                 } else {
-                    do_H(buffer, HASH_TYPE_SHA256|HASH_LEN_192, &pk_seed_pre,
-                             adr, buffer, sphincs_sig );
+                    do_H( buffer, hash, &pk_seed_pre, h_block, left, right );
                 }
                 sphincs_sig += 24;
              }
@@ -326,3 +379,15 @@ bool sh_verify( const void *message, size_t len_message,
     }
 }
 
+bool sh_verify( const void *message, size_t len_message,
+                const void *signature, size_t len_signature,
+                const void *public_key ) {
+    /* Pick the fastest SHA-256 implementation (if we haven't already) */
+    SHA256_select_backends();
+
+    long start = hash_compression_count;
+    bool valid = do_verify( message, len_message, signature, len_signature,
+                            public_key );
+    SHA256_account( SH_OP_VERIFY, start );
+    return valid;
+}
@@ -11,9 +11,33 @@
  * issue, we scrub the memory (at least, the parts that have data that would
  * make it possible to forge if it leaked) before releasing it.
  *
- * Now, there's a bunch of things we don't mind being exposed (e.g. internal
- * node values of Merkle trees), so we don't use this everywhere; only where
- * it is needed
+ * Now, there's a bunch of things we don't mind being exposed, so we don't
+ * use this everywhere; only where it is needed.  The rule we follow:
+ * - Secret: private keys (and the generator state and seeds that produce
+ *   them), the DRBG/HMAC state, and intermediate WOTS+/LM-OTS chain values
+ *   (anything below the top of a chain may be below what some future
+ *   signature reveals, and so would allow a forgery).  These are always
+ *   wiped
+ * - Public: the tops of the chains, OTS public keys, Merkle/FORS tree nodes
+ *   and roots, and the message hash (which includes the randomizer that we
+ *   reveal in the signature).  These are not wiped.  Note that a buffer in
+ *   which we step a chain in place ends up holding only the top (or, for a
+ *   signature, the revealed value), and so is public once we're done
+ *
+ * The SHA-256 routines (sha256.c, sha256_multi.c) don't wipe anything, as
+ * most of what they hash is public; the callers that hash secrets do.  The
+ * private key derivation (private_key_gen.c) hashes with
+ * SHA256_multi_secret, which wipes its working state and padding; a
+ * SHA256_CTX belongs to the caller, who wipes it if it hashed a secret with
+ * it.  When we step a chain to sign (lm_ots_generate_signature,
+ * hypertree_wots_sign), each hash overwrites the state of the previous one,
+ * and so what's left once we're done is the revealed value.
+ * lm_ots_generate_signature hashes each step in place, so its message block
+ * ends up with just that too; hypertree_wots_sign copies each value into
+ * its F block, which is left with the value below it, and so it wipes that
+ * block.  What's out of scope: the message schedules inside the compression
+ * functions themselves, whatever the compiler leaves in SIMD registers or
+ * spills, and anything OpenSSL does internally
  *
  * We use this, rather than having routines simply call memset, to avoid
  * potential problems with overenthusiastic optimizers.  Generally, we zeroize
@@ -38,6 +62,16 @@ void zeroize( void *area, size_t len ) {
      * us only one length), we use the same for both
      */
     memset_s( area, len, 0, len );
+#elif defined( __GNUC__ )
+    /*
+     * We do a plain memset (which the compiler does with wide stores), and
+     * then tell the compiler (with an empty asm statement) that something
+     * it can't see reads the area; that means it cannot decide the memset
+     * is dead.  This is much faster than the byte-at-a-time loop below,
+     * which matters as some of our callers run this for every OTS
+     */
+    memset( area, 0, len );
+    __asm__ __volatile__( "" : : "r"(area) : "memory" );
 #else
     /*
      * Fallback code for pre-C11 versions